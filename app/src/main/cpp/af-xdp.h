@@ -0,0 +1,631 @@
+#ifndef AF_XDP_H
+#define AF_XDP_H
+
+// AF_XDP needs the headers of Linux 5.10 or later (XDP links, need-wakeup
+// rings); with older ones, or -DTRANSMIT_NO_XDP, TRANSMIT_XDP is 0 and
+// nothing here is compiled.
+#if defined(__linux__) && !defined(TRANSMIT_NO_XDP) && defined(__has_include)
+#if __has_include(<linux/if_xdp.h>) && __has_include(<linux/bpf.h>)
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+#if defined(XDP_USE_NEED_WAKEUP) && defined(BPF_F_SLEEPABLE)
+#define TRANSMIT_XDP 1
+#endif
+#endif
+#endif
+
+#ifndef TRANSMIT_XDP
+#define TRANSMIT_XDP 0
+#endif
+
+#if TRANSMIT_XDP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <net/if.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/if_link.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+// UDP over raw Ethernet frames through an AF_XDP socket, bypassing the
+// kernel network stack. The frames live in a UMEM area shared with the
+// kernel; four rings pass frame addresses back and forth: fill (empty
+// frames for the kernel to receive into), rx, tx and completion (sent
+// frames coming back).
+//
+// For receiving, a small XDP program is loaded with the bpf() system
+// call (no libbpf): it redirects IPv4/UDP datagrams to the given port
+// into the socket, and passes anything else on to the stack. It stays
+// attached while the socket lives, through a BPF link.
+//
+// The driver's own XDP hook with zero-copy is tried first. Interfaces
+// without driver support (e.g. veth, or mode=skb) fall back to the
+// generic hook, where the kernel copies the frames; that needs nothing
+// of the driver, so it can be tested on a veth pair.
+class XdpSocket {
+ public:
+  struct Config {
+    std::string iface;
+    uint32_t queue = 0;
+    uint32_t frames = 4096;     //< In the UMEM; a power of two
+    uint32_t frame_size = 2048; //< A power of two, 2048 or 4096
+    int rx_port = 0;            //< UDP port to receive; 0 for sending only
+    bool skb_mode = false;      //< Go straight to the generic hook
+  };
+
+  // Offsets of a frame with a 20-byte IPv4 header.
+  enum { ETH_LEN = 14, IP_LEN = 20, UDP_LEN = 8, HEADERS = ETH_LEN + IP_LEN + UDP_LEN };
+
+  explicit XdpSocket(const Config &cfg) : m_cfg(cfg) {
+    if (!cfg.frames || (cfg.frames & (cfg.frames - 1))
+        || (cfg.frame_size != 2048 && cfg.frame_size != 4096))
+      throw std::invalid_argument("XdpSocket: frames must be a power of two, frame size 2048 or 4096");
+    m_ifindex = if_nametoindex(cfg.iface.c_str());
+    if (!m_ifindex)
+      throw std::invalid_argument("XdpSocket: no interface " + cfg.iface);
+
+    try {
+      Open();
+    } catch (...) {
+      Close();
+      throw;
+    }
+  }
+
+  ~XdpSocket() { Close(); }
+
+  int Fd() const { return m_fd; }
+  bool ZeroCopy() const { return m_zerocopy; }
+  bool DriverMode() const { return m_driver_mode; }
+  uint32_t FrameSize() const { return m_cfg.frame_size; }
+
+  // Calls fn(frame, length) for up to max received frames, waiting up to
+  // timeout_ms for the first one. The frame is only valid during the
+  // call. Returns the number of frames, 0 on timeout.
+  template<class Fn>
+  size_t Receive(size_t max, int timeout_ms, Fn fn) {
+    uint32_t ready = Available(m_rx);
+    if (!ready) {
+      if (NeedsWakeup(m_fill) || timeout_ms) {
+        pollfd p = {m_fd, POLLIN, 0};
+        poll(&p, 1, timeout_ms);
+      }
+      ready = Available(m_rx);
+      if (!ready)
+        return 0;
+    }
+    ready = std::min<uint32_t>(ready, uint32_t(max));
+
+    uint32_t at = m_rx.cached_cons;
+    const xdp_desc *rx = static_cast<const xdp_desc *>(m_rx.desc);
+    uint64_t *fill = static_cast<uint64_t *>(m_fill.desc);
+    uint32_t fill_at = Producer(m_fill);
+    for (uint32_t i = 0; i < ready; ++i) {
+      const xdp_desc &d = rx[(at + i) & m_rx.mask];
+      fn(m_umem + d.addr, size_t(d.len));
+      // The fill ring has room for every frame, so the frame goes
+      // straight back.
+      fill[(fill_at + i) & m_fill.mask] = d.addr & ~uint64_t(m_cfg.frame_size - 1);
+    }
+    m_rx.cached_cons = at + ready;
+    Consumer(m_rx)->store(m_rx.cached_cons, std::memory_order_release);
+    ProducerPtr(m_fill)->store(fill_at + ready, std::memory_order_release);
+    return ready;
+  }
+
+  // A free frame to build an outgoing one in, or null if every frame is
+  // in flight; Wait() then waits for the kernel to send some.
+  char *TxFrame() {
+    if (m_free.empty())
+      Reap();
+    if (m_free.empty())
+      return nullptr;
+    return m_umem + m_free.back();
+  }
+
+  // Queues the frame got from TxFrame(), len bytes long. It goes out with
+  // the next Kick().
+  void Send(char *frame, size_t len) {
+    uint64_t addr = uint64_t(frame - m_umem);
+    m_free.pop_back();
+    uint32_t at = Producer(m_tx);
+    xdp_desc &d = static_cast<xdp_desc *>(m_tx.desc)[at & m_tx.mask];
+    d.addr = addr;
+    d.len = uint32_t(len);
+    d.options = 0;
+    ProducerPtr(m_tx)->store(at + 1, std::memory_order_release);
+  }
+
+  // Makes the kernel send what was queued. In copy mode a wakeup sends
+  // at most 32 frames, so it takes as many as the queue needs.
+  void Kick() {
+    uint32_t end = Producer(m_tx), sent = Consumer(m_tx)->load(std::memory_order_acquire);
+    if (sent == end)
+      return;
+    if (m_zerocopy) {
+      if (NeedsWakeup(m_tx))
+        WakeupTx();
+      return;
+    }
+    while (sent != end) {
+      WakeupTx();
+      uint32_t now = Consumer(m_tx)->load(std::memory_order_acquire);
+      if (now == sent)
+        break; // No room in the device queue; the next Kick() retries
+      sent = now;
+    }
+  }
+
+  // Waits up to timeout_ms for the kernel to give back a sent frame.
+  bool Wait(int timeout_ms) {
+    WakeupTx();
+    Reap();
+    if (!m_free.empty())
+      return true;
+    pollfd p = {m_fd, POLLOUT, 0};
+    poll(&p, 1, timeout_ms);
+    Reap();
+    return !m_free.empty();
+  }
+
+  // Kernel counters: frames dropped for a full rx or an empty fill ring.
+  xdp_statistics Statistics() const {
+    xdp_statistics st;
+    memset(&st, 0, sizeof st);
+    socklen_t len = sizeof st;
+    getsockopt(m_fd, SOL_XDP, XDP_STATISTICS, &st, &len);
+    return st;
+  }
+
+  // The address of the interface, network order.
+  static in_addr_t InterfaceAddress(const std::string &iface) {
+    ifreq ifr = InterfaceRequest(iface, SIOCGIFADDR);
+    return reinterpret_cast<sockaddr_in &>(ifr.ifr_addr).sin_addr.s_addr;
+  }
+
+  static void InterfaceMac(const std::string &iface, uint8_t mac[6]) {
+    ifreq ifr = InterfaceRequest(iface, SIOCGIFHWADDR);
+    memcpy(mac, ifr.ifr_hwaddr.sa_data, 6);
+  }
+
+  // Looks the address up in the kernel's ARP table.
+  static bool NeighborMac(in_addr_t ip, const std::string &iface, uint8_t mac[6]) {
+    std::ifstream arp("/proc/net/arp");
+    std::string line;
+    std::getline(arp, line); // Column titles
+    while (std::getline(arp, line)) {
+      std::istringstream in(line);
+      std::string addr, type, flags, hw, mask, dev;
+      in_addr a;
+      if (!(in >> addr >> type >> flags >> hw >> mask >> dev) || dev != iface
+          || inet_pton(AF_INET, addr.c_str(), &a) != 1 || a.s_addr != ip)
+        continue;
+      return ParseMac(hw, mac) && flags != "0x0";
+    }
+    return false;
+  }
+
+  static bool ParseMac(const std::string &text, uint8_t mac[6]) {
+    unsigned b[6];
+    if (sscanf(text.c_str(), "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+      return false;
+    for (int i = 0; i < 6; ++i)
+      mac[i] = uint8_t(b[i]);
+    return true;
+  }
+
+ private:
+  struct Ring {
+    void *map = MAP_FAILED;
+    size_t map_size = 0;
+    uint32_t *producer = nullptr;
+    uint32_t *consumer = nullptr;
+    uint32_t *flags = nullptr;
+    void *desc = nullptr;
+    uint32_t mask = 0;
+    uint32_t cached_cons = 0; //< Of a ring we consume
+  };
+
+  static std::atomic<uint32_t> *ProducerPtr(Ring &r) {
+    return reinterpret_cast<std::atomic<uint32_t> *>(r.producer);
+  }
+  static std::atomic<uint32_t> *Consumer(Ring &r) {
+    return reinterpret_cast<std::atomic<uint32_t> *>(r.consumer);
+  }
+  // Our own index of a ring we produce into.
+  static uint32_t Producer(Ring &r) { return ProducerPtr(r)->load(std::memory_order_relaxed); }
+
+  // Entries a ring we consume has for us.
+  static uint32_t Available(Ring &r) {
+    return ProducerPtr(r)->load(std::memory_order_acquire) - r.cached_cons;
+  }
+
+  static bool NeedsWakeup(Ring &r) {
+    return reinterpret_cast<std::atomic<uint32_t> *>(r.flags)->load(std::memory_order_relaxed)
+           & XDP_RING_NEED_WAKEUP;
+  }
+
+  static ifreq InterfaceRequest(const std::string &iface, unsigned long request) {
+    ifreq ifr;
+    memset(&ifr, 0, sizeof ifr);
+    strncpy(ifr.ifr_name, iface.c_str(), IFNAMSIZ - 1);
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    int res = s == -1 ? -1 : ioctl(s, request, &ifr);
+    if (s != -1)
+      close(s);
+    if (res == -1)
+      throw std::runtime_error("XdpSocket: can't get the address of " + iface + ": "
+                               + strerror(errno));
+    return ifr;
+  }
+
+  void WakeupTx() {
+    if (sendto(m_fd, nullptr, 0, MSG_DONTWAIT, nullptr, 0) == -1 && errno != EAGAIN
+        && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN)
+      Fail("tx wakeup failed");
+  }
+
+  static long Bpf(int cmd, bpf_attr &attr) { return syscall(SYS_bpf, cmd, &attr, sizeof attr); }
+
+  void Fail(const std::string &what) {
+    throw std::runtime_error("XdpSocket: " + what + " on " + m_cfg.iface + ": " + strerror(errno));
+  }
+
+  void Open() {
+    size_t umem_size = size_t(m_cfg.frames) * m_cfg.frame_size;
+    void *umem = mmap(nullptr, umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (umem == MAP_FAILED)
+      Fail("can't map the UMEM");
+    m_umem = static_cast<char *>(umem);
+
+    m_fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (m_fd == -1)
+      Fail("can't create the socket");
+
+    xdp_umem_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.addr = uint64_t(uintptr_t(m_umem));
+    reg.len = umem_size;
+    reg.chunk_size = m_cfg.frame_size;
+    if (setsockopt(m_fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof reg) == -1)
+      Fail("can't register the UMEM");
+
+    // Every ring can hold all the frames, so no ring ever overflows.
+    uint32_t n = m_cfg.frames;
+    bool rx = m_cfg.rx_port != 0;
+    if (setsockopt(m_fd, SOL_XDP, XDP_UMEM_FILL_RING, &n, sizeof n) == -1
+        || setsockopt(m_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &n, sizeof n) == -1
+        || setsockopt(m_fd, SOL_XDP, rx ? XDP_RX_RING : XDP_TX_RING, &n, sizeof n) == -1)
+      Fail("can't size the rings");
+
+    xdp_mmap_offsets off;
+    socklen_t off_len = sizeof off;
+    if (getsockopt(m_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) == -1)
+      Fail("can't get the ring offsets");
+    MapRing(m_fill, off.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t));
+    MapRing(m_comp, off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t));
+    if (rx)
+      MapRing(m_rx, off.rx, XDP_PGOFF_RX_RING, sizeof(xdp_desc));
+    else
+      MapRing(m_tx, off.tx, XDP_PGOFF_TX_RING, sizeof(xdp_desc));
+
+    if (rx) {
+      // All the frames wait in the fill ring.
+      uint64_t *fill = static_cast<uint64_t *>(m_fill.desc);
+      for (uint32_t i = 0; i < n; ++i)
+        fill[i] = uint64_t(i) * m_cfg.frame_size;
+      ProducerPtr(m_fill)->store(n, std::memory_order_release);
+      LoadProgram();
+    } else {
+      for (uint32_t i = n; i > 0; --i)
+        m_free.push_back(uint64_t(i - 1) * m_cfg.frame_size);
+    }
+
+    Bind();
+
+    if (rx) {
+      uint32_t key = m_cfg.queue, value = uint32_t(m_fd);
+      bpf_attr attr;
+      memset(&attr, 0, sizeof attr);
+      attr.map_fd = uint32_t(m_map);
+      attr.key = uint64_t(uintptr_t(&key));
+      attr.value = uint64_t(uintptr_t(&value));
+      if (Bpf(BPF_MAP_UPDATE_ELEM, attr) == -1)
+        Fail("can't add the socket to the XSK map");
+    }
+  }
+
+  // Zero-copy needs the driver's hook; the generic one copies.
+  // A socket only sending has no program, and may try zero-copy anyway.
+  // The kernel lets go of a queue some time after the socket bound to it
+  // is closed, so a busy queue is tried again for a while.
+  void Bind() {
+    uint16_t tries[2] = {uint16_t(XDP_ZEROCOPY), uint16_t(XDP_COPY)};
+    bool zerocopy = !m_cfg.skb_mode && (m_driver_mode || !m_cfg.rx_port);
+    for (int i = zerocopy ? 0 : 1, busy = 0; i < 2; ++i) {
+      sockaddr_xdp sxdp;
+      memset(&sxdp, 0, sizeof sxdp);
+      sxdp.sxdp_family = AF_XDP;
+      sxdp.sxdp_ifindex = m_ifindex;
+      sxdp.sxdp_queue_id = m_cfg.queue;
+      sxdp.sxdp_flags = uint16_t(tries[i] | XDP_USE_NEED_WAKEUP);
+      if (bind(m_fd, reinterpret_cast<sockaddr *>(&sxdp), sizeof sxdp) == 0) {
+        m_zerocopy = tries[i] == XDP_ZEROCOPY;
+        return;
+      }
+      if (errno == EBUSY && busy++ < BIND_BUSY_RETRIES) {
+        usleep(BIND_BUSY_WAIT_US);
+        --i;
+      }
+    }
+    Fail("can't bind the socket to queue " + std::to_string(m_cfg.queue));
+  }
+
+  void MapRing(Ring &r, const xdp_ring_offset &off, uint64_t pgoff, size_t entry) {
+    r.map_size = off.desc + size_t(m_cfg.frames) * entry;
+    r.map = mmap(nullptr, r.map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                 off_t(pgoff));
+    if (r.map == MAP_FAILED)
+      Fail("can't map a ring");
+    char *base = static_cast<char *>(r.map);
+    r.producer = reinterpret_cast<uint32_t *>(base + off.producer);
+    r.consumer = reinterpret_cast<uint32_t *>(base + off.consumer);
+    r.flags = reinterpret_cast<uint32_t *>(base + off.flags);
+    r.desc = base + off.desc;
+    r.mask = m_cfg.frames - 1;
+  }
+
+  // Returns the frames the kernel has sent to the free list.
+  void Reap() {
+    uint32_t done = Available(m_comp);
+    if (!done)
+      return;
+    const uint64_t *comp = static_cast<const uint64_t *>(m_comp.desc);
+    for (uint32_t i = 0; i < done; ++i)
+      m_free.push_back(comp[(m_comp.cached_cons + i) & m_comp.mask]);
+    m_comp.cached_cons += done;
+    Consumer(m_comp)->store(m_comp.cached_cons, std::memory_order_release);
+  }
+
+  static const int BIND_BUSY_RETRIES = 20;
+  static const int BIND_BUSY_WAIT_US = 50000;
+
+  // Placeholder offset of the jumps to the pass label.
+  static const int16_t PASS = 0x7fff;
+
+  static bpf_insn Insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+    bpf_insn i;
+    i.code = code;
+    i.dst_reg = dst & 0xf;
+    i.src_reg = src & 0xf;
+    i.off = off;
+    i.imm = imm;
+    return i;
+  }
+
+  // The redirect program, assembled by hand:
+  //
+  //   if the frame is shorter than the headers, pass
+  //   if not IPv4 with a 20-byte header, UDP, unfragmented, to rx_port: pass
+  //   return bpf_redirect_map(xsks, ctx->rx_queue_index, XDP_PASS)
+  //
+  // The packet fields are loaded in host order, so they are compared
+  // with constants converted to network order.
+  std::vector<bpf_insn> Program() const {
+    enum { R0, R1, R2, R3, R4, R5, R6 };
+    const uint8_t LDX_W = BPF_LDX | BPF_MEM | BPF_W, LDX_H = BPF_LDX | BPF_MEM | BPF_H,
+                  LDX_B = BPF_LDX | BPF_MEM | BPF_B, JNE = BPF_JMP | BPF_JNE | BPF_K;
+    std::vector<bpf_insn> p;
+    p.push_back(Insn(BPF_ALU64 | BPF_MOV | BPF_X, R6, R1, 0, 0));
+    p.push_back(Insn(LDX_W, R2, R1, offsetof(xdp_md, data), 0));
+    p.push_back(Insn(LDX_W, R3, R1, offsetof(xdp_md, data_end), 0));
+    p.push_back(Insn(BPF_ALU64 | BPF_MOV | BPF_X, R4, R2, 0, 0));
+    p.push_back(Insn(BPF_ALU64 | BPF_ADD | BPF_K, R4, 0, 0, HEADERS));
+    p.push_back(Insn(BPF_JMP | BPF_JGT | BPF_X, R4, R3, PASS, 0));
+    p.push_back(Insn(LDX_H, R5, R2, 12, 0));
+    p.push_back(Insn(JNE, R5, 0, PASS, htons(0x0800)));
+    p.push_back(Insn(LDX_B, R5, R2, ETH_LEN, 0));
+    p.push_back(Insn(JNE, R5, 0, PASS, 0x45));
+    p.push_back(Insn(LDX_B, R5, R2, ETH_LEN + 9, 0));
+    p.push_back(Insn(JNE, R5, 0, PASS, IPPROTO_UDP));
+    p.push_back(Insn(LDX_H, R5, R2, ETH_LEN + 6, 0));
+    p.push_back(Insn(BPF_ALU64 | BPF_AND | BPF_K, R5, 0, 0, htons(0x3fff)));
+    p.push_back(Insn(JNE, R5, 0, PASS, 0));
+    p.push_back(Insn(LDX_H, R5, R2, ETH_LEN + IP_LEN + 2, 0));
+    p.push_back(Insn(JNE, R5, 0, PASS, htons(uint16_t(m_cfg.rx_port))));
+    p.push_back(Insn(LDX_W, R2, R6, offsetof(xdp_md, rx_queue_index), 0));
+    p.push_back(Insn(BPF_LD | BPF_DW | BPF_IMM, R1, BPF_PSEUDO_MAP_FD, 0, m_map));
+    p.push_back(Insn(0, 0, 0, 0, 0));
+    p.push_back(Insn(BPF_ALU64 | BPF_MOV | BPF_K, R3, 0, 0, XDP_PASS));
+    p.push_back(Insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+    p.push_back(Insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+    size_t pass = p.size();
+    p.push_back(Insn(BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, XDP_PASS));
+    p.push_back(Insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    // The jumps to PASS are relative to the next instruction.
+    for (size_t i = 0; i < pass; ++i) {
+      if (BPF_CLASS(p[i].code) == BPF_JMP && BPF_OP(p[i].code) != BPF_CALL
+          && BPF_OP(p[i].code) != BPF_EXIT && p[i].off == PASS)
+        p[i].off = int16_t(pass - i - 1);
+    }
+    return p;
+  }
+
+  void LoadProgram() {
+    bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = m_cfg.queue + 1;
+    m_map = int(Bpf(BPF_MAP_CREATE, attr));
+    if (m_map == -1)
+      Fail("can't create the XSK map");
+
+    std::vector<bpf_insn> prog = Program();
+    static const char license[] = "GPL";
+    std::vector<char> log(64 * 1024);
+    memset(&attr, 0, sizeof attr);
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = uint64_t(uintptr_t(prog.data()));
+    attr.insn_cnt = uint32_t(prog.size());
+    attr.license = uint64_t(uintptr_t(license));
+    attr.log_buf = uint64_t(uintptr_t(log.data()));
+    attr.log_size = uint32_t(log.size());
+    attr.log_level = 1;
+    m_prog = int(Bpf(BPF_PROG_LOAD, attr));
+    if (m_prog == -1)
+      throw std::runtime_error(std::string("XdpSocket: the verifier rejected the program: ")
+                               + strerror(errno) + "\n" + log.data());
+
+    // The driver's hook first, unless told otherwise.
+    for (int skb = m_cfg.skb_mode ? 1 : 0; skb < 2; ++skb) {
+      memset(&attr, 0, sizeof attr);
+      attr.link_create.prog_fd = uint32_t(m_prog);
+      attr.link_create.target_ifindex = m_ifindex;
+      attr.link_create.attach_type = BPF_XDP;
+      attr.link_create.flags = skb ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE;
+      m_link = int(Bpf(BPF_LINK_CREATE, attr));
+      if (m_link != -1) {
+        m_driver_mode = !skb;
+        return;
+      }
+    }
+    Fail("can't attach the XDP program (another one attached?)");
+  }
+
+  static void Unmap(Ring &r) {
+    if (r.map != MAP_FAILED)
+      munmap(r.map, r.map_size);
+    r.map = MAP_FAILED;
+  }
+
+  void Close() {
+    // The link detaches the program when closed.
+    for (int *fd: {&m_link, &m_prog, &m_map}) {
+      if (*fd != -1)
+        close(*fd);
+      *fd = -1;
+    }
+    Unmap(m_rx);
+    Unmap(m_tx);
+    Unmap(m_fill);
+    Unmap(m_comp);
+    if (m_fd != -1)
+      close(m_fd);
+    m_fd = -1;
+    if (m_umem)
+      munmap(m_umem, size_t(m_cfg.frames) * m_cfg.frame_size);
+    m_umem = nullptr;
+  }
+
+  Config m_cfg;
+  unsigned m_ifindex = 0;
+  int m_fd = -1;
+  int m_map = -1;
+  int m_prog = -1;
+  int m_link = -1;
+  char *m_umem = nullptr;
+  Ring m_fill, m_comp, m_rx, m_tx;
+  std::vector<uint64_t> m_free; //< Frames free for sending
+  bool m_zerocopy = false;
+  bool m_driver_mode = false;
+};
+
+// Addresses of one end of a UDP flow; all in network order.
+struct XdpEndpoint {
+  uint8_t mac[6];
+  in_addr_t ip;
+  uint16_t port;
+};
+
+// Writes a whole Ethernet/IPv4/UDP frame with the payload to frame, and
+// returns its length. The UDP checksum is left out (0), as IPv4 allows.
+inline size_t XdpBuildUdp(char *frame, const XdpEndpoint &from, const XdpEndpoint &to,
+                          uint16_t ip_id, const char *payload, size_t size) {
+  uint8_t *f = reinterpret_cast<uint8_t *>(frame);
+  memcpy(f, to.mac, 6);
+  memcpy(f + 6, from.mac, 6);
+  f[12] = 0x08;
+  f[13] = 0x00;
+
+  uint8_t *ip = f + XdpSocket::ETH_LEN;
+  uint16_t ip_len = uint16_t(XdpSocket::IP_LEN + XdpSocket::UDP_LEN + size);
+  ip[0] = 0x45;
+  ip[1] = 0;
+  ip[2] = uint8_t(ip_len >> 8);
+  ip[3] = uint8_t(ip_len);
+  ip[4] = uint8_t(ip_id >> 8);
+  ip[5] = uint8_t(ip_id);
+  ip[6] = 0x40; // Don't fragment
+  ip[7] = 0;
+  ip[8] = 64;
+  ip[9] = IPPROTO_UDP;
+  ip[10] = ip[11] = 0;
+  memcpy(ip + 12, &from.ip, 4);
+  memcpy(ip + 16, &to.ip, 4);
+  uint32_t sum = 0;
+  for (int i = 0; i < XdpSocket::IP_LEN; i += 2)
+    sum += uint32_t(ip[i]) << 8 | ip[i + 1];
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  ip[10] = uint8_t(~sum >> 8);
+  ip[11] = uint8_t(~sum);
+
+  uint8_t *udp = ip + XdpSocket::IP_LEN;
+  uint16_t udp_len = uint16_t(XdpSocket::UDP_LEN + size);
+  memcpy(udp, &from.port, 2);
+  memcpy(udp + 2, &to.port, 2);
+  udp[4] = uint8_t(udp_len >> 8);
+  udp[5] = uint8_t(udp_len);
+  udp[6] = udp[7] = 0;
+  memcpy(udp + XdpSocket::UDP_LEN, payload, size);
+  return XdpSocket::HEADERS + size;
+}
+
+// The UDP payload of a received frame, or null if it isn't a whole
+// IPv4/UDP datagram.
+inline const char *XdpUdpPayload(const char *frame, size_t len, size_t &size) {
+  const uint8_t *f = reinterpret_cast<const uint8_t *>(frame);
+  if (len < XdpSocket::HEADERS || f[12] != 0x08 || f[13] != 0x00)
+    return nullptr;
+  const uint8_t *ip = f + XdpSocket::ETH_LEN;
+  size_t ihl = size_t(ip[0] & 0xf) * 4;
+  if ((ip[0] >> 4) != 4 || ihl < XdpSocket::IP_LEN || ip[9] != IPPROTO_UDP
+      || len < XdpSocket::ETH_LEN + ihl + XdpSocket::UDP_LEN)
+    return nullptr;
+  const uint8_t *udp = ip + ihl;
+  size_t udp_len = size_t(udp[4]) << 8 | udp[5];
+  size_t room = len - XdpSocket::ETH_LEN - ihl;
+  if (udp_len < XdpSocket::UDP_LEN || udp_len > room)
+    return nullptr;
+  size = udp_len - XdpSocket::UDP_LEN;
+  return reinterpret_cast<const char *>(udp + XdpSocket::UDP_LEN);
+}
+
+#endif // TRANSMIT_XDP
+
+#endif // AF_XDP_H
@@ -0,0 +1,138 @@
+#ifndef CONGESTION_MONITOR_H
+#define CONGESTION_MONITOR_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+// What the sender should do with its encoder bitrate.
+struct CongestionSignal {
+  enum State { CLEAR, LOADED, CONGESTED };
+
+  State state = CLEAR;
+  int64_t target_bitrate = 0; //< Recommended encoder bitrate [bps]
+  double mbps_bandwidth = 0;  //< Link capacity as estimated by SRT
+  int ms_snd_buf = 0;         //< Unacknowledged timespan in the sender buffer
+  int snd_drops = 0;          //< Packets dropped as too late since the last sample
+  int snd_losses = 0;         //< Packets reported lost since the last sample
+};
+
+// Sender statistics the monitor works on; a subset of CBytePerfMon,
+// so that the monitor can be fed from anything, not only a live socket.
+struct CongestionSample {
+  double mbps_bandwidth = 0;
+  int ms_snd_buf = 0;
+  int64_t pkt_sent_total = 0;
+  int pkt_snd_loss_total = 0;
+  int pkt_snd_drop_total = 0;
+
+  template<class PerfMonType>
+  static CongestionSample From(const PerfMonType &mon) {
+    CongestionSample s;
+    s.mbps_bandwidth = mon.mbpsBandwidth;
+    s.ms_snd_buf = mon.msSndBuf;
+    s.pkt_sent_total = mon.pktSentTotal;
+    s.pkt_snd_loss_total = mon.pktSndLossTotal;
+    s.pkt_snd_drop_total = mon.pktSndDropTotal;
+    return s;
+  }
+};
+
+// Derives a recommended encoder bitrate from the trends of the sender
+// statistics, so that the encoder backs off before SRT has to drop:
+//
+// - any too-late drop means the link can't carry the stream at all:
+//   cut the bitrate down by 30%
+// - the sender buffer filling up over a quarter of the latency, or
+//   the loss rate over 2%, means the link is saturating: go 15% down
+//   and not over 80% of the estimated bandwidth
+// - otherwise after a few clear samples probe up by 5% of the maximum.
+//
+// The callback is called only when the recommendation changes, and not
+// more often than once per min_interval_ms, except for drops, which are
+// reported immediately.
+class CongestionMonitor {
+ public:
+  typedef std::chrono::steady_clock::time_point time_point;
+  typedef std::function<void(const CongestionSignal &)> Callback;
+
+  CongestionMonitor(int64_t max_bitrate, int latency_ms, Callback cb, int min_interval_ms = 500)
+      : m_max_bitrate(max_bitrate), m_latency_ms(latency_ms), m_callback(cb),
+        m_min_interval(min_interval_ms), m_bitrate(max_bitrate) {}
+
+  template<class PerfMonType>
+  void Update(const PerfMonType &mon, time_point now = std::chrono::steady_clock::now()) {
+    Update(CongestionSample::From(mon), now);
+  }
+
+  void Update(const CongestionSample &s, time_point now) {
+    if (!m_primed) {
+      m_prev = s;
+      m_primed = true;
+      return;
+    }
+
+    CongestionSignal sig;
+    sig.mbps_bandwidth = s.mbps_bandwidth;
+    sig.ms_snd_buf = s.ms_snd_buf;
+    sig.snd_drops = s.pkt_snd_drop_total - m_prev.pkt_snd_drop_total;
+    sig.snd_losses = s.pkt_snd_loss_total - m_prev.pkt_snd_loss_total;
+    int64_t sent = s.pkt_sent_total - m_prev.pkt_sent_total;
+    bool buffer_rising = s.ms_snd_buf > m_prev.ms_snd_buf;
+    m_prev = s;
+
+    int64_t capacity = int64_t(s.mbps_bandwidth * 1000000);
+    int64_t bitrate = m_bitrate;
+
+    if (sig.snd_drops > 0) {
+      sig.state = CongestionSignal::CONGESTED;
+      bitrate = bitrate * 7 / 10;
+      m_clear_samples = 0;
+    } else if ((buffer_rising && s.ms_snd_buf * 4 > m_latency_ms)
+        || (sent > 0 && sig.snd_losses * 50 > sent)) {
+      sig.state = CongestionSignal::LOADED;
+      bitrate = bitrate * 85 / 100;
+      if (capacity > 0)
+        bitrate = std::min(bitrate, capacity * 8 / 10);
+      m_clear_samples = 0;
+    } else if (++m_clear_samples >= CLEAR_SAMPLES_TO_PROBE) {
+      bitrate += m_max_bitrate / 20;
+      m_clear_samples = 0;
+    }
+
+    bitrate = std::max(m_max_bitrate / 10, std::min(bitrate, m_max_bitrate));
+    if (bitrate == m_bitrate)
+      return;
+
+    bool urgent = sig.state == CongestionSignal::CONGESTED;
+    if (!urgent && m_reported && now - m_last_report < m_min_interval)
+      return;
+
+    m_bitrate = bitrate;
+    sig.target_bitrate = bitrate;
+    m_last_report = now;
+    m_reported = true;
+    if (m_callback)
+      m_callback(sig);
+  }
+
+  int64_t TargetBitrate() const { return m_bitrate; }
+
+ private:
+  static const int CLEAR_SAMPLES_TO_PROBE = 4;
+
+  int64_t m_max_bitrate;
+  int m_latency_ms;
+  Callback m_callback;
+  std::chrono::milliseconds m_min_interval;
+
+  int64_t m_bitrate;
+  CongestionSample m_prev;
+  bool m_primed = false;
+  int m_clear_samples = 0;
+  bool m_reported = false;
+  time_point m_last_report;
+};
+
+#endif // CONGESTION_MONITOR_H
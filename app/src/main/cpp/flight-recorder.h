@@ -0,0 +1,246 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+// What happened to the last packets of a route, kept in a ring of small
+// fixed records, so that a failure comes with its history. Writing a
+// record is a few stores; the ring is only ever written by the thread
+// driving the route, while a signal on any thread may read it. On a
+// failure the route dumps its ring to a file, and a signal (see
+// InstallSignals) dumps the rings of all the routes.
+//
+// The dump is the raw memory, so that it can be written from a signal
+// handler: a FlightDumpHeader followed by the records from the oldest.
+// The tsc of the records is the caller's counter; the header has two
+// (tsc, CLOCK_MONOTONIC) pairs, from the start and the dump, to convert.
+
+enum FlightKind : uint16_t {
+  FLIGHT_READ = 1,    //< a: size, b: seq
+  FLIGHT_WRITE,       //< a: size, b: seq, c: ticks spent in the send stage
+  FLIGHT_FILTER_DROP, //< a: size, b: seq
+  FLIGHT_SRT_DROP,    //< aux: SrtTarget's drop reason, a: size
+  FLIGHT_SRT_SEND,    //< a: srt_sendmsg2 result, b: msgno
+  FLIGHT_SRT_RECV,    //< a: srt_recvmsg2 result, b: packet sequence, c: msgno
+  FLIGHT_SRT_STATE,   //< a: new SRT_SOCKSTATUS, b: socket
+  FLIGHT_STATS,       //< a: buffered ms, b: lost total, c: dropped total
+};
+
+struct FlightRecord {
+  uint64_t tsc;
+  uint16_t kind;
+  uint16_t aux;
+  int32_t a;
+  int64_t b;
+  int64_t c;
+};
+
+struct FlightDumpHeader {
+  char magic[8];          //< "SRTFLT1"
+  uint32_t record_size;
+  uint32_t route;
+  uint64_t capacity;      //< Records in the ring
+  uint64_t written;       //< Records ever written; the dump has min(written, capacity)
+  uint64_t start_tsc;
+  int64_t start_ns;
+  uint64_t dump_tsc;
+  int64_t dump_ns;
+  char reason[32];
+};
+
+class FlightRecorder {
+ public:
+  // Slots for the recorders a signal dumps; more are recorded, but only
+  // dumped on their own failures.
+  static const int MAX_LIVE = 64;
+
+  // The capacity is rounded up to a power of two.
+  FlightRecorder(size_t capacity, uint32_t route, const std::string &path, uint64_t tsc)
+      : m_ring(RoundUp(capacity)), m_mask(m_ring.size() - 1), m_route(route), m_start_tsc(tsc),
+        m_start_ns(MonotonicNs()) {
+    strncpy(m_path, path.c_str(), sizeof m_path - 1);
+    m_path[sizeof m_path - 1] = 0;
+    for (auto &slot: Live()) {
+      FlightRecorder *none = nullptr;
+      if (slot.compare_exchange_strong(none, this))
+        break;
+    }
+  }
+
+  // Unregisters first, then waits out a signal that may have found the
+  // recorder before, so that the ring is not freed under its dump.
+  ~FlightRecorder() {
+    for (auto &slot: Live()) {
+      FlightRecorder *self = this;
+      if (slot.compare_exchange_strong(self, nullptr))
+        break;
+    }
+    while (Dumping().load())
+      sched_yield();
+  }
+
+  void Add(uint64_t tsc, FlightKind kind, int32_t a, int64_t b = 0, int64_t c = 0,
+           uint16_t aux = 0) {
+    uint64_t written = m_written.load(std::memory_order_relaxed);
+    FlightRecord &r = m_ring[written & m_mask];
+    r.tsc = tsc;
+    r.kind = kind;
+    r.aux = aux;
+    r.a = a;
+    r.b = b;
+    r.c = c;
+    // Orders the record before the count for a signal on this thread;
+    // one on another thread may still catch the newest record half done.
+    std::atomic_signal_fence(std::memory_order_release);
+    m_written.store(written + 1, std::memory_order_relaxed);
+  }
+
+  // Async-signal-safe. Returns false if the file can't be written.
+  bool Dump(const char *reason, uint64_t tsc) const {
+    int fd = open(m_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+      return false;
+
+    FlightDumpHeader h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, "SRTFLT1", 8);
+    h.record_size = sizeof(FlightRecord);
+    h.route = m_route;
+    h.capacity = m_ring.size();
+    h.written = m_written.load(std::memory_order_relaxed);
+    h.start_tsc = m_start_tsc;
+    h.start_ns = m_start_ns;
+    h.dump_tsc = tsc;
+    h.dump_ns = MonotonicNs();
+    strncpy(h.reason, reason, sizeof h.reason - 1);
+
+    // Oldest first: the part after the write position, then the part before.
+    size_t n = m_ring.size(), at = size_t(h.written % n);
+    bool ok = WriteAll(fd, &h, sizeof h);
+    if (h.written >= n)
+      ok = ok && WriteAll(fd, &m_ring[at], (n - at) * sizeof(FlightRecord));
+    ok = ok && WriteAll(fd, &m_ring[0], at * sizeof(FlightRecord));
+    close(fd);
+    return ok;
+  }
+
+  const char *Path() const { return m_path; }
+
+  // Dumps every live recorder on SIGUSR1 and keeps running; on a crash
+  // dumps and lets the signal go on. SIGUSR1 restarts the calls it
+  // interrupts. SIGSEGV runs on the alternate stack of the thread, if it
+  // has one (see UseAltStack), so that a stack overflow is dumped too.
+  static void InstallSignals(uint64_t (*clock)()) {
+    Clock() = clock;
+    UseAltStack();
+    Handle(SIGUSR1, SA_RESTART);
+    Handle(SIGSEGV, SA_RESTART | SA_ONSTACK);
+    Handle(SIGBUS, SA_RESTART);
+    Handle(SIGABRT, SA_RESTART);
+  }
+
+  // Gives the calling thread a stack of its own for the crash handler;
+  // alternate stacks are per thread.
+  static void UseAltStack() {
+    static thread_local std::vector<char> stack;
+    if (!stack.empty())
+      return;
+    stack.resize(std::max<size_t>(SIGSTKSZ, 64 * 1024));
+    stack_t ss;
+    memset(&ss, 0, sizeof ss);
+    ss.ss_sp = stack.data();
+    ss.ss_size = stack.size();
+    if (sigaltstack(&ss, nullptr) == -1)
+      stack.clear();
+  }
+
+ private:
+  std::vector<FlightRecord> m_ring;
+  size_t m_mask;
+  std::atomic<uint64_t> m_written{0}; //< Atomic only not to be torn for a signal
+  uint32_t m_route;
+  uint64_t m_start_tsc;
+  int64_t m_start_ns;
+  char m_path[256];
+
+  static std::atomic<FlightRecorder *> (&Live())[MAX_LIVE] {
+    static std::atomic<FlightRecorder *> live[MAX_LIVE];
+    return live;
+  }
+
+  // Signal handlers in the middle of dumping.
+  static std::atomic<int> &Dumping() {
+    static std::atomic<int> dumping{0};
+    return dumping;
+  }
+
+  static uint64_t (*&Clock())() {
+    static uint64_t (*clock)() = nullptr;
+    return clock;
+  }
+
+  static size_t RoundUp(size_t n) {
+    size_t p = 1;
+    while (p < n)
+      p <<= 1;
+    return p;
+  }
+
+  static int64_t MonotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  static bool WriteAll(int fd, const void *data, size_t size) {
+    const char *p = static_cast<const char *>(data);
+    while (size) {
+      ssize_t n = write(fd, p, size);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      p += n;
+      size -= size_t(n);
+    }
+    return true;
+  }
+
+  static void OnSignal(int sig) {
+    uint64_t tsc = Clock() ? Clock()() : 0;
+    const char *reason = sig == SIGUSR1 ? "signal" : "crash";
+    ++Dumping();
+    for (auto &slot: Live()) {
+      FlightRecorder *r = slot.load();
+      if (r)
+        r->Dump(reason, tsc);
+    }
+    --Dumping();
+    if (sig != SIGUSR1) {
+      Handle(sig, 0, SIG_DFL);
+      raise(sig);
+    }
+  }
+
+  static void Handle(int sig, int flags, void (*handler)(int) = OnSignal) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = handler;
+    sa.sa_flags = flags;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, nullptr);
+  }
+};
+
+#endif // FLIGHT_RECORDER_H
@@ -1,53 +1,157 @@
 #include <jni.h>
 #include <string>
+#include <sstream>
 #include <android/log.h>
 #include <srt/srt.h>
 
+#include "congestion-monitor.h"
+#include "shm-ring.h"
+#include "srt-trace.h"
+#include "usdt-probes.h"
+
 #define  LOG_TAG    "SRTClient"
 
 #define  LOGD(...)  __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
 #define  LOGE(...)  __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 
+// Encoder bitrate the sender starts with and never recommends above.
+static const int64_t MAX_BITRATE = 4000000;
+// Every how many packets the sender statistics are checked for congestion.
+static const int CONGESTION_SAMPLE_PACKETS = 50;
+// Calls into libsrt taking longer than this are logged.
+static const int64_t SRT_SLOW_CALL_US = 20000;
+
+typedef void SrtCongestionHandler(void *opaque, int64_t target_bitrate, int state);
+
+static SrtCongestionHandler *congestion_handler = nullptr;
+static void *congestion_opaque = nullptr;
+
+// Lets a native encoder get the recommended bitrate directly, without
+// going through Java. Called on the sending thread.
+extern "C" void srt_set_congestion_handler(SrtCongestionHandler *handler, void *opaque) {
+    congestion_handler = handler;
+    congestion_opaque = opaque;
+}
+
+// Packet hand-over to a transmit process reading shm://<path>: the ring
+// is created by the reader, the encoder attaches to it and writes one
+// packet per call. Native encoders use these directly, Java ones through
+// MainActivity.shmOpen/shmWrite/shmClose.
+extern "C" void *srt_shm_open(const char *path, int timeout_ms) {
+    try {
+        return ShmRing::Attach(path, timeout_ms);
+    } catch (std::exception &x) {
+        LOGE("srt_shm_open: %s\n", x.what());
+        return nullptr;
+    }
+}
+
+// Returns 0 when written, 1 when the ring stayed full for timeout_ms,
+// -1 when the reader has gone, the packet doesn't fit in a slot or there
+// is no ring.
+extern "C" int srt_shm_write(void *ring, const char *data, size_t size, int timeout_ms) {
+    if (!ring) {
+        LOGE("srt_shm_write: no ring\n");
+        return -1;
+    }
+    try {
+        return static_cast<ShmRing *>(ring)->Write(data, size, timeout_ms);
+    } catch (std::exception &x) {
+        LOGE("srt_shm_write: %s\n", x.what());
+        return -1;
+    }
+}
+
+extern "C" void srt_shm_close(void *ring) {
+    delete static_cast<ShmRing *>(ring);
+}
+
+extern "C"
+JNIEXPORT jlong
+JNICALL
+Java_com_example_srttest_MainActivity_shmOpen(JNIEnv *env, jobject /* this */, jstring path,
+                                              jint timeout_ms) {
+    const char *cpath = env->GetStringUTFChars(path, nullptr);
+    void *ring = srt_shm_open(cpath, timeout_ms);
+    env->ReleaseStringUTFChars(path, cpath);
+    return (jlong) (intptr_t) ring;
+}
+
+extern "C"
+JNIEXPORT jint
+JNICALL
+Java_com_example_srttest_MainActivity_shmWrite(JNIEnv *env, jobject /* this */, jlong ring,
+                                               jbyteArray data, jint length, jint timeout_ms) {
+    if (!ring || length < 0 || length > env->GetArrayLength(data)) {
+        LOGE("shmWrite: no ring or length %d out of the array\n", length);
+        return -1;
+    }
+    // Critical access avoids copying the array out of the Java heap, but
+    // must not block, so only a ring with a free slot is written that way.
+    void *bytes = env->GetPrimitiveArrayCritical(data, nullptr);
+    int status = srt_shm_write((void *) (intptr_t) ring, (const char *) bytes, length, 0);
+    env->ReleasePrimitiveArrayCritical(data, bytes, JNI_ABORT);
+    if (status != 1 || timeout_ms == 0)
+        return status;
+
+    jbyte *elements = env->GetByteArrayElements(data, nullptr);
+    status = srt_shm_write((void *) (intptr_t) ring, (const char *) elements, length, timeout_ms);
+    env->ReleaseByteArrayElements(data, elements, JNI_ABORT);
+    return status;
+}
+
+extern "C"
+JNIEXPORT void
+JNICALL
+Java_com_example_srttest_MainActivity_shmClose(JNIEnv * /* env */, jobject /* this */, jlong ring) {
+    srt_shm_close((void *) (intptr_t) ring);
+}
+
 extern "C"
 JNIEXPORT jstring
 
 JNICALL
 Java_com_example_srttest_MainActivity_stringFromJNI(
         JNIEnv *env,
-        jobject /* this */) {
+        jobject thiz) {
 
     int yes = 1;
     int no = 0;
 
-    int status = srt_startup();
+    srt_trace::Config().slow_us = SRT_SLOW_CALL_US;
+    srt_trace::Config().on_slow = [](const srt_trace::Site &site, int64_t us, int error) {
+        LOGE("%s took %lldus (error %d)\n", site.name, (long long) us, error);
+    };
+
+    int status = SRT_TRACED(srt_startup)();
     if (status != 0) {
         LOGD("%s(%d):Failed \n", __FUNCTION__, __LINE__);
     }
 
-    int client_pollid = srt_epoll_create();
+    int client_pollid = SRT_TRACED(srt_epoll_create)();
     if (client_pollid == SRT_ERROR) {
         LOGD("%s(%d):Failed \n", __FUNCTION__, __LINE__);
     }
 
-    SRTSOCKET  m_client_sock = srt_socket(AF_INET, SOCK_DGRAM, 0);
+    SRTSOCKET  m_client_sock = SRT_TRACED(srt_socket)(AF_INET, SOCK_DGRAM, 0);
 
-    status = srt_setsockopt(m_client_sock, 0, SRTO_SNDSYN, &no, sizeof no); // for async connect
+    status = SRT_TRACED(srt_setsockopt)(m_client_sock, 0, SRTO_SNDSYN, &no, sizeof no); // for async connect
     if (status == SRT_ERROR) {
         LOGD("%s(%d):Failed \n", __FUNCTION__, __LINE__);
     }
 
-    srt_setsockflag(m_client_sock, SRTO_SENDER, &yes, sizeof yes);
+    SRT_TRACED(srt_setsockflag)(m_client_sock, SRTO_SENDER, &yes, sizeof yes);
     if (status == SRT_ERROR) {
         LOGD("%s(%d):Failed \n", __FUNCTION__, __LINE__);
     }
 
-    status = srt_setsockopt(m_client_sock, 0, SRTO_TSBPDMODE, &yes, sizeof yes);
+    status = SRT_TRACED(srt_setsockopt)(m_client_sock, 0, SRTO_TSBPDMODE, &yes, sizeof yes);
     if (status == SRT_ERROR) {
         LOGD("%s(%d):Failed \n", __FUNCTION__, __LINE__);
     }
 
     int epoll_out = SRT_EPOLL_OUT;
-    srt_epoll_add_usock(client_pollid, m_client_sock, &epoll_out);
+    SRT_TRACED(srt_epoll_add_usock)(client_pollid, m_client_sock, &epoll_out);
 
     struct sockaddr_in sa;
     memset(&sa, 0, sizeof sa);
@@ -57,7 +161,7 @@ Java_com_example_srttest_MainActivity_stringFromJNI(
     if (inet_pton(AF_INET, "192.168.1.45", &sa.sin_addr) != 1) {
         LOGD("%s(%d):Failed \n", __FUNCTION__, __LINE__);
         std::string hello = "inet_pton failed";
-        srt_cleanup();
+        SRT_TRACED(srt_cleanup)();
         return env->NewStringUTF(hello.c_str());
     }
 
@@ -65,15 +169,37 @@ Java_com_example_srttest_MainActivity_stringFromJNI(
 
     LOGD("%s(%d):srt_connect\n", __FUNCTION__, __LINE__);
 
-    status = srt_connect(m_client_sock, psa, sizeof sa);
+    status = SRT_TRACED(srt_connect)(m_client_sock, psa, sizeof sa);
+    TRANSMIT_PROBE(jni_connect, m_client_sock, status);
     if (status == SRT_ERROR) {
         LOGD("%s(%d):Failed \n", __FUNCTION__, __LINE__);
         LOGD("srt_connect: %s\n", srt_getlasterror_str());
         std::string hello = "srt_connect failed";
-        srt_cleanup();
+        SRT_TRACED(srt_cleanup)();
         return env->NewStringUTF(hello.c_str());
     }
 
+    jmethodID on_target_bitrate = env->GetMethodID(env->GetObjectClass(thiz),
+                                                   "onTargetBitrate", "(JI)V");
+    if (on_target_bitrate == nullptr) {
+        env->ExceptionClear();
+        LOGD("%s(%d):No onTargetBitrate in Java, native handler only\n", __FUNCTION__, __LINE__);
+    }
+
+    int latency = 120;
+    int latency_len = sizeof latency;
+    SRT_TRACED(srt_getsockopt)(m_client_sock, 0, SRTO_PEERLATENCY, &latency, &latency_len);
+
+    CongestionMonitor monitor(MAX_BITRATE, latency, [&](const CongestionSignal &sig) {
+        LOGD("Congestion: state %d, target bitrate %lld (bw %.2fMb/s, sndbuf %dms, drop %d, loss %d)\n",
+             sig.state, (long long) sig.target_bitrate, sig.mbps_bandwidth, sig.ms_snd_buf,
+             sig.snd_drops, sig.snd_losses);
+        if (congestion_handler)
+            congestion_handler(congestion_opaque, sig.target_bitrate, sig.state);
+        if (on_target_bitrate)
+            env->CallVoidMethod(thiz, on_target_bitrate, (jlong) sig.target_bitrate, (jint) sig.state);
+    });
+
     // Socket readiness for connection is checked by polling on WRITE allowed sockets.
 
     int i = 0;
@@ -85,11 +211,11 @@ Java_com_example_srttest_MainActivity_stringFromJNI(
             int wlen = 2;
             SRTSOCKET write[2];
 
-            status = srt_epoll_wait(client_pollid, read, &rlen,
-                                    write, &wlen,
-                                    (int64_t)-1, // -1 is set for debuging purpose.
+            status = SRT_TRACED(srt_epoll_wait)(client_pollid, read, &rlen,
+                                                write, &wlen,
+                                                (int64_t)-1, // -1 is set for debuging purpose.
                     // in case of production we need to set appropriate value
-                                    0, 0, 0, 0);
+                                                0, 0, 0, 0);
             if (status == SRT_ERROR) {
                 LOGD("%s(%d):Failed \n", __FUNCTION__, __LINE__);
             }
@@ -109,21 +235,35 @@ Java_com_example_srttest_MainActivity_stringFromJNI(
         LOGD("Send packet #%d\n", i);
         char buffer[1316] = {1, 2, 3, 4};
 
-        status = srt_sendmsg(m_client_sock,
-                             buffer,
-                             sizeof buffer,
-                             -1, // infinit ttl
-                             1); // in order must be set to true
+        status = SRT_TRACED(srt_sendmsg)(m_client_sock,
+                                         buffer,
+                                         sizeof buffer,
+                                         -1, // infinit ttl
+                                         1); // in order must be set to true
+        TRANSMIT_PROBE(jni_send, m_client_sock, i, sizeof buffer, status);
         if (status == SRT_ERROR) {
             LOGD("%s(%d):Failed \n", __FUNCTION__, __LINE__);
             LOGD("srt_sendmsg: %s\n", srt_getlasterror_str());
         }
+
+        if (i % CONGESTION_SAMPLE_PACKETS == 0) {
+            SRT_TRACEBSTATS perf;
+            if (SRT_TRACED(srt_bstats)(m_client_sock, &perf, 0) != SRT_ERROR) {
+                TRANSMIT_PROBE(stats_sample, m_client_sock, perf.msSndBuf, perf.pktSndLossTotal,
+                               perf.pktSndDropTotal, int64_t(perf.mbpsBandwidth * 1000));
+                monitor.Update(perf);
+            }
+        }
     }
 
     usleep(1000 * 1000);
     LOGD("%s(%d):usleep\n", __FUNCTION__, __LINE__);
-    srt_epoll_release(client_pollid);
-    srt_cleanup();
+    SRT_TRACED(srt_epoll_release)(client_pollid);
+    SRT_TRACED(srt_cleanup)();
+
+    std::ostringstream calls;
+    srt_trace::Print(calls);
+    LOGD("%s", calls.str().c_str());
 
     LOGD("%s(%d):EXIT\n", __FUNCTION__, __LINE__);
 
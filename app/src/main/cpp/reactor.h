@@ -0,0 +1,221 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+// Include after srt.h: the loop waits with srt_epoll, which takes both
+// SRT and system sockets.
+
+// The socket a Reactor should wait on for a medium.
+struct PollHandle {
+  bool srt; //< SRT socket if true, otherwise a system socket
+  int sock;
+};
+
+// Event loop driving many routes on one thread. Every task runs on the
+// loop thread; a task waiting for a socket registers a one-shot
+// continuation with WhenReady() and returns, so no task ever blocks.
+// With cpu >= 0 the loop thread is meant to be pinned to that core by
+// the setup task, making it one shard of a thread-per-core engine.
+class Reactor {
+ public:
+  typedef std::function<void()> Task;
+
+  // Updated by the loop thread, read by the balancer.
+  struct Stats {
+    std::atomic<size_t> routes{0};
+    std::atomic<size_t> packets{0};
+    std::atomic<size_t> bytes{0};
+    std::atomic<int64_t> busy_ns{0}; //< Time spent outside of epoll wait
+    std::atomic<size_t> migrated_in{0};
+    std::atomic<size_t> migrated_out{0};
+  };
+  Stats stats;
+
+  // The setup task runs first on the loop thread.
+  explicit Reactor(int cpu = -1, Task setup = Task()) : m_cpu(cpu), m_setup(std::move(setup)) {
+    m_eid = srt_epoll_create();
+    if (m_eid < 0)
+      throw std::runtime_error("Reactor: can't create epoll");
+    m_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeup == -1)
+      throw std::runtime_error("Reactor: can't create wakeup eventfd");
+    int events = SRT_EPOLL_IN;
+    srt_epoll_add_ssock(m_eid, m_wakeup, &events);
+    m_thread = std::thread(&Reactor::Run, this);
+  }
+
+  ~Reactor() {
+    m_stop = true;
+    Wakeup();
+    m_thread.join();
+    srt_epoll_release(m_eid);
+    close(m_wakeup);
+  }
+
+  // Runs the task on the loop thread. Can be called from any thread.
+  void Post(Task task) {
+    {
+      std::lock_guard<std::mutex> lk(m_lock);
+      m_posted.push_back(std::move(task));
+    }
+    Wakeup();
+  }
+
+  // Runs the task once the socket is ready for reading or writing.
+  // Loop thread only.
+  void WhenReady(PollHandle h, bool write, Task task) {
+    Waiter &w = m_waiters[Key(h)];
+    (write ? w.on_write : w.on_read) = std::move(task);
+    Update(h, w);
+  }
+
+  // Drops the continuations waiting on the socket. Loop thread only.
+  void Cancel(PollHandle h) {
+    auto i = m_waiters.find(Key(h));
+    if (i == m_waiters.end())
+      return;
+    i->second.on_read = Task();
+    i->second.on_write = Task();
+    Update(h, i->second);
+  }
+
+  int Cpu() const { return m_cpu; }
+
+  // The reactor whose loop runs the calling thread, if any.
+  static Reactor *Current() { return CurrentSlot(); }
+
+ private:
+  struct Waiter {
+    Task on_read;
+    Task on_write;
+    bool registered = false; //< In the epoll set
+  };
+  typedef std::pair<bool, int> WaiterKey;
+
+  static WaiterKey Key(PollHandle h) { return WaiterKey(h.srt, h.sock); }
+
+  static Reactor *&CurrentSlot() {
+    static thread_local Reactor *current = nullptr;
+    return current;
+  }
+
+  void Wakeup() {
+    uint64_t one = 1;
+    if (write(m_wakeup, &one, sizeof one) == -1 && errno != EAGAIN)
+      perror("Reactor: wakeup");
+  }
+
+  void Update(PollHandle h, Waiter &w) {
+    int events = (w.on_read ? SRT_EPOLL_IN : 0) | (w.on_write ? SRT_EPOLL_OUT : 0);
+    if (events == 0) {
+      if (h.srt)
+        srt_epoll_remove_usock(m_eid, h.sock);
+      else
+        srt_epoll_remove_ssock(m_eid, h.sock);
+      m_waiters.erase(Key(h));
+      return;
+    }
+    // Adding again doesn't replace the events: an SRT socket would keep
+    // the old ones, and a system socket fails with EEXIST.
+    if (!w.registered) {
+      if (h.srt)
+        srt_epoll_add_usock(m_eid, h.sock, &events);
+      else
+        srt_epoll_add_ssock(m_eid, h.sock, &events);
+      w.registered = true;
+    } else if (h.srt) {
+      srt_epoll_update_usock(m_eid, h.sock, &events);
+    } else {
+      srt_epoll_update_ssock(m_eid, h.sock, &events);
+    }
+  }
+
+  void Fire(PollHandle h, bool write) {
+    auto i = m_waiters.find(Key(h));
+    if (i == m_waiters.end())
+      return;
+    Task task;
+    std::swap(task, write ? i->second.on_write : i->second.on_read);
+    Update(h, i->second);
+    if (task)
+      task();
+  }
+
+  void Run() {
+    using namespace std::chrono;
+    static const int MAX_EVENTS = 64;
+    SRTSOCKET rd[MAX_EVENTS], wr[MAX_EVENTS];
+    SYSSOCKET lrd[MAX_EVENTS], lwr[MAX_EVENTS];
+
+    CurrentSlot() = this;
+    if (m_setup)
+      m_setup();
+
+    steady_clock::time_point busy_since = steady_clock::now();
+    while (!m_stop) {
+      std::deque<Task> posted;
+      {
+        std::lock_guard<std::mutex> lk(m_lock);
+        posted.swap(m_posted);
+      }
+      for (Task &task: posted)
+        task();
+
+      int rnum = MAX_EVENTS, wnum = MAX_EVENTS, lrnum = MAX_EVENTS, lwnum = MAX_EVENTS;
+      stats.busy_ns += duration_cast<nanoseconds>(steady_clock::now() - busy_since).count();
+      int ready = srt_epoll_wait(m_eid, rd, &rnum, wr, &wnum, 100, lrd, &lrnum, lwr, &lwnum);
+      busy_since = steady_clock::now();
+      // Fails also on timeout, which just means nothing is ready.
+      if (ready < 0)
+        continue;
+
+      for (int i = 0; i < std::min(lrnum, MAX_EVENTS); ++i) {
+        if (lrd[i] == m_wakeup) {
+          // The counter is reset by one read.
+          uint64_t count;
+          if (read(m_wakeup, &count, sizeof count) == -1 && errno != EAGAIN)
+            perror("Reactor: wakeup");
+          continue;
+        }
+        Fire(PollHandle{false, lrd[i]}, false);
+      }
+      for (int i = 0; i < std::min(lwnum, MAX_EVENTS); ++i)
+        Fire(PollHandle{false, lwr[i]}, true);
+      for (int i = 0; i < std::min(rnum, MAX_EVENTS); ++i)
+        Fire(PollHandle{true, rd[i]}, false);
+      for (int i = 0; i < std::min(wnum, MAX_EVENTS); ++i)
+        Fire(PollHandle{true, wr[i]}, true);
+    }
+
+    // Drop the continuations, and with them the routes they hold.
+    m_waiters.clear();
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_posted.clear();
+  }
+
+  int m_cpu;
+  Task m_setup;
+  int m_eid = -1;
+  int m_wakeup = -1; //< eventfd to interrupt the wait
+  std::mutex m_lock;
+  std::deque<Task> m_posted;
+  std::map<WaiterKey, Waiter> m_waiters;
+  std::atomic<bool> m_stop{false};
+  std::thread m_thread;
+};
+
+#endif // REACTOR_H
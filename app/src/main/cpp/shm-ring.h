@@ -0,0 +1,281 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// Single-producer single-consumer ring of packet slots in shared memory,
+// for handing packets between co-located processes (or threads) without
+// a system call per packet. Each side only writes its own index; a side
+// that finds the ring empty or full sleeps on the other's index with a
+// futex, and is woken only if it announced that it sleeps.
+//
+// The consumer creates the ring, the producer attaches to it. A name
+// containing '/' is a file to map (on Android, which has no shm_open,
+// use a file in the app's cache directory); otherwise it's a POSIX
+// shared memory object.
+class ShmRing {
+ public:
+  static const uint32_t MAGIC = 0x53524d52; // "SRMR"
+  static const uint32_t VERSION = 1;
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    alignas(64) std::atomic<uint32_t> head;      //< Next slot to write; producer only
+    std::atomic<uint32_t> producer_waiting;
+    alignas(64) std::atomic<uint32_t> tail;      //< Next slot to read; consumer only
+    std::atomic<uint32_t> consumer_waiting;
+    alignas(64) std::atomic<uint32_t> closed;    //< CLOSED_* bits
+  };
+
+  enum { CLOSED_PRODUCER = 1, CLOSED_CONSUMER = 2 };
+
+  // How long a side sleeps at most before checking for the other side gone.
+  static const int WAIT_MS = 100;
+
+  static ShmRing *Create(const std::string &name, uint32_t slots, uint32_t slot_size) {
+    if (slots == 0 || slot_size == 0)
+      throw std::invalid_argument("ShmRing: slots and slot size must not be 0");
+    size_t size = sizeof(Header) + size_t(slots) * SlotStride(slot_size);
+    int fd = OpenFd(name, O_RDWR | O_CREAT | O_TRUNC);
+    if (ftruncate(fd, size) == -1) {
+      close(fd);
+      throw std::runtime_error("ShmRing: can't size " + name + ": " + strerror(errno));
+    }
+    Header *h = Map(name, fd, size);
+    h->version = VERSION;
+    h->slots = slots;
+    h->slot_size = slot_size;
+    h->head = 0;
+    h->tail = 0;
+    h->producer_waiting = 0;
+    h->consumer_waiting = 0;
+    h->closed = 0;
+    // Published last; the producer waits for it.
+    reinterpret_cast<std::atomic<uint32_t> *>(&h->magic)->store(MAGIC);
+    return new ShmRing(name, fd, size, true, h);
+  }
+
+  // Waits up to timeout_ms for the consumer to create the ring.
+  static ShmRing *Attach(const std::string &name, int timeout_ms) {
+    using namespace std::chrono;
+    steady_clock::time_point deadline = steady_clock::now() + milliseconds(timeout_ms);
+    for (;;) {
+      int fd = OpenFd(name, O_RDWR, false);
+      struct stat st;
+      if (fd != -1 && fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header)) {
+        // Not a ShmRing until the magic is there: dropping it must not
+        // mark the consumer's ring as closed.
+        size_t size = st.st_size;
+        Header *h = Map(name, fd, size);
+        if (reinterpret_cast<std::atomic<uint32_t> *>(&h->magic)->load() == MAGIC) {
+          const char *error = nullptr;
+          if (h->version != VERSION)
+            error = " has an unknown version";
+          else if (h->slots == 0 || size < sizeof(Header) + size_t(h->slots) * SlotStride(h->slot_size))
+            error = " is truncated";
+          if (!error)
+            return new ShmRing(name, fd, size, false, h);
+          munmap(h, size);
+          close(fd);
+          throw std::runtime_error("ShmRing: " + name + error);
+        }
+        munmap(h, size);
+        close(fd);
+      } else if (fd != -1) {
+        close(fd);
+      }
+      if (steady_clock::now() >= deadline)
+        throw std::runtime_error("ShmRing: no consumer created " + name);
+      std::this_thread::sleep_for(milliseconds(WAIT_MS));
+    }
+  }
+
+  ~ShmRing() {
+    m_header->closed |= m_creator ? CLOSED_CONSUMER : CLOSED_PRODUCER;
+    Wake(&m_header->head);
+    Wake(&m_header->tail);
+    munmap(m_header, m_size);
+    close(m_fd);
+    if (m_creator)
+      Unlink(m_name);
+  }
+
+  uint32_t SlotSize() const { return m_slot_size; }
+
+  // Producer side. Returns 0 if the slot was taken, 1 if the ring is
+  // still full after timeout_ms (-1 waits indefinitely) and -1 if the
+  // consumer has gone.
+  int Write(const char *data, size_t size, int timeout_ms = -1) {
+    Header *h = m_header;
+    if (size > m_slot_size)
+      throw std::invalid_argument("ShmRing: packet larger than the slot");
+
+    uint32_t head = h->head.load(std::memory_order_relaxed);
+    if (!WaitFor(h->tail, h->producer_waiting, CLOSED_CONSUMER, timeout_ms,
+                 [&](uint32_t tail) { return head - tail < m_slots; }))
+      return (h->closed & CLOSED_CONSUMER) ? -1 : 1;
+
+    char *slot = Slot(head);
+    uint32_t len = uint32_t(size);
+    memcpy(slot, &len, sizeof len);
+    memcpy(slot + sizeof len, data, size);
+    h->head.store(head + 1);
+    if (h->consumer_waiting.load())
+      Wake(&h->head);
+    return 0;
+  }
+
+  // Consumer side. Returns the size of the packet copied into buf, 0 if
+  // nothing came in timeout_ms and -1 if the producer has gone and the
+  // ring is empty. buf must have room for SlotSize() bytes. Throws on a
+  // length that doesn't fit in a slot, which only a broken producer writes.
+  int Read(char *buf, int timeout_ms = -1) {
+    Header *h = m_header;
+    uint32_t tail = h->tail.load(std::memory_order_relaxed);
+    if (!WaitFor(h->head, h->consumer_waiting, CLOSED_PRODUCER, timeout_ms,
+                 [&](uint32_t head) { return head != tail; }))
+      return (h->closed & CLOSED_PRODUCER) ? -1 : 0;
+
+    const char *slot = Slot(tail);
+    uint32_t len;
+    memcpy(&len, slot, sizeof len);
+    if (len > m_slot_size)
+      throw std::runtime_error("ShmRing: corrupt packet length in " + m_name);
+    memcpy(buf, slot + sizeof len, len);
+    h->tail.store(tail + 1);
+    if (h->producer_waiting.load())
+      Wake(&h->tail);
+    return int(len);
+  }
+
+ private:
+  std::string m_name;
+  int m_fd;
+  size_t m_size;
+  bool m_creator;
+  Header *m_header;
+  // Copies of the geometry, checked against the mapping once; the other
+  // side can still write the shared ones.
+  uint32_t m_slots;
+  uint32_t m_slot_size;
+
+  ShmRing(const std::string &name, int fd, size_t size, bool creator, Header *header)
+      : m_name(name), m_fd(fd), m_size(size), m_creator(creator), m_header(header),
+        m_slots(header->slots), m_slot_size(header->slot_size) {}
+
+  // Closes fd if it can't be mapped.
+  static Header *Map(const std::string &name, int fd, size_t size) {
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("ShmRing: can't map " + name + ": " + strerror(errno));
+    }
+    return static_cast<Header *>(mem);
+  }
+
+  static size_t SlotStride(uint32_t slot_size) {
+    // Length prefix, rounded up to keep the slots cache line aligned.
+    return (sizeof(uint32_t) + slot_size + 63) / 64 * 64;
+  }
+
+  char *Slot(uint32_t index) {
+    return reinterpret_cast<char *>(m_header + 1) + size_t(index % m_slots) * SlotStride(m_slot_size);
+  }
+
+  static bool IsPath(const std::string &name) { return name.find('/') != std::string::npos; }
+
+  static int OpenFd(const std::string &name, int flags, bool required = true) {
+    int fd;
+    if (IsPath(name)) {
+      fd = open(name.c_str(), flags, 0600);
+    } else {
+#ifdef __ANDROID__
+      throw std::invalid_argument("ShmRing: use a file path for " + name + " on Android");
+#else
+      fd = shm_open(("/" + name).c_str(), flags, 0600);
+#endif
+    }
+    if (fd == -1 && required)
+      throw std::runtime_error("ShmRing: can't open " + name + ": " + strerror(errno));
+    return fd;
+  }
+
+  static void Unlink(const std::string &name) {
+    if (IsPath(name))
+      unlink(name.c_str());
+#ifndef __ANDROID__
+    else
+      shm_unlink(("/" + name).c_str());
+#endif
+  }
+
+  // Waits until ready(index) holds for the other side's index, sleeping
+  // on it with waiting set. Gives up when the other side is gone or the
+  // timeout expires. The waiting flag is set before the index is checked
+  // again, and the other side checks the flag after it moved the index,
+  // so one of them always sees the other.
+  template<class Ready>
+  bool WaitFor(std::atomic<uint32_t> &index, std::atomic<uint32_t> &waiting, uint32_t gone,
+               int timeout_ms, Ready ready) {
+    using namespace std::chrono;
+    uint32_t value = index.load(std::memory_order_acquire);
+    if (ready(value))
+      return true;
+
+    steady_clock::time_point deadline = steady_clock::now() + milliseconds(timeout_ms);
+    for (;;) {
+      waiting.store(1);
+      value = index.load();
+      if (ready(value)) {
+        waiting.store(0);
+        return true;
+      }
+      if (m_header->closed & gone) {
+        waiting.store(0);
+        return false;
+      }
+      int wait_ms = WAIT_MS;
+      if (timeout_ms >= 0) {
+        int64_t left = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+        if (left <= 0) {
+          waiting.store(0);
+          return false;
+        }
+        wait_ms = int(std::min<int64_t>(left, WAIT_MS));
+      }
+      Sleep(&index, value, wait_ms);
+    }
+  }
+
+  // The rings are shared between processes, so no FUTEX_PRIVATE_FLAG.
+  static void Sleep(std::atomic<uint32_t> *addr, uint32_t value, int timeout_ms) {
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT, value, &ts, nullptr, 0);
+  }
+
+  static void Wake(std::atomic<uint32_t> *addr) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+  }
+};
+
+#endif // SHM_RING_H
@@ -0,0 +1,186 @@
+#ifndef SRT_TRACE_H
+#define SRT_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+// Timing of the calls into libsrt, so that a stall inside the library can
+// be told from one in our code. A call written as
+//
+//   SRT_TRACED(srt_sendmsg2)(sock, data, size, &mctrl)
+//
+// is counted under its function name with its duration and, if it failed,
+// the SRT error code. Calls slower than the threshold are logged as they
+// happen. Include after srt.h.
+namespace srt_trace {
+
+// Durations in powers of two of microseconds: <1us, <2us, ..., >=2^22us.
+const int BUCKETS = 24;
+// Distinct error codes counted per call; more are counted as "other".
+const int ERROR_CODES = 8;
+
+struct Site {
+  const char *name;
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> total_ns{0};
+  std::atomic<uint64_t> max_ns{0};
+  std::atomic<uint64_t> buckets[BUCKETS];
+  std::atomic<uint64_t> errors{0};
+  std::atomic<int> codes[ERROR_CODES];
+  std::atomic<uint64_t> code_counts[ERROR_CODES];
+
+  explicit Site(const char *n) : name(n) {
+    for (auto &b: buckets)
+      b = 0;
+    for (int i = 0; i < ERROR_CODES; ++i) {
+      codes[i] = 0;
+      code_counts[i] = 0;
+    }
+  }
+
+  void Record(uint64_t ns, int error) {
+    const std::memory_order relaxed = std::memory_order_relaxed;
+    calls.fetch_add(1, relaxed);
+    total_ns.fetch_add(ns, relaxed);
+    uint64_t prev = max_ns.load(relaxed);
+    while (ns > prev && !max_ns.compare_exchange_weak(prev, ns, relaxed))
+      ;
+    int b = 0;
+    for (uint64_t us = ns / 1000; us && b < BUCKETS - 1; us >>= 1)
+      ++b;
+    buckets[b].fetch_add(1, relaxed);
+
+    if (!error)
+      return;
+    errors.fetch_add(1, relaxed);
+    for (int i = 0; i < ERROR_CODES; ++i) {
+      int code = codes[i].load(relaxed);
+      if (code == 0 && codes[i].compare_exchange_strong(code, error))
+        code = error;
+      if (code == error) {
+        code_counts[i].fetch_add(1, relaxed);
+        return;
+      }
+    }
+  }
+};
+
+struct Settings {
+  std::atomic<bool> enabled{true};
+  std::atomic<int64_t> slow_us{0}; //< Calls taking longer are logged; 0 for none
+  // Where the slow calls go; set before the first call. By default stderr.
+  std::function<void(const Site &, int64_t us, int error)> on_slow;
+};
+
+inline Settings &Config() {
+  static Settings settings;
+  return settings;
+}
+
+// The sites in the order of the first call; never removed, so a site
+// found once can be kept by the caller.
+inline std::deque<Site> &Sites(std::unique_lock<std::mutex> &lk) {
+  static std::mutex lock;
+  static std::deque<Site> sites;
+  lk = std::unique_lock<std::mutex>(lock);
+  return sites;
+}
+
+inline Site &Get(const char *name) {
+  std::unique_lock<std::mutex> lk;
+  std::deque<Site> &sites = Sites(lk);
+  for (Site &s: sites)
+    if (std::string(s.name) == name)
+      return s;
+  sites.emplace_back(name);
+  return sites.back();
+}
+
+template<class R>
+bool Failed(R result) { return result == R(SRT_ERROR); }
+
+// Takes the arguments as the function's own parameter types, so that
+// a literal 0 still passes for a null pointer.
+template<class Fn>
+struct Traced;
+
+template<class R, class... Params>
+struct Traced<R (*)(Params...)> {
+  R (*fn)(Params...);
+  Site &site;
+
+  R operator()(Params... args) {
+    Settings &cfg = Config();
+    if (!cfg.enabled.load(std::memory_order_relaxed))
+      return fn(args...);
+
+    using namespace std::chrono;
+    steady_clock::time_point start = steady_clock::now();
+    R result = fn(args...);
+    int64_t ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    int error = Failed(result) ? srt_getlasterror(nullptr) : 0;
+    site.Record(uint64_t(ns), error);
+
+    int64_t slow_us = cfg.slow_us.load(std::memory_order_relaxed);
+    if (slow_us && ns / 1000 >= slow_us) {
+      if (cfg.on_slow)
+        cfg.on_slow(site, ns / 1000, error);
+      else
+        fprintf(stderr, "SRT SLOW: %s took %lldus (error %d)\n", site.name, (long long) (ns / 1000),
+                error);
+    }
+    return result;
+  }
+};
+
+template<class Fn>
+Traced<Fn> Trace(Fn fn, Site &site) { return Traced<Fn>{fn, site}; }
+
+inline void Print(std::ostream &out) {
+  std::unique_lock<std::mutex> lk;
+  for (const Site &s: Sites(lk)) {
+    uint64_t calls = s.calls;
+    if (!calls)
+      continue;
+    out << "SRT CALL " << s.name << ": calls=" << calls << " avg=" << s.total_ns / calls / 1000
+        << "us max=" << s.max_ns / 1000 << "us";
+    for (int b = 0; b < BUCKETS; ++b) {
+      if (!s.buckets[b])
+        continue;
+      if (b < BUCKETS - 1)
+        out << " <" << (1 << b) << "us:" << s.buckets[b];
+      else
+        out << " >=" << (1 << (b - 1)) << "us:" << s.buckets[b];
+    }
+    if (s.errors) {
+      out << " errors=" << s.errors;
+      uint64_t listed = 0;
+      for (int i = 0; i < ERROR_CODES && s.codes[i]; ++i) {
+        out << " [" << s.codes[i] << "]:" << s.code_counts[i];
+        listed += s.code_counts[i];
+      }
+      if (listed < s.errors)
+        out << " [other]:" << s.errors - listed;
+    }
+    out << "\n";
+  }
+  out.flush();
+}
+
+} // namespace srt_trace
+
+// The site is looked up once per place of call.
+#define SRT_TRACED(fn) \
+  srt_trace::Trace(&fn, []() -> srt_trace::Site & { \
+    static srt_trace::Site &site = srt_trace::Get(#fn); \
+    return site; \
+  }())
+
+#endif // SRT_TRACE_H
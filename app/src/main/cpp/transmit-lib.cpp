@@ -8,6 +8,7 @@
 #include <map>
 #include <set>
 #include <vector>
+#include <deque>
 #include <memory>
 #include <algorithm>
 #include <iterator>
@@ -16,6 +17,26 @@
 #include <csignal>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cmath>
+#include <typeinfo>
+#include <type_traits>
+#include <functional>
+#include <sstream>
+#include <future>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#include <sys/eventfd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include <jni.h>
 #include <string>
@@ -28,6 +49,14 @@
 #include <srt/common/appcommon.hpp>
 #include <srt/common/socketoptions.hpp>
 
+#include "congestion-monitor.h"
+#include "shm-ring.h"
+#include "srt-trace.h"
+#include "usdt-probes.h"
+#include "flight-recorder.h"
+#include "reactor.h"
+#include "af-xdp.h"
+
 // FEATURES when undefined or == 2, sets developer mode.
 // When FEATURES == 1, it enforces user mode.
 // In user mode SRT output is disabled.
@@ -65,6 +94,113 @@ using namespace std;
 
 typedef std::vector<char> bytevector;
 
+// A portion of data travelling from a Source to a Target, stamped with
+// the time when it entered the pipeline.
+struct MediaPacket {
+  typedef std::chrono::steady_clock::time_point time_point;
+  bytevector payload;
+  time_point ingest_time;
+
+  uint64_t stamp = 0; //< TscNow() at the last stage boundary it crossed, with -stages
+  uint64_t seq = 0;   //< Order of reading in its route, for the probes
+
+  MediaPacket() {}
+  MediaPacket(bytevector &&data, time_point t) : payload(std::move(data)), ingest_time(t) {}
+
+  int64_t IngestNs() const {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(ingest_time.time_since_epoch()).count();
+  }
+};
+
+class PacketPool;
+
+struct PooledPacket {
+  MediaPacket packet;
+  std::atomic<int> refs{0};
+  PacketPool *pool = nullptr;
+};
+
+// A MediaPacket shared between pipeline stages. Releasing the last
+// reference gives it back to its pool with the payload capacity kept,
+// so that the data path doesn't allocate once it's warmed up.
+class PacketRef {
+  PooledPacket *m_pp = nullptr;
+ public:
+  PacketRef() {}
+  explicit PacketRef(PooledPacket *pp) : m_pp(pp) { ++m_pp->refs; }
+  PacketRef(const PacketRef &r) : m_pp(r.m_pp) {
+    if (m_pp)
+      ++m_pp->refs;
+  }
+  PacketRef(PacketRef &&r) : m_pp(r.m_pp) { r.m_pp = nullptr; }
+  PacketRef &operator=(PacketRef r) {
+    swap(m_pp, r.m_pp);
+    return *this;
+  }
+  ~PacketRef() { reset(); }
+
+  void reset();
+  MediaPacket &operator*() const { return m_pp->packet; }
+  MediaPacket *operator->() const { return &m_pp->packet; }
+  explicit operator bool() const { return m_pp != nullptr; }
+  // Whether this is the only reference, so the packet can be taken apart.
+  bool unique() const { return m_pp && m_pp->refs == 1; }
+};
+
+class PacketPool {
+  std::mutex m_lock;
+  vector<PooledPacket *> m_free;
+  size_t m_in_use = 0;
+  size_t m_peak_in_use = 0;
+ public:
+  PacketRef Get() {
+    PooledPacket *pp;
+    {
+      std::lock_guard<std::mutex> lk(m_lock);
+      if (m_free.empty()) {
+        pp = new PooledPacket;
+        pp->pool = this;
+      } else {
+        pp = m_free.back();
+        m_free.pop_back();
+      }
+      m_peak_in_use = max(m_peak_in_use, ++m_in_use);
+    }
+    return PacketRef(pp);
+  }
+
+  void Release(PooledPacket *pp) {
+    pp->packet.payload.clear();
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_free.push_back(pp);
+    --m_in_use;
+  }
+
+  // Packets taken and not yet released, that is, in all the queues
+  // between the stages together.
+  size_t InUse() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    return m_in_use;
+  }
+
+  size_t PeakInUse() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    return m_peak_in_use;
+  }
+
+  ~PacketPool() {
+    for (PooledPacket *pp: m_free)
+      delete pp;
+  }
+};
+
+inline void PacketRef::reset() {
+  if (m_pp && --m_pp->refs == 0)
+    m_pp->pool->Release(m_pp);
+  m_pp = nullptr;
+}
+
 // This is based on codes taken from <sys/syslog.h>
 // This is POSIX standard, so it's not going to change.
 // Haivision standard only adds one more severity below
@@ -197,7 +333,22 @@ unique_ptr<Base> CreateMedium(const string &uri);
 
 class Source {
  public:
-  virtual bytevector Read(size_t chunk) = 0;
+  // Reads up to chunk bytes into data, reusing its capacity; data is
+  // left empty when nothing could be read.
+  virtual void Read(size_t chunk, bytevector &data) = 0;
+  bytevector Read(size_t chunk) {
+    bytevector data;
+    Read(chunk, data);
+    return data;
+  }
+  // Appends to batch the packets that can be read at once, up to max,
+  // but at least one. Sources that can't tell what's available read one.
+  virtual void ReadBatch(size_t chunk, size_t max, PacketPool &pool, vector<PacketRef> &batch) {
+    (void) max;
+    PacketRef packet = pool.Get();
+    Read(chunk, packet->payload);
+    batch.push_back(std::move(packet));
+  }
   virtual bool IsOpen() = 0;
   virtual bool End() = 0;
   static unique_ptr<Source> Create(const string &url) {
@@ -209,14 +360,42 @@ class Source {
 class Target {
  public:
   virtual void Write(const bytevector &portion) = 0;
+  // Targets that care how long the data spent in the pipeline override this.
+  virtual void Write(const MediaPacket &packet) { Write(packet.payload); }
+  // Targets that keep the packet beyond the call take a reference.
+  virtual void Write(const PacketRef &packet) { Write(*packet); }
+  // Sends out what the target may have held back to send in one go;
+  // called when the source has nothing more at hand.
+  virtual void Flush() {}
   virtual bool IsOpen() = 0;
   virtual bool Broken() = 0;
   static unique_ptr<Target> Create(const string &url) {
     return CreateMedium<Target>(url);
   }
+  // More than one url makes a tee.
+  static unique_ptr<Target> Create(const vector<string> &urls);
   virtual ~Target() {}
 };
 
+// Media that can be driven by a Reactor. The Try* calls never block:
+// they return false when the medium isn't ready, and the reactor then
+// waits on the socket from Poll() before trying again.
+class AsyncSource {
+ public:
+  virtual void SetNonBlocking() {}
+  virtual PollHandle Poll() = 0;
+  virtual bool TryRead(size_t chunk, bytevector &data) = 0;
+  virtual ~AsyncSource() {}
+};
+
+class AsyncTarget {
+ public:
+  virtual void SetNonBlocking() {}
+  virtual PollHandle Poll() = 0;
+  virtual bool TryWrite(const MediaPacket &packet) = 0;
+  virtual ~AsyncTarget() {}
+};
+
 
 map<string, string> g_options;
 
@@ -237,6 +416,64 @@ ostream *cverb = &cout;
 bool bidirectional = false;
 unsigned srt_maxlossttl = 0;
 unsigned stats_report_freq = 0;
+unsigned autobuf_headroom = 0; // [%]; 0 means buffer auto-sizing is off
+int64_t stream_bitrate = 0; // [bps], as given by -b; a hint for buffer auto-sizing
+size_t tee_queue_limit = 1024; // [packets] waiting for a single output of a tee
+size_t read_block_size = 256 * 1024; // [bytes] read at once from files and the console
+bool ts_align = false; // cut byte streams into whole TS packets
+bool stage_stats = true; // time the stages of every packet (-stages)
+size_t flight_records = 8192; // [records] kept per route for a dump on failure; 0 for none
+string flight_dir = "."; // where the flight recorders are dumped
+int spin_us = 0; // [us] of non-blocking tries before a read or wait blocks (-lowlatency)
+vector<int> pin_cpus; // cores for the data path threads, taken in turn (-cpus)
+int rt_priority = 0; // SCHED_FIFO priority of the data path threads, 0 for none (-rtprio)
+
+// With -lowlatency keeps calling try_once, which returns true when it got
+// a result, for up to spin_us, so that data arriving within that time
+// don't pay for a wakeup. Returns false if the caller still has to block.
+template<class TryOnce>
+bool SpinFor(TryOnce try_once) {
+  using namespace std::chrono;
+  if (!spin_us)
+    return false;
+  steady_clock::time_point deadline = steady_clock::now() + microseconds(spin_us);
+  do {
+    if (try_once())
+      return true;
+  } while (steady_clock::now() < deadline);
+  return false;
+}
+
+bool PinToCpu(int cpu) {
+  // Android has no pthread_setaffinity_np; pid 0 means the calling thread.
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof set, &set) == 0;
+}
+
+std::atomic<size_t> next_pin_cpu{0};
+
+// Moves the calling data path thread to the next of the -cpus cores, and
+// with -rtprio to real-time scheduling.
+void PinThread(const char *role) {
+  if (!pin_cpus.empty()) {
+    int cpu = pin_cpus[next_pin_cpu++ % pin_cpus.size()];
+    if (!PinToCpu(cpu))
+      cout << "WARNING: can't pin the " << role << " thread to cpu " << cpu << endl;
+    else if (transmit_verbose)
+      cout << "NOTE: " << role << " thread on cpu " << cpu << endl;
+  }
+  if (rt_priority) {
+    sched_param sp;
+    sp.sched_priority = rt_priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1)
+      cout << "WARNING: can't set SCHED_FIFO for the " << role << " thread: " << strerror(errno)
+           << endl;
+  }
+  if (flight_records)
+    FlightRecorder::UseAltStack();
+}
 
 void OnINT_SetIntState(int) {
   cerr << "\n-------- REQUESTED INTERRUPT!\n";
@@ -310,1021 +547,4101 @@ struct BandwidthGuard {
   }
 };
 
-int bw_report = 0;
+// Exponentially weighted moving average of a byte rate. Bytes are
+// accumulated per packet and folded into the average whenever Sample()
+// is called, with the weight depending on the time elapsed, so that an
+// irregular sampling doesn't skew the result.
+struct RateEstimator {
+  typedef std::chrono::steady_clock::time_point time_point;
+  double time_constant_ms;
+  double rate = 0; //< [B/s]
+  size_t bytes = 0;
+  time_point last_sample;
+  bool primed = false;
 
-extern "C" void TestLogHandler(void *opaque,
-                               int level,
-                               const char *file,
-                               int line,
-                               const char *area,
-                               const char *message);
+  RateEstimator(double tc_ms = 1000)
+      : time_constant_ms(tc_ms), last_sample(std::chrono::steady_clock::now()) {}
 
-int main(int argc, char **argv) {
-  // This is mainly required on Windows to initialize the network system,
-  // for a case when the instance would use UDP. SRT does it on its own, independently.
-  if (!SysInitializeNetwork())
-    throw std::runtime_error("Can't initialize network!");
+  void Add(size_t size) { bytes += size; }
 
-  // Symmetrically, this does a cleanup; put into a local destructor to ensure that
-  // it's called regardless of how this function returns.
-  struct NetworkCleanup {
-    ~NetworkCleanup() {
-      SysCleanupNetwork();
+  double Sample(time_point now) {
+    using namespace std::chrono;
+    double elapsed_ms = duration_cast<microseconds>(now - last_sample).count() / 1000.0;
+    if (elapsed_ms <= 0)
+      return rate;
+
+    double current = bytes * 1000.0 / elapsed_ms;
+    if (primed) {
+      double alpha = 1 - exp(-elapsed_ms / time_constant_ms);
+      rate += alpha * (current - rate);
+    } else {
+      rate = current;
+      primed = true;
     }
-  } cleanupobj;
-
-  vector<string> args;
-  copy(argv + 1, argv + argc, back_inserter(args));
 
-  // Check options
-  vector<string> params;
+    bytes = 0;
+    last_sample = now;
+    return rate;
+  }
+};
 
-  for (string a: args) {
-    if (a[0] == '-') {
-      string key = a.substr(1);
-      size_t pos = key.find(':');
-      if (pos == string::npos)
-        pos = key.find(' ');
-      string value = pos == string::npos ? "" : key.substr(pos + 1);
-      key = key.substr(0, pos);
-      g_options[key] = value;
-      continue;
-    }
+// Counts of durations in logarithmic buckets (1-2-5 steps from 100us
+// to 10s), cheap enough to be filled for every packet.
+struct LatencyHistogram {
+  enum { BUCKETS = 17 };
+  size_t counts[BUCKETS] = {};
+  int64_t max_us = 0;
+
+  static const int64_t *Bounds() {
+    static const int64_t bounds[BUCKETS - 1] = {
+        100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000,
+        200000, 500000, 1000000, 2000000, 5000000, 10000000
+    };
+    return bounds;
+  }
 
-    params.push_back(a);
+  void Add(int64_t us) {
+    const int64_t *bounds = Bounds();
+    int i = int(upper_bound(bounds, bounds + BUCKETS - 1, us) - bounds);
+    ++counts[i];
+    max_us = max(max_us, us);
   }
 
-  if (params.size() != 2) {
-    cerr << "Usage: " << argv[0] << " [options] <input-uri> <output-uri>\n";
-    cerr << "\t-t:<timeout=0> - connection timeout\n";
-    cerr << "\t-c:<chunk=1316> - max size of data read in one step\n";
-    cerr << "\t-b:<bandwidth> - set SRT bandwidth\n";
-    cerr << "\t-r:<report-frequency=0> - bandwidth report frequency\n";
-    cerr << "\t-s:<stats-report-freq=0> - frequency of status report\n";
-    cerr << "\t-k - crash on error (aka developer mode)\n";
-    cerr << "\t-v - verbose mode (prints also size of every data packet passed)\n";
-    return 1;
+  void Print(ostream &out, const char *title) const {
+    const int64_t *bounds = Bounds();
+    out << title << ":";
+    for (int i = 0; i < BUCKETS; ++i) {
+      if (!counts[i])
+        continue;
+      if (i < BUCKETS - 1)
+        out << " <" << bounds[i] << "us:" << counts[i];
+      else
+        out << " >=" << bounds[i - 1] << "us:" << counts[i];
+    }
+    out << " MAX: " << max_us << "us\n";
   }
+};
 
-  int timeout = stoi(Option("30", "t", "to", "timeout"), 0, 0);
-  size_t chunk = stoul(Option("0", "c", "chunk"), 0, 0);
-  if (chunk == 0)
-    chunk = DEFAULT_CHUNK;
-  size_t bandwidth = stoul(Option("0", "b", "bandwidth", "bitrate"), 0, 0);
-  bw_report = stoul(Option("0", "r", "report", "bandwidth-report", "bitrate-report"), 0, 0);
-  transmit_verbose = Option("no", "v", "verbose") != "no";
-  bool crashonx = Option("no", "k", "crash") != "no";
-  bidirectional = Option("no", "2", "rw", "bidirectional") != "no";
+// The CPU's cycle counter, cheap enough to read at every stage of every
+// packet; on CPUs without one readable from user space, steady_clock.
+inline uint64_t TscNow() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t v;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+  return v;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
 
-  string loglevel = Option("error", "loglevel");
-  string logfa = Option("general", "logfa");
-  string logfile = Option("", "logfile");
-  srt_maxlossttl = stoi(Option("0", "ttl", "max-loss-delay"));
-  stats_report_freq = stoi(Option("0", "s", "stats", "stats-report-frequency"), 0, 0);
+inline double &TscRate() {
+  static double rate = 0;
+  return rate;
+}
 
-  bool internal_log = Option("no", "loginternal") != "no";
+// Measures the counter against steady_clock over 10ms. main() does it
+// once before any route starts, so that no data path thread sleeps for it.
+inline void CalibrateTsc() {
+  using namespace std::chrono;
+  uint64_t tsc0 = TscNow();
+  steady_clock::time_point t0 = steady_clock::now();
+  this_thread::sleep_for(milliseconds(10));
+  int64_t ns = duration_cast<nanoseconds>(steady_clock::now() - t0).count();
+  TscRate() = double(TscNow() - tsc0) / ns;
+}
 
-  std::ofstream logfile_stream; // leave unused if not set
+// Counter ticks per nanosecond, as measured by CalibrateTsc().
+inline double TscPerNs() {
+  if (TscRate() == 0)
+    CalibrateTsc();
+  return TscRate();
+}
 
-  srt_setloglevel(ParseLogLevel(loglevel));
-  set<logging::LogFA> fas = ParseLogFA(logfa);
-  for (set<logging::LogFA>::iterator i = fas.begin(); i != fas.end(); ++i)
-    srt_addlogfa(*i);
+// Histogram of tick counts in the layout of an HDR histogram: 16 linear
+// buckets per power of two, so that percentiles come out within 1/16 of
+// the exact value at any magnitude, and Add() is a shift and an increment.
+struct TscHistogram {
+  enum { SUB_BITS = 4, SUB = 1 << SUB_BITS, BUCKETS = (64 - SUB_BITS + 1) * SUB };
+  uint64_t counts[BUCKETS] = {};
+  uint64_t total = 0;
+  uint64_t max_ticks = 0;
+
+  static int Index(uint64_t v) {
+    if (v < SUB)
+      return int(v);
+    int e = 63 - __builtin_clzll(v);
+    return (e - SUB_BITS + 1) * SUB + int((v >> (e - SUB_BITS)) & (SUB - 1));
+  }
 
-  char NAME[] = "SRTLIB";
-  if (internal_log) {
-    srt_setlogflags(0
-                        | SRT_LOGF_DISABLE_TIME
-                        | SRT_LOGF_DISABLE_SEVERITY
-                        | SRT_LOGF_DISABLE_THREADNAME
-                        | SRT_LOGF_DISABLE_EOL
-    );
-    srt_setloghandler(NAME, TestLogHandler);
-  } else if (logfile != "") {
-    logfile_stream.open(logfile.c_str());
-    if (!logfile_stream) {
-      cerr << "ERROR: Can't open '" << logfile << "' for writing - fallback to cerr\n";
-    } else {
-      UDT::setlogstream(logfile_stream);
-    }
+  static uint64_t Lowest(int i) {
+    if (i < SUB)
+      return uint64_t(i);
+    int e = i / SUB + SUB_BITS - 1;
+    return uint64_t(SUB + i % SUB) << (e - SUB_BITS);
   }
 
-#ifdef WIN32
-#define alarm(argument) (void)0
-#else
-  signal(SIGALRM, OnAlarm_Interrupt);
-#endif
-  signal(SIGINT, OnINT_SetIntState);
-  signal(SIGTERM, OnINT_SetIntState);
+  void Add(uint64_t ticks) {
+    ++counts[Index(ticks)];
+    ++total;
+    max_ticks = max(max_ticks, ticks);
+  }
 
-  try {
-    auto src = Source::Create(params[0]);
-    auto tar = Target::Create(params[1]);
+  uint64_t Percentile(double q) const {
+    uint64_t rank = max<uint64_t>(uint64_t(ceil(q * total)), 1), seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+      seen += counts[i];
+      if (seen >= rank)
+        return min(Lowest(i), max_ticks);
+    }
+    return max_ticks;
+  }
+};
 
-    // Now loop until broken
-    BandwidthGuard bw(bandwidth);
+enum Stage { STAGE_READ, STAGE_QUEUE, STAGE_FILTER, STAGE_PACE, STAGE_WAIT, STAGE_SEND, STAGE__SIZE };
 
-    if (transmit_verbose) {
-      cout << "STARTING TRANSMISSION: '" << params[0] << "' --> '" << params[1] << "'\n";
-    }
+// Where the packets of one route spend their time between the input and
+// the output: reading (for the whole batch the packet came with), waiting
+// behind the packets read before it, filtering, pacing to -bandwidth,
+// waiting for room in the SRT sender buffer, and sending. Each stage ends
+// at a counter reading that also starts the next one, so a packet costs
+// one reading per stage it goes through. Not thread safe: used by the
+// thread driving the route.
+class StageStats {
+  TscHistogram m_stages[STAGE__SIZE];
+  uint64_t m_cursor = 0;
 
-    extern logging::Logger glog;
-    for (;;) {
-      if (timeout != -1) {
-        alarm(timeout);
-      }
-      const bytevector &data = src->Read(chunk);
-      if (transmit_verbose)
-        cout << " << " << data.size() << "  ->  ";
-      if (data.empty() && src->End()) {
-        if (transmit_verbose)
-          cout << "EOS\n";
-        break;
-      }
-      tar->Write(data);
-      if (timeout != -1) {
-        alarm(0);
-      }
-      if (tar->Broken()) {
-        if (transmit_verbose)
-          cout << " OUTPUT broken\n";
-        break;
-      }
-      if (transmit_verbose)
-        cout << " sent\n";
-      if (int_state) {
-        cerr << "\n (interrupted on request)\n";
-        break;
-      }
+ public:
+  static const char *Name(Stage s) {
+    static const char *const names[STAGE__SIZE] = {"read", "queue", "filter", "pace", "wait", "send"};
+    return names[s];
+  }
 
-      bw.Checkpoint(chunk, bw_report);
-    }
-    alarm(0);
+  uint64_t Cursor() const { return m_cursor; }
+  void Begin(uint64_t tsc) { m_cursor = tsc; }
 
-  } catch (...) {
-    if (crashonx)
-      throw;
+  // Counters of different cores may be slightly off, so time never goes
+  // backwards here.
+  void Add(Stage s, uint64_t from, uint64_t to) { m_stages[s].Add(to > from ? to - from : 0); }
 
-    return 1;
+  // Ends the stage s, which began at the cursor, now. Returns its ticks.
+  uint64_t Mark(Stage s) {
+    uint64_t now = TscNow(), from = m_cursor;
+    Add(s, from, now);
+    m_cursor = now;
+    return now > from ? now - from : 0;
   }
-  return 0;
-}
-
-// Class utilities
 
-string udt_status_names[] = {
-    "INIT", "OPENED", "LISTENING", "CONNECTING", "CONNECTED", "BROKEN", "CLOSING", "CLOSED",
-    "NONEXIST"
+  void Print(ostream &out, const string &title) const {
+    double per_us = TscPerNs() * 1000;
+    out << "STAGES " << title << ":";
+    for (int s = 0; s < STAGE__SIZE; ++s) {
+      const TscHistogram &h = m_stages[s];
+      if (!h.total)
+        continue;
+      char buf[160];
+      snprintf(buf, sizeof buf, " %s[n=%llu p50=%.1f p99=%.1f p99.9=%.1f max=%.1fus]",
+               Name(Stage(s)), (unsigned long long) h.total, h.Percentile(0.5) / per_us,
+               h.Percentile(0.99) / per_us, h.Percentile(0.999) / per_us, h.max_ticks / per_us);
+      out << buf;
+    }
+    out << endl;
+  }
 };
 
-// Medium concretizations
+// Returns null with -flight:0.
+unique_ptr<FlightRecorder> NewFlightRecorder(int route) {
+  if (!flight_records)
+    return nullptr;
+  string path = flight_dir + "/flight-" + to_string(getpid()) + "-" + to_string(route) + ".bin";
+  return unique_ptr<FlightRecorder>(new FlightRecorder(flight_records, route, path, TscNow()));
+}
+
+void DumpFlight(const FlightRecorder *flight, const string &reason) {
+  if (!flight)
+    return;
+  if (flight->Dump(reason.c_str(), TscNow()))
+    cout << "NOTE: the last packets were dumped to " << flight->Path() << endl;
+  else
+    cout << "WARNING: can't dump the last packets to " << flight->Path() << ": "
+         << strerror(errno) << endl;
+}
 
-class FileSource: public Source {
-  ifstream ifile;
+// Processing between Source and Target. A filter works on the packet in
+// place, or just inspects it and passes it through. Filters must not
+// block, and with -filter-threads Process() runs concurrently on several
+// packets, so any state a filter keeps must be atomic.
+class Filter {
  public:
+  // Returns false if the packet is to be dropped.
+  virtual bool Process(MediaPacket &packet) = 0;
+  virtual void PrintStats(ostream &) {}
+  virtual ~Filter() {}
+};
 
-  FileSource(const string &path) : ifile(path, ios::in | ios::binary) {}
+const size_t TS_PACKET_SIZE = 188;
+const char TS_SYNC_BYTE = 0x47;
 
-  bytevector Read(size_t chunk) override {
-    bytevector data(chunk);
-    ifile.read(data.data(), chunk);
-    size_t nread = size_t(ifile.gcount());
-    if (nread < data.size())
-      data.resize(nread);
-    return data;
+static inline int TsPid(const char *ts) {
+  return ((uint8_t(ts[1]) & 0x1F) << 8) | uint8_t(ts[2]);
+}
+
+// Counts TS packets that miss the sync byte and payloads that aren't
+// aligned to TS packets, passing everything through.
+class TsCheckFilter: public Filter {
+  std::atomic<size_t> m_sync_errors{0};
+  std::atomic<size_t> m_unaligned{0};
+ public:
+  bool Process(MediaPacket &packet) override {
+    const bytevector &p = packet.payload;
+    if (p.size() % TS_PACKET_SIZE)
+      ++m_unaligned;
+    for (size_t i = 0; i < p.size(); i += TS_PACKET_SIZE) {
+      if (p[i] != TS_SYNC_BYTE)
+        ++m_sync_errors;
+    }
+    return true;
   }
 
-  bool IsOpen() override { return bool(ifile); }
-  bool End() override { return ifile.eof(); }
-  //~FileSource() { ifile.close(); }
+  void PrintStats(ostream &out) override {
+    out << " sync-errors=" << m_sync_errors << " unaligned=" << m_unaligned;
+  }
 };
 
-class FileTarget: public Target {
-  ofstream ofile;
+// Removes TS packets of the given PID (8191 strips the null packets)
+// by compacting the payload in place. Packets left empty are dropped.
+class PidDropFilter: public Filter {
+  int m_pid;
+  std::atomic<size_t> m_removed{0};
  public:
+  explicit PidDropFilter(int pid) : m_pid(pid) {}
+
+  bool Process(MediaPacket &packet) override {
+    bytevector &p = packet.payload;
+    size_t out = 0, in = 0;
+    for (; in + TS_PACKET_SIZE <= p.size(); in += TS_PACKET_SIZE) {
+      if (p[in] == TS_SYNC_BYTE && TsPid(&p[in]) == m_pid) {
+        ++m_removed;
+        continue;
+      }
+      if (out != in)
+        memmove(&p[out], &p[in], TS_PACKET_SIZE);
+      out += TS_PACKET_SIZE;
+    }
 
-  FileTarget(const string &path) : ofile(path, ios::out | ios::trunc | ios::binary) {}
-
-  void Write(const bytevector &data) override {
-    ofile.write(data.data(), data.size());
+    // Keep the unaligned rest, if any; it's not ours to judge.
+    size_t rest = p.size() - in;
+    if (rest && out != in)
+      memmove(&p[out], &p[in], rest);
+    p.resize(out + rest);
+    return !p.empty();
   }
 
-  bool IsOpen() override { return !!ofile; }
-  bool Broken() override { return !ofile.good(); }
-  //~FileTarget() { ofile.close(); }
+  void PrintStats(ostream &out) override { out << " removed=" << m_removed; }
 };
 
-template<class Iface>
-struct File;
-template<>
-struct File<Source> { typedef FileSource type; };
-template<>
-struct File<Target> { typedef FileTarget type; };
-
-template<class Iface>
-Iface *CreateFile(const string &name) { return new typename File<Iface>::type(name); }
+unique_ptr<Filter> CreateFilter(const string &name, const string &arg) {
+  if (name == "tscheck")
+    return unique_ptr<Filter>(new TsCheckFilter);
+  if (name == "piddrop") {
+    if (arg == "")
+      throw invalid_argument("piddrop filter requires a PID: piddrop=<pid>");
+    return unique_ptr<Filter>(new PidDropFilter(stoi(arg, 0, 0)));
+  }
+  cerr << "ERROR: Unknown filter: '" << name << "'\n";
+  throw invalid_argument("Invalid filter");
+}
 
+// The filters configured with -filter:<name>[=<arg>],..., applied in
+// order. Each stage is timed, so that the cost of processing shows up
+// separately from the I/O.
+class FilterChain {
+  struct Stage {
+    string name;
+    unique_ptr<Filter> filter;
+    std::atomic<size_t> packets{0};
+    std::atomic<size_t> dropped{0};
+    std::atomic<int64_t> total_ns{0};
+    std::atomic<int64_t> max_ns{0};
+  };
+  vector<unique_ptr<Stage>> m_stages;
 
-class SrtCommon {
-  int srt_conn_epoll = -1;
- protected:
+ public:
+  explicit FilterChain(const string &spec) {
+    size_t pos = 0;
+    while (pos < spec.size()) {
+      size_t end = spec.find(',', pos);
+      if (end == string::npos)
+        end = spec.size();
+      string item = spec.substr(pos, end - pos);
+      pos = end + 1;
+      if (item == "")
+        continue;
 
-  bool m_output_direction =
-      false; //< Defines which of SND or RCV option variant should be used, also to set SRT_SENDER for output
-  bool m_blocking_mode =
-      true; //< enforces using SRTO_SNDSYN or SRTO_RCVSYN, depending on @a m_output_direction
-  int m_timeout =
-      0; //< enforces using SRTO_SNDTIMEO or SRTO_RCVTIMEO, depending on @a m_output_direction
-  bool m_tsbpdmode = true;
-  map<string, string> m_options; // All other options, as provided in the URI
-  SRTSOCKET m_sock = SRT_INVALID_SOCK;
-  SRTSOCKET m_bindsock = SRT_INVALID_SOCK;
-  bool IsUsable() {
-    SRT_SOCKSTATUS st = srt_getsockstate(m_sock);
-    return st > SRTS_INIT && st < SRTS_BROKEN;
+      size_t eq = item.find('=');
+      Stage *st = new Stage;
+      m_stages.emplace_back(st);
+      st->name = item.substr(0, eq);
+      st->filter = CreateFilter(st->name, eq == string::npos ? "" : item.substr(eq + 1));
+    }
   }
-  bool IsBroken() { return srt_getsockstate(m_sock) > SRTS_CONNECTED; }
 
-  void Init(string host, int port, map<string, string> par, bool dir_output) {
-    m_output_direction = dir_output;
+  bool empty() const { return m_stages.empty(); }
 
-    // Application-specific options: mode, blocking, timeout, adapter
-    if (transmit_verbose) {
-      cout << "Parameters:\n";
-      for (map<string, string>::iterator i = par.begin(); i != par.end(); ++i) {
-        cout << "\t" << i->first << " = '" << i->second << "'\n";
+  bool Process(MediaPacket &packet) {
+    using namespace std::chrono;
+    for (auto &stage: m_stages) {
+      Stage &st = *stage;
+      steady_clock::time_point start = steady_clock::now();
+      bool pass = st.filter->Process(packet);
+      int64_t ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+      ++st.packets;
+      st.total_ns += ns;
+      int64_t max_ns = st.max_ns;
+      while (ns > max_ns && !st.max_ns.compare_exchange_weak(max_ns, ns)) {
+      }
+      if (!pass) {
+        ++st.dropped;
+        return false;
       }
     }
+    return true;
+  }
 
-    string mode = "default";
-    if (par.count("mode"))
-      mode = par.at("mode");
+  void PrintStats(ostream &out) {
+    for (auto &stage: m_stages) {
+      Stage &st = *stage;
+      size_t packets = st.packets;
+      out << "FILTER " << st.name << ": packets=" << packets << " dropped=" << st.dropped
+          << " avg=" << (packets ? st.total_ns / int64_t(packets) : 0) << "ns max="
+          << st.max_ns << "ns";
+      st.filter->PrintStats(out);
+      out << endl;
+    }
+  }
+};
 
-    if (mode == "default") {
-      // Use the following convention:
-      // 1. Server for source, Client for target
-      // 2. If host is empty, then always server.
-      if (host == "")
-        mode = "server";
-        //else if ( !dir_output )
-        //mode = "server";
-      else
-        mode = "client";
+// Thread pool for CPU-heavy processing. Every worker has its own queue
+// and takes its newest task first; an idle worker steals the oldest task
+// of another one, so a burst submitted to one queue spreads over all.
+class TaskPool {
+ public:
+  typedef std::function<void()> Task;
+
+  explicit TaskPool(size_t threads) {
+    for (size_t i = 0; i < threads; ++i)
+      m_workers.emplace_back(new Worker);
+    m_start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < threads; ++i)
+      m_workers[i]->thread = std::thread(&TaskPool::Run, this, i);
+  }
+
+  // Runs the tasks still queued, then stops the workers.
+  ~TaskPool() {
+    {
+      std::lock_guard<std::mutex> lk(m_idle_lock);
+      m_stop = true;
     }
-    par.erase("mode");
+    m_idle.notify_all();
+    for (auto &w: m_workers)
+      w->thread.join();
+  }
 
-    if (par.count("blocking")) {
-      m_blocking_mode = !false_names.count(par.at("blocking"));
-      par.erase("blocking");
+  void Submit(Task task) {
+    Worker &w = *m_workers[m_next++ % m_workers.size()];
+    {
+      std::lock_guard<std::mutex> lk(w.lock);
+      w.tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lk(m_idle_lock);
+      ++m_pending;
     }
+    m_idle.notify_one();
+  }
 
-    if (par.count("timeout")) {
-      m_timeout = stoi(par.at("timeout"), 0, 0);
-      par.erase("timeout");
+  size_t Size() const { return m_workers.size(); }
+
+  void PrintStats(ostream &out) {
+    using namespace std::chrono;
+    int64_t elapsed = duration_cast<nanoseconds>(steady_clock::now() - m_start).count();
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+      Worker &w = *m_workers[i];
+      out << "WORKER " << i << ": tasks=" << w.executed << " steals=" << w.steals
+          << " utilisation=" << (elapsed ? w.busy_ns * 100 / elapsed : 0) << "%\n";
     }
+  }
 
-    string adapter = ""; // needed for rendezvous only
-    if (par.count("adapter")) {
-      adapter = par.at("adapter");
-      par.erase("adapter");
+ private:
+  struct Worker {
+    std::mutex lock;
+    deque<Task> tasks;
+    std::thread thread;
+    std::atomic<size_t> executed{0};
+    std::atomic<size_t> steals{0}; //< Tasks taken from other workers
+    std::atomic<int64_t> busy_ns{0};
+  };
+
+  bool Pop(size_t self, Task &task) {
+    {
+      Worker &w = *m_workers[self];
+      std::lock_guard<std::mutex> lk(w.lock);
+      if (!w.tasks.empty()) {
+        task = std::move(w.tasks.back());
+        w.tasks.pop_back();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < m_workers.size(); ++i) {
+      Worker &victim = *m_workers[(self + i) % m_workers.size()];
+      std::lock_guard<std::mutex> lk(victim.lock);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        ++m_workers[self]->steals;
+        return true;
+      }
     }
+    return false;
+  }
 
-    if (par.count("tsbpd") && false_names.count(par.at("tsbpd"))) {
-      m_tsbpdmode = false;
+  void Run(size_t self) {
+    using namespace std::chrono;
+    PinThread("filter worker");
+    Worker &w = *m_workers[self];
+    for (;;) {
+      Task task;
+      if (Pop(self, task)) {
+        --m_pending;
+        steady_clock::time_point start = steady_clock::now();
+        task();
+        w.busy_ns += duration_cast<nanoseconds>(steady_clock::now() - start).count();
+        ++w.executed;
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lk(m_idle_lock);
+      m_idle.wait(lk, [this] { return m_stop || m_pending > 0; });
+      if (m_stop && m_pending == 0)
+        return;
     }
+  }
 
-    // Assign the others here.
-    m_options = par;
+  vector<unique_ptr<Worker>> m_workers;
+  std::atomic<size_t> m_next{0};
+  std::mutex m_idle_lock;
+  std::condition_variable m_idle;
+  std::atomic<size_t> m_pending{0}; //< Submitted and not yet taken
+  bool m_stop = false;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+int bw_report = 0;
+
+// Everything the transmission loop needs, apart from the media.
+struct PipelineConfig {
+  size_t chunk = DEFAULT_CHUNK;
+  int timeout = -1;
+  size_t bandwidth = 0;
+  bool generic = false; //< Use virtual calls regardless of the media types
+  TaskPool *workers = nullptr; //< Run the filters here, if set
+  size_t filter_batch = 8; //< Packets filtered in one task
+};
+
+// Most packets taken from a Source at once (see Source::ReadBatch).
+const size_t READ_BATCH = 64;
+
+void RunPipeline(Source &src, Target &tar, PacketPool &pool, FilterChain &filters,
+                 const PipelineConfig &cfg);
+void RunRoutes(const string &path, const string &threads, size_t chunk);
+
+// Routes not yet finished.
+std::atomic<int> active_routes{0};
+
+// Lets an SRT medium record its socket's events too; others ignore it.
+template<class Medium>
+void AttachRecorder(Medium &medium, FlightRecorder *flight);
+
+// One input-output pair run by a Reactor. Resume() moves packets until
+// either side would block, then leaves a continuation holding the route
+// and returns; after ROUTE_BATCH packets it yields to the other routes.
+class AsyncRoute: public std::enable_shared_from_this<AsyncRoute> {
+  static const int ROUTE_BATCH = 64;
+
+  string m_name;
+  int m_id; //< Line in the routes file
+  unique_ptr<FlightRecorder> m_flight; //< Outlives the media, which record into it
+  std::atomic<Reactor *> m_reactor; //< Changed only by its own loop, when migrating
+  size_t m_chunk;
+  unique_ptr<Source> m_src_medium;
+  unique_ptr<Target> m_tar_medium;
+  AsyncSource *m_src = nullptr;
+  AsyncTarget *m_tar = nullptr;
+  MediaPacket m_packet;
+  bool m_pending = false; //< m_packet was read, but not yet written
+  StageStats m_stages; //< With -stages; the wait is for the output to take m_packet
+  std::atomic<size_t> m_packets{0};
+  std::atomic<bool> m_open{false};
+  std::atomic<bool> m_done{false};
+
+ public:
+  AsyncRoute(const string &name, int id, Reactor &reactor, size_t chunk)
+      : m_name(name), m_id(id), m_flight(NewFlightRecorder(id)), m_reactor(&reactor),
+        m_chunk(chunk) {
+    ++active_routes;
+    ++reactor.stats.routes;
+  }
+
+  const string &Name() const { return m_name; }
+  Reactor *Shard() const { return m_reactor; }
+  size_t Packets() const { return m_packets; }
+  bool Running() const { return m_open && !m_done; }
 
+  // Only an opener thread outliving the engine can get here unfinished,
+  // and then the shard may be gone already.
+  ~AsyncRoute() {
+    if (!m_done)
+      --active_routes;
+  }
+
+  // Opens the media; blocks until connected, so not on the loop thread.
+  void Open(const string &in, const string &out) {
+    m_src_medium = Source::Create(in);
+    m_tar_medium = Target::Create(out);
+    m_src = dynamic_cast<AsyncSource *>(m_src_medium.get());
+    m_tar = dynamic_cast<AsyncTarget *>(m_tar_medium.get());
+    if (!m_src || !m_tar)
+      throw invalid_argument("Route '" + m_name + "': only SRT and UDP media can be routed");
+    AttachRecorder(*m_src_medium, m_flight.get());
+    AttachRecorder(*m_tar_medium, m_flight.get());
+    m_src->SetNonBlocking();
+    m_tar->SetNonBlocking();
+    m_open = true;
+  }
+
+  void Start() {
+    auto self = shared_from_this();
+    m_reactor.load()->Post([self] { self->Resume(); });
+  }
+
+  // Moves the route to another shard. The current loop drops the route's
+  // continuations and then hands it over, so the route never runs on
+  // both loops at once.
+  void MoveTo(Reactor &to) {
+    auto self = shared_from_this();
+    Reactor *from = m_reactor;
+    from->Post([self, from, &to] {
+      if (self->m_done || self->m_reactor != from)
+        return;
+      from->Cancel(self->m_src->Poll());
+      from->Cancel(self->m_tar->Poll());
+      --from->stats.routes;
+      ++from->stats.migrated_out;
+      self->m_reactor = &to;
+      ++to.stats.routes;
+      ++to.stats.migrated_in;
+      to.Post([self] { self->Resume(); });
+    });
+  }
+
+  void Resume() {
+    // A yield posted before the route migrated finds it on another shard.
+    if (m_done || Reactor::Current() != m_reactor)
+      return;
+    Reactor::Stats &stats = m_reactor.load()->stats;
+    if (stage_stats) {
+      uint64_t now = TscNow();
+      if (m_pending)
+        m_stages.Add(STAGE_WAIT, m_packet.stamp, now);
+      m_stages.Begin(now);
+    }
+    try {
+      for (int n = 0; n < ROUTE_BATCH; ++n) {
+        if (int_state)
+          return Finish("interrupted");
+        if (!m_pending) {
+          if (!m_src->TryRead(m_chunk, m_packet.payload))
+            return Wait(m_src->Poll(), false);
+          if (m_packet.payload.empty()) {
+            if (m_src_medium->End())
+              return Finish("EOS");
+            continue;
+          }
+          m_packet.ingest_time = std::chrono::steady_clock::now();
+          m_packet.seq = m_packets;
+          m_pending = true;
+          // One counter reading for both the stage and the record.
+          if (stage_stats)
+            m_stages.Mark(STAGE_READ);
+          if (m_flight)
+            m_flight->Add(stage_stats ? m_stages.Cursor() : TscNow(), FLIGHT_READ,
+                          int32_t(m_packet.payload.size()), m_packet.seq);
+          TRANSMIT_PROBE(packet_read, m_id, m_packet.seq, m_packet.payload.size(),
+                         m_packet.IngestNs());
+        }
+        if (!m_tar->TryWrite(m_packet)) {
+          if (stage_stats)
+            m_packet.stamp = TscNow();
+          return Wait(m_tar->Poll(), true);
+        }
+        uint64_t send_ticks = stage_stats ? m_stages.Mark(STAGE_SEND) : 0;
+        if (m_flight)
+          m_flight->Add(stage_stats ? m_stages.Cursor() : TscNow(), FLIGHT_WRITE,
+                        int32_t(m_packet.payload.size()), m_packet.seq, send_ticks);
+        TRANSMIT_PROBE(packet_write, m_id, m_packet.seq, m_packet.payload.size(),
+                       m_packet.IngestNs());
+        m_pending = false;
+        ++m_packets;
+        ++stats.packets;
+        stats.bytes += m_packet.payload.size();
+        if (m_tar_medium->Broken()) {
+          DumpFlight(m_flight.get(), "output broken");
+          return Finish("output broken");
+        }
+      }
+      Start();
+    } catch (std::exception &x) {
+      DumpFlight(m_flight.get(), x.what());
+      Finish(x.what());
+    }
+  }
+
+  void Finish(const string &reason) {
+    m_done = true;
     if (transmit_verbose)
-      cout << "Opening SRT " << (dir_output ? "target" : "source") << " " << mode
-           << "(" << (m_blocking_mode ? "" : "non-") << "blocking)"
-           << " on " << host << ":" << port << endl;
+      cout << "ROUTE " << m_name << ": " << reason << " after " << m_packets << " packets\n";
+    if (stage_stats && m_packets && (transmit_verbose || stats_report_freq))
+      m_stages.Print(cout, m_name);
+    --m_reactor.load()->stats.routes;
+    --active_routes;
+  }
 
-    if (mode == "client" || mode == "caller")
-      OpenClient(host, port);
-    else if (mode == "server" || mode == "listener")
-      OpenServer(host == "" ? adapter : host, port);
-    else if (mode == "rendezvous")
-      OpenRendezvous(adapter, host, port);
-    else {
-      throw std::invalid_argument("Invalid 'mode'. Use 'client' or 'server'");
+ private:
+  void Wait(PollHandle h, bool write) {
+    auto self = shared_from_this();
+    m_reactor.load()->WhenReady(h, write, [self] { self->Resume(); });
+  }
+};
+
+const int SHARD_VNODES = 64;
+const int REBALANCE_PERIOD_MS = 1000;
+const double REBALANCE_LOAD = 0.75; //< Busy share of a shard worth migrating from
+
+// The event loops running the routes, one per core when -threads:auto.
+// Routes are placed by consistent hashing of their names, so that the
+// placement of a route doesn't depend on the others, and Rebalance()
+// moves routes off a shard that is busy much more than the idlest one.
+class ShardedEngine {
+  vector<unique_ptr<Reactor>> m_shards;
+  map<size_t, size_t> m_ring; //< Hash point -> shard index
+  vector<std::weak_ptr<AsyncRoute>> m_routes;
+
+  // Since the previous Rebalance()
+  vector<int64_t> m_prev_busy;
+  map<AsyncRoute *, size_t> m_prev_packets;
+  std::chrono::steady_clock::time_point m_prev_time;
+
+ public:
+  ShardedEngine(size_t count, bool pin) {
+    for (size_t i = 0; i < count; ++i) {
+      int cpu = pin ? int(i) : -1;
+      m_shards.emplace_back(new Reactor(cpu, [cpu] {
+        if (cpu < 0)
+          PinThread("event loop");
+        else if (!PinToCpu(cpu) && transmit_verbose)
+          cout << "WARNING: can't pin the event loop to cpu " << cpu << endl;
+      }));
+      for (int v = 0; v < SHARD_VNODES; ++v)
+        m_ring[std::hash<string>()(to_string(i) + "#" + to_string(v))] = i;
     }
+    m_prev_busy.resize(count);
+    m_prev_time = std::chrono::steady_clock::now();
   }
 
-  int AddPoller(SRTSOCKET socket, int modes) {
-    int pollid = srt_epoll_create();
-    if (pollid == -1)
-      throw std::runtime_error("Can't create epoll in nonblocking mode");
-    srt_epoll_add_usock(pollid, socket, &modes);
-    return pollid;
+  Reactor &ShardFor(const string &route_name) {
+    auto i = m_ring.lower_bound(std::hash<string>()(route_name));
+    if (i == m_ring.end())
+      i = m_ring.begin();
+    return *m_shards[i->second];
   }
 
-  virtual int ConfigurePost(SRTSOCKET sock) {
-    bool yes = m_blocking_mode;
-    int result = 0;
-    if (m_output_direction) {
-      result = srt_setsockopt(sock, 0, SRTO_SNDSYN, &yes, sizeof yes);
-      if (result == -1)
-        return result;
+  void Add(const std::shared_ptr<AsyncRoute> &route) { m_routes.push_back(route); }
 
-      if (m_timeout)
-        return srt_setsockopt(sock, 0, SRTO_SNDTIMEO, &m_timeout, sizeof m_timeout);
-    } else {
-      result = srt_setsockopt(sock, 0, SRTO_RCVSYN, &yes, sizeof yes);
-      if (result == -1)
-        return result;
+  void Rebalance() {
+    using namespace std::chrono;
+    steady_clock::time_point now = steady_clock::now();
+    int64_t period = duration_cast<nanoseconds>(now - m_prev_time).count();
+    m_prev_time = now;
+    if (m_shards.size() < 2 || period <= 0)
+      return;
 
-      if (m_timeout)
-        return srt_setsockopt(sock, 0, SRTO_RCVTIMEO, &m_timeout, sizeof m_timeout);
+    vector<double> load(m_shards.size());
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+      int64_t busy = m_shards[i]->stats.busy_ns;
+      load[i] = double(busy - m_prev_busy[i]) / period;
+      m_prev_busy[i] = busy;
     }
 
-    SrtConfigurePost(sock, m_options);
+    // Packets per route in this period, to pick one that carries about
+    // half of the load difference.
+    map<AsyncRoute *, size_t> packets;
+    vector<std::shared_ptr<AsyncRoute>> running;
+    for (auto &w: m_routes) {
+      auto r = w.lock();
+      if (!r || !r->Running())
+        continue;
+      packets[r.get()] = r->Packets();
+      running.push_back(r);
+    }
 
-    for (auto o: srt_options) {
-      if (o.binding == SocketOption::POST && m_options.count(o.name)) {
-        string value = m_options.at(o.name);
-        bool ok = o.apply<SocketOption::SRT>(sock, value);
-        if (transmit_verbose) {
-          if (!ok)
-            cout << "WARNING: failed to set '" << o.name << "' (post, "
-                 << (m_output_direction ? "target" : "source") << ") to " << value << endl;
-          else
-            cout << "NOTE: SRT/post::" << o.name << "=" << value << endl;
+    size_t hot = max_element(load.begin(), load.end()) - load.begin();
+    size_t cool = min_element(load.begin(), load.end()) - load.begin();
+    if (load[hot] >= REBALANCE_LOAD && load[hot] - load[cool] > REBALANCE_LOAD / 2) {
+      size_t hot_packets = 0;
+      for (auto &r: running)
+        if (r->Shard() == m_shards[hot].get())
+          hot_packets += packets[r.get()] - m_prev_packets[r.get()];
+      double want = hot_packets * (load[hot] - load[cool]) / (2 * load[hot]);
+
+      std::shared_ptr<AsyncRoute> best;
+      double best_diff = 0;
+      for (auto &r: running) {
+        if (r->Shard() != m_shards[hot].get())
+          continue;
+        double diff = fabs(double(packets[r.get()] - m_prev_packets[r.get()]) - want);
+        if (!best || diff < best_diff) {
+          best = r;
+          best_diff = diff;
         }
       }
+      if (best) {
+        if (transmit_verbose)
+          cout << "NOTE: moving route " << best->Name() << " from shard " << hot << " ("
+               << int(load[hot] * 100) << "% busy) to shard " << cool << " ("
+               << int(load[cool] * 100) << "% busy)\n";
+        best->MoveTo(*m_shards[cool]);
+      }
     }
+    m_prev_packets.swap(packets);
+  }
 
-    return 0;
+  void PrintStats(ostream &out) {
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+      Reactor::Stats &st = m_shards[i]->stats;
+      out << "SHARD " << i;
+      if (m_shards[i]->Cpu() >= 0)
+        out << " (cpu " << m_shards[i]->Cpu() << ")";
+      out << ": routes=" << st.routes << " packets=" << st.packets << " bytes=" << st.bytes
+          << " busy=" << st.busy_ns / 1000000 << "ms migrated-in=" << st.migrated_in
+          << " migrated-out=" << st.migrated_out << endl;
+    }
   }
+};
 
-  virtual int ConfigurePre(SRTSOCKET sock) {
-    int result = 0;
+// Lets the opener threads, which may still be connecting when the engine
+// goes, hand their routes over only while the engine is there.
+class OpenerGate {
+  std::mutex m_lock;
+  bool m_open = true;
 
-    int no = 0;
-    if (!m_tsbpdmode) {
-      result = srt_setsockopt(sock, 0, SRTO_TSBPDMODE, &no, sizeof no);
-      if (result == -1)
-        return result;
+ public:
+  // Runs fn with the engine guaranteed to stay, or not at all.
+  template<class Fn>
+  void Pass(Fn fn) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    if (m_open)
+      fn();
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_open = false;
+  }
+};
+
+void RunRoutes(const string &path, const string &threads, size_t chunk) {
+  ifstream file(path);
+  if (!file)
+    throw invalid_argument("Can't open routes file: " + path);
+
+  vector<pair<string, string>> routes;
+  vector<int> lines;
+  string line;
+  for (int number = 1; getline(file, line); ++number) {
+    istringstream ln(line);
+    string in, out;
+    if (!(ln >> in) || in[0] == '#')
+      continue;
+    if (!(ln >> out))
+      throw invalid_argument("Route without output in " + path + ": " + line);
+    routes.push_back(make_pair(in, out));
+    lines.push_back(number);
+  }
+
+  bool per_core = threads == "auto";
+  size_t count = per_core ? std::thread::hardware_concurrency() : stoul(threads, 0, 0);
+  ShardedEngine engine(max<size_t>(count, 1), per_core);
+
+  // Closed before the engine is destroyed, also by an exception; an
+  // opener that connects only then drops its route without touching
+  // the shard it was meant for.
+  auto gate = std::make_shared<OpenerGate>();
+  struct GateCloser {
+    std::shared_ptr<OpenerGate> gate;
+    ~GateCloser() { gate->Close(); }
+  } closer{gate};
+
+  // Connecting blocks, so every route is opened on its own thread and
+  // handed to its reactor once ready.
+  for (size_t i = 0; i < routes.size(); ++i) {
+    string name = routes[i].first + " -> " + routes[i].second;
+    auto route = std::make_shared<AsyncRoute>(name, lines[i], engine.ShardFor(name), chunk);
+    engine.Add(route);
+    auto uris = routes[i];
+    std::thread([route, uris, gate] {
+      try {
+        route->Open(uris.first, uris.second);
+        gate->Pass([&route] { route->Start(); });
+      } catch (std::exception &x) {
+        cerr << "ERROR: " << x.what() << endl;
+        gate->Pass([&route] { route->Finish("failed to open"); });
+      }
+    }).detach();
+  }
+
+  using namespace std::chrono;
+  steady_clock::time_point next_rebalance = steady_clock::now() + milliseconds(REBALANCE_PERIOD_MS);
+  while (active_routes > 0 && !int_state) {
+    std::this_thread::sleep_for(milliseconds(100));
+    if (steady_clock::now() >= next_rebalance) {
+      engine.Rebalance();
+      next_rebalance += milliseconds(REBALANCE_PERIOD_MS);
+    }
+  }
+  if (int_state)
+    cerr << "\n (interrupted on request)\n";
+  if (transmit_verbose || stats_report_freq)
+    engine.PrintStats(cout);
+}
+
+extern "C" void TestLogHandler(void *opaque,
+                               int level,
+                               const char *file,
+                               int line,
+                               const char *area,
+                               const char *message);
+
+int main(int argc, char **argv) {
+  // This is mainly required on Windows to initialize the network system,
+  // for a case when the instance would use UDP. SRT does it on its own, independently.
+  if (!SysInitializeNetwork())
+    throw std::runtime_error("Can't initialize network!");
+
+  // Symmetrically, this does a cleanup; put into a local destructor to ensure that
+  // it's called regardless of how this function returns.
+  struct NetworkCleanup {
+    ~NetworkCleanup() {
+      SysCleanupNetwork();
+    }
+  } cleanupobj;
+
+  vector<string> args;
+  copy(argv + 1, argv + argc, back_inserter(args));
+
+  // Check options
+  vector<string> params;
+
+  for (string a: args) {
+    if (a[0] == '-') {
+      string key = a.substr(1);
+      size_t pos = key.find(':');
+      if (pos == string::npos)
+        pos = key.find(' ');
+      string value = pos == string::npos ? "" : key.substr(pos + 1);
+      key = key.substr(0, pos);
+      g_options[key] = value;
+      continue;
+    }
+
+    params.push_back(a);
+  }
+
+  string routes = Option("", "routes");
+  if (params.size() < 2 && routes == "") {
+    cerr << "Usage: " << argv[0] << " [options] <input-uri> <output-uri> [<output-uri>...]\n";
+    cerr << "\t(uris: srt://, udp://, file://, file://con, shm://<name or /path>, xdp://)\n";
+    cerr << "\t-t:<timeout=0> - connection timeout\n";
+    cerr << "\t-c:<chunk=1316> - max size of data read in one step\n";
+    cerr << "\t-b:<bandwidth> - set SRT bandwidth\n";
+    cerr << "\t-r:<report-frequency=0> - bandwidth report frequency\n";
+    cerr << "\t-s:<stats-report-freq=0> - frequency of status report\n";
+    cerr << "\t-k - crash on error (aka developer mode)\n";
+    cerr << "\t-v - verbose mode (prints also size of every data packet passed)\n";
+    cerr << "\t-autobuf:<headroom%=25> - size SRT/UDP buffers from bitrate x latency\n";
+    cerr << "\t-filter:<name>[=<arg>],... - process data between input and output\n";
+    cerr << "\t\t(tscheck, piddrop=<pid>)\n";
+    cerr << "\t-filter-threads:<count=0> - run the filters on a pool of threads\n";
+    cerr << "\t-filter-batch:<packets=8> - packets per filtering task with -filter-threads\n";
+    cerr << "\t-tee-queue:<packets=1024> - queue limit per output, when more outputs given\n";
+    cerr << "\t-pipeline:generic - don't specialize the transmission loop for the media types\n";
+    cerr << "\t-read-block:<KB=256> - read files and the console in blocks of this size\n";
+    cerr << "\t-tsalign - cut file and console input into whole 188-byte TS packets\n";
+    cerr << "\t-stages:<yes|no> - time the stages of every packet, reported with the stats\n";
+    cerr << "\t-flight:<records=8192> - keep this many recent events per route, dumped on\n";
+    cerr << "\t\tfailure or SIGUSR1 to <dir>/flight-<pid>-<route>.bin; 0 turns it off\n";
+    cerr << "\t-flight-dir:<dir=.> - where the flight recorders are dumped\n";
+    cerr << "\t-srttrace:<yes|no> - time the calls into libsrt, reported with the stats\n";
+    cerr << "\t-srtslow:<us> - report any call into libsrt taking at least this long\n";
+    cerr << "\t-lowlatency:<spin-us=50> - busy-poll UDP sockets and spin before blocking waits\n";
+    cerr << "\t-cpus:<n>,... - pin the data path threads to these cores, in turn\n";
+    cerr << "\t-rtprio:<1-99> - run the data path threads with SCHED_FIFO at this priority\n";
+    cerr << "\t-routes:<file> - run many routes, one '<input-uri> <output-uri>' per line,\n";
+    cerr << "\t\tinstead of the uris given in the command line (SRT and UDP only)\n";
+    cerr << "\t-threads:<count=1|auto> - number of event loop threads running the routes;\n";
+    cerr << "\t\tauto runs one per core, pinned to it\n";
+    return 1;
+  }
+
+  int timeout = stoi(Option("30", "t", "to", "timeout"), 0, 0);
+  size_t chunk = stoul(Option("0", "c", "chunk"), 0, 0);
+  if (chunk == 0)
+    chunk = DEFAULT_CHUNK;
+  size_t bandwidth = stoul(Option("0", "b", "bandwidth", "bitrate"), 0, 0);
+  stream_bitrate = int64_t(bandwidth) * 8;
+  bw_report = stoul(Option("0", "r", "report", "bandwidth-report", "bitrate-report"), 0, 0);
+  transmit_verbose = Option("no", "v", "verbose") != "no";
+  bool crashonx = Option("no", "k", "crash") != "no";
+  bidirectional = Option("no", "2", "rw", "bidirectional") != "no";
+
+  string loglevel = Option("error", "loglevel");
+  string logfa = Option("general", "logfa");
+  string logfile = Option("", "logfile");
+  srt_maxlossttl = stoi(Option("0", "ttl", "max-loss-delay"));
+  stats_report_freq = stoi(Option("0", "s", "stats", "stats-report-frequency"), 0, 0);
+  string autobuf = Option("no", "autobuf", "auto-buffers");
+  if (autobuf != "no")
+    autobuf_headroom = autobuf == "" ? 25 : stoi(autobuf);
+
+  bool internal_log = Option("no", "loginternal") != "no";
+  tee_queue_limit = stoul(Option("1024", "tee-queue"), 0, 0);
+  read_block_size = stoul(Option("256", "read-block"), 0, 0) * 1024;
+  ts_align = Option("no", "tsalign") != "no";
+  stage_stats = !false_names.count(Option("yes", "stages"));
+  flight_records = stoul(Option("8192", "flight"), 0, 0);
+  flight_dir = Option(".", "flight-dir");
+  srt_trace::Config().enabled = !false_names.count(Option("yes", "srttrace"));
+  srt_trace::Config().slow_us = stoll(Option("0", "srtslow"), 0, 0);
+  srt_trace::Config().on_slow = [](const srt_trace::Site &site, int64_t us, int error) {
+    cout << "WARNING: " << site.name << " took " << us << "us";
+    if (error)
+      cout << " and failed with " << error;
+    cout << endl;
+  };
+  string lowlatency = Option("no", "lowlatency");
+  if (lowlatency != "no")
+    spin_us = lowlatency == "" ? 50 : stoi(lowlatency, 0, 0);
+  for (string cpus = Option("", "cpus"); cpus != "";) {
+    size_t comma = cpus.find(',');
+    pin_cpus.push_back(stoi(cpus.substr(0, comma)));
+    cpus = comma == string::npos ? "" : cpus.substr(comma + 1);
+  }
+  rt_priority = stoi(Option("0", "rtprio"), 0, 0);
+
+  std::ofstream logfile_stream; // leave unused if not set
+
+  srt_setloglevel(ParseLogLevel(loglevel));
+  set<logging::LogFA> fas = ParseLogFA(logfa);
+  for (set<logging::LogFA>::iterator i = fas.begin(); i != fas.end(); ++i)
+    srt_addlogfa(*i);
+
+  char NAME[] = "SRTLIB";
+  if (internal_log) {
+    srt_setlogflags(0
+                        | SRT_LOGF_DISABLE_TIME
+                        | SRT_LOGF_DISABLE_SEVERITY
+                        | SRT_LOGF_DISABLE_THREADNAME
+                        | SRT_LOGF_DISABLE_EOL
+    );
+    srt_setloghandler(NAME, TestLogHandler);
+  } else if (logfile != "") {
+    logfile_stream.open(logfile.c_str());
+    if (!logfile_stream) {
+      cerr << "ERROR: Can't open '" << logfile << "' for writing - fallback to cerr\n";
+    } else {
+      UDT::setlogstream(logfile_stream);
+    }
+  }
+
+#ifdef WIN32
+#define alarm(argument) (void)0
+#else
+  signal(SIGALRM, OnAlarm_Interrupt);
+#endif
+  signal(SIGINT, OnINT_SetIntState);
+  signal(SIGTERM, OnINT_SetIntState);
+  if (flight_records)
+    FlightRecorder::InstallSignals(&TscNow);
+  if (stage_stats)
+    CalibrateTsc();
+
+  try {
+    if (routes != "") {
+      RunRoutes(routes, Option("1", "threads"), chunk);
+      if (transmit_verbose || stats_report_freq)
+        srt_trace::Print(cout);
+      return 0;
+    }
+
+    // Declared first so that it outlives any packet still held by the media.
+    PacketPool pool;
+    FilterChain filters(Option("", "filter"));
+    size_t filter_threads = stoul(Option("0", "filter-threads"), 0, 0);
+    unique_ptr<TaskPool> workers;
+    if (filter_threads && !filters.empty())
+      workers.reset(new TaskPool(filter_threads));
+    auto src = Source::Create(params[0]);
+    auto tar = Target::Create(vector<string>(params.begin() + 1, params.end()));
+
+    PipelineConfig cfg;
+    cfg.chunk = chunk;
+    cfg.timeout = timeout;
+    cfg.bandwidth = bandwidth;
+    cfg.generic = Option("", "pipeline") == "generic";
+    cfg.workers = workers.get();
+    cfg.filter_batch = max<size_t>(stoul(Option("8", "filter-batch"), 0, 0), 1);
+
+    if (transmit_verbose) {
+      cout << "STARTING TRANSMISSION: '" << params[0] << "' --> '" << params[1] << "'\n";
+    }
+
+    // Pinned only now, so that the threads SRT started while opening
+    // the media don't inherit the core.
+    PinThread("pipeline");
+    RunPipeline(*src, *tar, pool, filters, cfg);
+    alarm(0);
+
+    if (!filters.empty() && (transmit_verbose || stats_report_freq)) {
+      filters.PrintStats(cout);
+      if (workers)
+        workers->PrintStats(cout);
+      cout << "PACKETS IN FLIGHT: peak " << pool.PeakInUse() << endl;
+    }
+    if (transmit_verbose || stats_report_freq)
+      srt_trace::Print(cout);
+
+  } catch (...) {
+    if (crashonx)
+      throw;
+
+    return 1;
+  }
+  return 0;
+}
+
+// Class utilities
+
+string udt_status_names[] = {
+    "INIT", "OPENED", "LISTENING", "CONNECTING", "CONNECTED", "BROKEN", "CLOSING", "CLOSED",
+    "NONEXIST"
+};
+
+// Medium concretizations
+
+// Waits until a descriptor opened in non-blocking mode by someone else
+// (such as the process feeding the pipe) is ready.
+static void WaitFd(int fd, short events) {
+  pollfd pfd = {fd, events, 0};
+  ::throw_on_interrupt = true;
+  int stat = poll(&pfd, 1, -1);
+  ::throw_on_interrupt = false;
+  if (stat == -1 && errno != EINTR)
+    throw runtime_error(string("poll: ") + strerror(errno));
+}
+
+// Byte stream read in large blocks: one read call fills the block, which
+// is then sliced into chunks, so that the stream costs one system call per
+// block rather than per chunk. The data are copied once, from the block
+// into the payload, just as they were from the iostream buffer before.
+// With -tsalign the chunks are cut to whole TS packets.
+class BlockSource: public Source {
+  bytevector m_block;
+  size_t m_begin = 0;
+  size_t m_end = 0;
+  bool m_eof = false;
+
+  static size_t Align(size_t chunk) {
+    if (ts_align && chunk >= TS_PACKET_SIZE)
+      chunk -= chunk % TS_PACKET_SIZE;
+    return chunk;
+  }
+
+  size_t Buffered() const { return m_end - m_begin; }
+
+  // Makes at least chunk bytes available, unless the stream ends first.
+  void Fill(size_t chunk) {
+    if (Buffered() >= chunk || m_eof)
+      return;
+    if (m_block.size() < max(read_block_size, chunk))
+      m_block.resize(max(read_block_size, chunk));
+    if (m_begin) {
+      memmove(m_block.data(), m_block.data() + m_begin, Buffered());
+      m_end -= m_begin;
+      m_begin = 0;
+    }
+    while (m_end < chunk && !m_eof) {
+      size_t n = ReadSome(m_block.data() + m_end, m_block.size() - m_end);
+      if (n == 0)
+        m_eof = true;
+      m_end += n;
+    }
+  }
+
+  void Slice(size_t chunk, bytevector &data) {
+    size_t n = min(chunk, Buffered());
+    data.resize(n);
+    memcpy(data.data(), m_block.data() + m_begin, n);
+    m_begin += n;
+  }
+
+ protected:
+  // Reads up to size bytes, as many as available, but at least one;
+  // returns 0 at the end of the stream.
+  virtual size_t ReadSome(char *buf, size_t size) = 0;
+
+  size_t ReadFd(int fd, char *buf, size_t size) {
+    for (;;) {
+      ::throw_on_interrupt = true;
+      ssize_t n = ::read(fd, buf, size);
+      ::throw_on_interrupt = false;
+      if (n >= 0)
+        return size_t(n);
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        WaitFd(fd, POLLIN);
+      else if (errno != EINTR)
+        throw runtime_error(string("read: ") + strerror(errno));
+    }
+  }
+
+ public:
+  // The descriptor read from, for splicing.
+  virtual int Descriptor() = 0;
+
+  void Read(size_t chunk, bytevector &data) override {
+    chunk = Align(chunk);
+    Fill(chunk);
+    Slice(chunk, data);
+  }
+
+  // Hands out all the whole chunks the block has, after reading one.
+  void ReadBatch(size_t chunk, size_t max, PacketPool &pool, vector<PacketRef> &batch) override {
+    Source::ReadBatch(chunk, max, pool, batch);
+    chunk = Align(chunk);
+    for (size_t n = 1; n < max && Buffered() >= chunk; ++n) {
+      PacketRef packet = pool.Get();
+      Slice(chunk, packet->payload);
+      batch.push_back(std::move(packet));
+    }
+  }
+
+  bool End() override { return m_eof && Buffered() == 0; }
+};
+
+class FileSource final: public BlockSource {
+  int m_fd;
+ public:
+
+  FileSource(const string &path) : m_fd(::open(path.c_str(), O_RDONLY)) {}
+  ~FileSource() {
+    if (m_fd != -1)
+      ::close(m_fd);
+  }
+
+  bool IsOpen() override { return m_fd != -1; }
+  int Descriptor() override { return m_fd; }
+
+ protected:
+  size_t ReadSome(char *buf, size_t size) override { return ReadFd(m_fd, buf, size); }
+};
+
+// Byte stream written straight to a descriptor, without going through
+// an iostream buffer.
+class FdTarget: public Target {
+  bool m_broken = false;
+
+ protected:
+  int m_fd;
+
+ public:
+  explicit FdTarget(int fd) : m_fd(fd) {}
+
+  void Write(const bytevector &data) override {
+    size_t done = 0;
+    while (done < data.size()) {
+      ::throw_on_interrupt = true;
+      ssize_t n = ::write(m_fd, data.data() + done, data.size() - done);
+      ::throw_on_interrupt = false;
+      if (n >= 0) {
+        done += n;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        WaitFd(m_fd, POLLOUT);
+      } else if (errno != EINTR) {
+        perror("write");
+        m_broken = true;
+        return;
+      }
+    }
+  }
+
+  bool IsOpen() override { return m_fd != -1; }
+  bool Broken() override { return m_broken; }
+  // The descriptor written to, for splicing.
+  int Descriptor() { return m_fd; }
+};
+
+class FileTarget final: public FdTarget {
+ public:
+
+  FileTarget(const string &path)
+      : FdTarget(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) {}
+  ~FileTarget() {
+    if (m_fd != -1)
+      ::close(m_fd);
+  }
+};
+
+template<class Iface>
+struct File;
+template<>
+struct File<Source> { typedef FileSource type; };
+template<>
+struct File<Target> { typedef FileTarget type; };
+
+template<class Iface>
+Iface *CreateFile(const string &name) { return new typename File<Iface>::type(name); }
+
+// Buffer sizes derived from the bandwidth-delay product of a stream.
+// SRT keeps its buffers in units of (MSS - 28) bytes, whereas the
+// payload size decides how many packets a given bitrate produces.
+struct BufferPlan {
+  int fc = 0;        //< SRTO_FC [packets]
+  int srt_bytes = 0; //< SRTO_SNDBUF / SRTO_RCVBUF [bytes]
+  int udp_bytes = 0; //< SRTO_UDP_SNDBUF / SRTO_UDP_RCVBUF, SO_RCVBUF / SO_SNDBUF [bytes]
+};
+
+const int SRT_MIN_FC = 32; // SRT silently raises anything lower to this
+const int UDP_MIN_BUFFER = 65536;
+
+BufferPlan PlanBuffers(int64_t bitrate, int window_ms, int payload_size, int mss,
+                       unsigned headroom) {
+  BufferPlan plan;
+  double bdp_bytes = double(bitrate) / 8 * window_ms / 1000;
+  double packets = bdp_bytes / payload_size * (100 + headroom) / 100;
+
+  plan.fc = max(SRT_MIN_FC, int(packets + 1));
+  plan.srt_bytes = plan.fc * (mss - 28);
+
+  // The system UDP buffer only needs to absorb a burst that arrives while
+  // the SRT receiver thread is busy, so a quarter of the window is enough.
+  plan.udp_bytes = max(UDP_MIN_BUFFER, plan.srt_bytes / 4);
+  return plan;
+}
+
+
+class SrtCommon {
+  int srt_conn_epoll = -1;
+  int m_sock_state = -1; //< Last state seen, to record the changes
+ public:
+  // Set by the route driving the medium, which records on its thread.
+  void AttachRecorder(FlightRecorder *flight) { m_flight = flight; }
+
+ protected:
+  FlightRecorder *m_flight = nullptr;
+
+  bool m_output_direction =
+      false; //< Defines which of SND or RCV option variant should be used, also to set SRT_SENDER for output
+  bool m_blocking_mode =
+      true; //< enforces using SRTO_SNDSYN or SRTO_RCVSYN, depending on @a m_output_direction
+  int m_timeout =
+      0; //< enforces using SRTO_SNDTIMEO or SRTO_RCVTIMEO, depending on @a m_output_direction
+  bool m_tsbpdmode = true;
+  bool m_autobuf = false; //< Size buffers from bitrate and latency (see PlanBuffers)
+  int64_t m_bitrate = 0;  //< Expected stream bitrate [bps], 0 if unknown
+  int m_buffer_bytes = 0; //< SRTO_SNDBUF/SRTO_RCVBUF as set by auto-sizing
+  int m_peak_sndbuf = 0;  //< Highest CBytePerfMon::byteSndBuf seen
+  int m_peak_rcvbuf = 0;  //< Highest CBytePerfMon::byteRcvBuf seen
+  map<string, string> m_options; // All other options, as provided in the URI
+  SRTSOCKET m_sock = SRT_INVALID_SOCK;
+  SRTSOCKET m_bindsock = SRT_INVALID_SOCK;
+  SRT_SOCKSTATUS SockState() {
+    SRT_SOCKSTATUS st = SRT_TRACED(srt_getsockstate)(m_sock);
+    if (m_flight && st != m_sock_state)
+      m_flight->Add(TscNow(), FLIGHT_SRT_STATE, st, m_sock);
+    m_sock_state = st;
+    return st;
+  }
+  bool IsUsable() {
+    SRT_SOCKSTATUS st = SockState();
+    return st > SRTS_INIT && st < SRTS_BROKEN;
+  }
+  bool IsBroken() { return SockState() > SRTS_CONNECTED; }
+
+  void Flight(FlightKind kind, int32_t a, int64_t b = 0, int64_t c = 0, uint16_t aux = 0) {
+    if (m_flight)
+      m_flight->Add(TscNow(), kind, a, b, c, aux);
+  }
+
+  void Init(string host, int port, map<string, string> par, bool dir_output) {
+    m_output_direction = dir_output;
+
+    // Application-specific options: mode, blocking, timeout, adapter
+    if (transmit_verbose) {
+      cout << "Parameters:\n";
+      for (map<string, string>::iterator i = par.begin(); i != par.end(); ++i) {
+        cout << "\t" << i->first << " = '" << i->second << "'\n";
+      }
+    }
+
+    string mode = "default";
+    if (par.count("mode"))
+      mode = par.at("mode");
+
+    if (mode == "default") {
+      // Use the following convention:
+      // 1. Server for source, Client for target
+      // 2. If host is empty, then always server.
+      if (host == "")
+        mode = "server";
+        //else if ( !dir_output )
+        //mode = "server";
+      else
+        mode = "client";
+    }
+    par.erase("mode");
+
+    if (par.count("blocking")) {
+      m_blocking_mode = !false_names.count(par.at("blocking"));
+      par.erase("blocking");
+    }
+
+    if (par.count("timeout")) {
+      m_timeout = stoi(par.at("timeout"), 0, 0);
+      par.erase("timeout");
+    }
+
+    string adapter = ""; // needed for rendezvous only
+    if (par.count("adapter")) {
+      adapter = par.at("adapter");
+      par.erase("adapter");
+    }
+
+    if (par.count("tsbpd") && false_names.count(par.at("tsbpd"))) {
+      m_tsbpdmode = false;
+    }
+
+    m_autobuf = ::autobuf_headroom != 0;
+    if (par.count("autobuf")) {
+      m_autobuf = !false_names.count(par.at("autobuf"));
+      par.erase("autobuf");
+    }
+
+    m_bitrate = ::stream_bitrate;
+    if (par.count("bitrate")) {
+      m_bitrate = stoll(par.at("bitrate"), 0, 0);
+      par.erase("bitrate");
+    }
+
+    // Assign the others here.
+    m_options = par;
+
+    if (transmit_verbose)
+      cout << "Opening SRT " << (dir_output ? "target" : "source") << " " << mode
+           << "(" << (m_blocking_mode ? "" : "non-") << "blocking)"
+           << " on " << host << ":" << port << endl;
+
+    int probe_mode;
+    if (mode == "client" || mode == "caller") {
+      OpenClient(host, port);
+      probe_mode = 0;
+    } else if (mode == "server" || mode == "listener") {
+      OpenServer(host == "" ? adapter : host, port);
+      probe_mode = 1;
+    } else if (mode == "rendezvous") {
+      OpenRendezvous(adapter, host, port);
+      probe_mode = 2;
+    } else {
+      throw std::invalid_argument("Invalid 'mode'. Use 'client' or 'server'");
+    }
+    TRANSMIT_PROBE(srt_connect, m_sock, probe_mode);
+  }
+
+  int AddPoller(SRTSOCKET socket, int modes) {
+    int pollid = SRT_TRACED(srt_epoll_create)();
+    if (pollid == -1)
+      throw std::runtime_error("Can't create epoll in nonblocking mode");
+    SRT_TRACED(srt_epoll_add_usock)(pollid, socket, &modes);
+    return pollid;
+  }
+
+  virtual int ConfigurePost(SRTSOCKET sock) {
+    bool yes = m_blocking_mode;
+    int result = 0;
+    if (m_output_direction) {
+      result = SRT_TRACED(srt_setsockopt)(sock, 0, SRTO_SNDSYN, &yes, sizeof yes);
+      if (result == -1)
+        return result;
+
+      if (m_timeout)
+        return SRT_TRACED(srt_setsockopt)(sock, 0, SRTO_SNDTIMEO, &m_timeout, sizeof m_timeout);
+    } else {
+      result = SRT_TRACED(srt_setsockopt)(sock, 0, SRTO_RCVSYN, &yes, sizeof yes);
+      if (result == -1)
+        return result;
+
+      if (m_timeout)
+        return SRT_TRACED(srt_setsockopt)(sock, 0, SRTO_RCVTIMEO, &m_timeout, sizeof m_timeout);
+    }
+
+    SrtConfigurePost(sock, m_options);
+
+    for (auto o: srt_options) {
+      if (o.binding == SocketOption::POST && m_options.count(o.name)) {
+        string value = m_options.at(o.name);
+        bool ok = o.apply<SocketOption::SRT>(sock, value);
+        if (transmit_verbose) {
+          if (!ok)
+            cout << "WARNING: failed to set '" << o.name << "' (post, "
+                 << (m_output_direction ? "target" : "source") << ") to " << value << endl;
+          else
+            cout << "NOTE: SRT/post::" << o.name << "=" << value << endl;
+        }
+      }
+    }
+
+    return 0;
+  }
+
+  virtual int ConfigurePre(SRTSOCKET sock) {
+    int result = 0;
+
+    int no = 0;
+    if (!m_tsbpdmode) {
+      result = SRT_TRACED(srt_setsockopt)(sock, 0, SRTO_TSBPDMODE, &no, sizeof no);
+      if (result == -1)
+        return result;
+    }
+
+    if (::srt_maxlossttl != 0) {
+      result = SRT_TRACED(srt_setsockopt)(sock, 0, SRTO_LOSSMAXTTL, &srt_maxlossttl,
+                                          sizeof srt_maxlossttl);
+      if (result == -1)
+        return result;
+    }
+
+    // Let's pretend async mode is set this way.
+    // This is for asynchronous connect.
+    int maybe = m_blocking_mode;
+    result = SRT_TRACED(srt_setsockopt)(sock, 0, SRTO_RCVSYN, &maybe, sizeof maybe);
+    if (result == -1)
+      return result;
+
+    //if ( m_timeout )
+    //    result = srt_setsockopt(sock, 0, SRTO_RCVTIMEO, &m_timeout, sizeof m_timeout);
+    //if ( result == -1 )
+    //    return result;
+
+    //if ( transmit_verbose )
+    //{
+    //    cout << "PRE: blocking mode set: " << yes << " timeout " << m_timeout << endl;
+    //}
+
+    // host is only checked for emptiness and depending on that the connection mode is selected.
+    // Here we are not exactly interested with that information.
+    vector<string> failures;
+    SocketOption::Mode conmode = SrtConfigurePre(sock, "", m_options, &failures);
+
+    if (transmit_verbose && conmode == SocketOption::FAILURE) {
+      cout << "WARNING: failed to set options: ";
+      copy(failures.begin(), failures.end(), ostream_iterator<string>(cout, ", "));
+      cout << endl;
+    }
+
+    // After the URI options: SRT converts the buffer sizes to packets
+    // of the MSS in effect at the time they are set.
+    if (m_autobuf) {
+      result = ConfigureBuffers(sock);
+      if (result == -1)
+        return result;
+    }
+
+    return 0;
+  }
+
+  int OptionValue(const char *name, int deflt) {
+    return m_options.count(name) ? stoi(m_options.at(name), 0, 0) : deflt;
+  }
+
+  // Sets the buffer sizes from bitrate x latency, unless they were given
+  // explicitly in the URI. The sender keeps packets until they are ACK-ed
+  // or dropped too late (1.25 x latency), the receiver holds them for the
+  // latency plus the time to recover a loss, so both use the same window.
+  int ConfigureBuffers(SRTSOCKET sock) {
+    if (m_bitrate <= 0) {
+      if (transmit_verbose)
+        cout << "WARNING: autobuf: no bitrate known (use -b or bitrate=), keeping defaults\n";
+      return 0;
+    }
+
+    int latency = OptionValue("latency", 120);
+    latency = OptionValue(m_output_direction ? "peerlatency" : "rcvlatency", latency);
+    int payload_size = OptionValue("payloadsize", DEFAULT_CHUNK);
+    int mss = 1500;
+    int mss_len = sizeof mss;
+    if (SRT_TRACED(srt_getsockopt)(sock, 0, SRTO_MSS, &mss, &mss_len) == -1)
+      mss = OptionValue("mss", 1500);
+
+    BufferPlan plan = PlanBuffers(m_bitrate, latency + latency / 4, payload_size, mss,
+                                  ::autobuf_headroom ? ::autobuf_headroom : 25);
+
+    // FC must go first, SRTO_RCVBUF is trimmed down to it.
+    struct {
+      const char *name;
+      SRT_SOCKOPT opt;
+      int value;
+    } settings[] = {
+        {"fc", SRTO_FC, plan.fc},
+        {"sndbuf", SRTO_SNDBUF, plan.srt_bytes},
+        {"rcvbuf", SRTO_RCVBUF, plan.srt_bytes},
+        {"udpsndbuf", SRTO_UDP_SNDBUF, plan.udp_bytes},
+        {"udprcvbuf", SRTO_UDP_RCVBUF, plan.udp_bytes}
+    };
+
+    for (auto &s: settings) {
+      if (m_options.count(s.name))
+        continue;
+      int result = SRT_TRACED(srt_setsockopt)(sock, 0, s.opt, &s.value, sizeof s.value);
+      if (result == -1)
+        return result;
+      if (transmit_verbose)
+        cout << "NOTE: autobuf: " << s.name << "=" << s.value << endl;
+    }
+
+    m_buffer_bytes = plan.srt_bytes;
+    if (transmit_verbose)
+      cout << "NOTE: autobuf: " << m_bitrate << "bps x " << latency << "ms latency, payload "
+           << payload_size << "B\n";
+    return 0;
+  }
+
+  void UpdateBufferPeak(const CBytePerfMon &perf) {
+    m_peak_sndbuf = max(m_peak_sndbuf, perf.byteSndBuf);
+    m_peak_rcvbuf = max(m_peak_rcvbuf, perf.byteRcvBuf);
+  }
+
+  void PrintBufferUsage() {
+    int peak = m_output_direction ? m_peak_sndbuf : m_peak_rcvbuf;
+    cout << "BUFFER PEAK: " << (m_output_direction ? "SND: " : "RCV: ") << peak << "B";
+    if (m_buffer_bytes)
+      cout << " of " << m_buffer_bytes << "B (" << (100.0 * peak / m_buffer_bytes) << "%)";
+    cout << endl;
+  }
+
+  void OpenClient(string host, int port) {
+    m_sock = SRT_TRACED(srt_socket)(AF_INET, SOCK_DGRAM, 0);
+    if (m_sock == SRT_ERROR)
+      Error(UDT::getlasterror(), "srt_socket");
+
+    int stat = ConfigurePre(m_sock);
+    if (stat == SRT_ERROR)
+      Error(UDT::getlasterror(), "ConfigurePre");
+
+    if (!m_blocking_mode) {
+      srt_conn_epoll = AddPoller(m_sock, SRT_EPOLL_OUT);
+    }
+
+    sockaddr_in sa = CreateAddrInet(host, port);
+    sockaddr *psa = (sockaddr *) &sa;
+    if (transmit_verbose) {
+      cout << "Connecting to " << host << ":" << port << " ... ";
+      cout.flush();
+    }
+    stat = SRT_TRACED(srt_connect)(m_sock, psa, sizeof sa);
+    if (stat == SRT_ERROR) {
+      SRT_TRACED(srt_close)(m_sock);
+      Error(UDT::getlasterror(), "UDT::connect");
+    }
+
+    if (!m_blocking_mode) {
+      if (transmit_verbose)
+        cout << "[ASYNC] " << flush;
+
+      /* SPIN-WAITING version. Don't use it unless you know what you're doing.
+
+      for (;;)
+      {
+          int state = UDT::getsockstate(m_sock);
+          if ( state < CONNECTED )
+          {
+              if ( verbose )
+                  cout << state << flush;
+              usleep(250000);
+              continue;
+          }
+          else if ( state > CONNECTED )
+          {
+              Error(UDT::getlasterror(), "UDT::connect status=" + udt_status_names[state]);
+          }
+
+          stat = 0; // fake that connect() returned 0
+          break;
+      }
+      */
+
+      // Socket readiness for connection is checked by polling on WRITE allowed sockets.
+      int len = 2;
+      SRTSOCKET ready[2];
+      if (SRT_TRACED(srt_epoll_wait)(srt_conn_epoll, 0, 0, ready, &len, -1, 0, 0, 0, 0) != -1) {
+        if (transmit_verbose) {
+          cout << "[EPOLL: " << len << " sockets] " << flush;
+        }
+      } else {
+        Error(UDT::getlasterror(), "srt_epoll_wait");
+      }
+    }
+
+    if (transmit_verbose)
+      cout << " connected.\n";
+    stat = ConfigurePost(m_sock);
+    if (stat == SRT_ERROR)
+      Error(UDT::getlasterror(), "ConfigurePost");
+  }
+
+  void Error(UDT::ERRORINFO &udtError, string src) {
+    int udtResult = udtError.getErrorCode();
+    if (transmit_verbose)
+      cout << "FAILURE\n" << src << ": [" << udtResult << "] " << udtError.getErrorMessage()
+           << endl;
+    udtError.clear();
+    throw std::invalid_argument("error in " + src);
+  }
+
+  void OpenServer(string host, int port) {
+    m_bindsock = SRT_TRACED(srt_socket)(AF_INET, SOCK_DGRAM, 0);
+    if (m_bindsock == SRT_ERROR)
+      Error(UDT::getlasterror(), "srt_socket");
+
+    int stat = ConfigurePre(m_bindsock);
+    if (stat == SRT_ERROR)
+      Error(UDT::getlasterror(), "ConfigurePre");
+
+    if (!m_blocking_mode) {
+      srt_conn_epoll = AddPoller(m_bindsock, SRT_EPOLL_OUT);
+    }
+
+    sockaddr_in sa = CreateAddrInet(host, port);
+    sockaddr *psa = (sockaddr *) &sa;
+    if (transmit_verbose) {
+      cout << "Binding a server on " << host << ":" << port << " ...";
+      cout.flush();
+    }
+    stat = SRT_TRACED(srt_bind)(m_bindsock, psa, sizeof sa);
+    if (stat == SRT_ERROR) {
+      SRT_TRACED(srt_close)(m_bindsock);
+      Error(UDT::getlasterror(), "srt_bind");
+    }
+
+    if (transmit_verbose) {
+      cout << " listen... ";
+      cout.flush();
+    }
+    stat = SRT_TRACED(srt_listen)(m_bindsock, 1);
+    if (stat == SRT_ERROR) {
+      SRT_TRACED(srt_close)(m_bindsock);
+      Error(UDT::getlasterror(), "srt_listen");
+    }
+
+    sockaddr_in scl;
+    int sclen = sizeof scl;
+    if (transmit_verbose) {
+      cout << " accept... ";
+      cout.flush();
+    }
+    ::throw_on_interrupt = true;
+
+    if (!m_blocking_mode) {
+      if (transmit_verbose)
+        cout << "[ASYNC] " << flush;
+
+      int len = 2;
+      SRTSOCKET ready[2];
+      if (SRT_TRACED(srt_epoll_wait)(srt_conn_epoll, 0, 0, ready, &len, -1, 0, 0, 0, 0) == -1)
+        Error(UDT::getlasterror(), "srt_epoll_wait");
+
+      if (transmit_verbose) {
+        cout << "[EPOLL: " << len << " sockets] " << flush;
+      }
+    }
+
+    m_sock = SRT_TRACED(srt_accept)(m_bindsock, (sockaddr *) &scl, &sclen);
+    if (m_sock == SRT_INVALID_SOCK) {
+      SRT_TRACED(srt_close)(m_bindsock);
+      Error(UDT::getlasterror(), "srt_accept");
+    }
+
+    if (transmit_verbose)
+      cout << " connected.\n";
+    ::throw_on_interrupt = false;
+
+    // ConfigurePre is done on bindsock, so any possible Pre flags
+    // are DERIVED by sock. ConfigurePost is done exclusively on sock.
+    stat = ConfigurePost(m_sock);
+    if (stat == SRT_ERROR)
+      Error(UDT::getlasterror(), "ConfigurePost");
+  }
+
+  void OpenRendezvous(string adapter, string host, int port) {
+    m_sock = SRT_TRACED(srt_socket)(AF_INET, SOCK_DGRAM, 0);
+    if (m_sock == SRT_ERROR)
+      Error(UDT::getlasterror(), "srt_socket");
+
+    bool yes = true;
+    SRT_TRACED(srt_setsockopt)(m_sock, 0, SRTO_RENDEZVOUS, &yes, sizeof yes);
+
+    int stat = ConfigurePre(m_sock);
+    if (stat == SRT_ERROR)
+      Error(UDT::getlasterror(), "ConfigurePre");
+
+    if (!m_blocking_mode) {
+      srt_conn_epoll = AddPoller(m_bindsock, SRT_EPOLL_OUT);
+    }
+
+    sockaddr_in localsa = CreateAddrInet(adapter, port);
+    sockaddr *plsa = (sockaddr *) &localsa;
+    if (transmit_verbose) {
+      cout << "Binding a server on " << adapter << ":" << port << " ...";
+      cout.flush();
+    }
+    stat = SRT_TRACED(srt_bind)(m_sock, plsa, sizeof localsa);
+    if (stat == SRT_ERROR) {
+      SRT_TRACED(srt_close)(m_sock);
+      Error(UDT::getlasterror(), "srt_bind");
+    }
+
+    sockaddr_in sa = CreateAddrInet(host, port);
+    sockaddr *psa = (sockaddr *) &sa;
+    if (transmit_verbose) {
+      cout << "Connecting to " << host << ":" << port << " ... ";
+      cout.flush();
+    }
+    stat = SRT_TRACED(srt_connect)(m_sock, psa, sizeof sa);
+    if (stat == SRT_ERROR) {
+      SRT_TRACED(srt_close)(m_sock);
+      Error(UDT::getlasterror(), "srt_connect");
+    }
+
+    if (transmit_verbose)
+      cout << " connected.\n";
+
+    stat = ConfigurePost(m_sock);
+    if (stat == SRT_ERROR)
+      Error(UDT::getlasterror(), "ConfigurePost");
+  }
+
+  ~SrtCommon() {
+    if (transmit_verbose)
+      cout << "SrtCommon: DESTROYING CONNECTION, closing sockets\n";
+    if (transmit_verbose && m_autobuf)
+      PrintBufferUsage();
+    if (m_sock != UDT::INVALID_SOCK) {
+      TRANSMIT_PROBE(srt_close, m_sock);
+      SRT_TRACED(srt_close)(m_sock);
+    }
+
+    if (m_bindsock != UDT::INVALID_SOCK)
+      SRT_TRACED(srt_close)(m_bindsock);
+  }
+};
+
+// Every how many packets the receiver takes a CBytePerfMon sample.
+const size_t SOURCE_STATS_SAMPLE = 64;
+
+class SrtSource final: public Source, public AsyncSource, public SrtCommon {
+  int srt_epoll = -1;
+  bool m_drain = false; //< Read all the available messages per readiness
+  size_t m_counter = 1;
+ public:
+
+  SrtSource(string host, int port, const map<string, string> &par) {
+    map<string, string> p = par;
+    if (p.count("drain")) {
+      m_drain = !false_names.count(p.at("drain"));
+      p.erase("drain");
+    }
+    // Draining reads until the receiver buffer is empty, which only
+    // a non-blocking socket can tell.
+    if (m_drain)
+      p["blocking"] = "no";
+
+    Init(host, port, p, false);
+
+    if (!m_blocking_mode) {
+      srt_epoll = AddPoller(m_sock, SRT_EPOLL_IN);
+    }
+  }
+
+  void Read(size_t chunk, bytevector &data) override {
+    data.resize(chunk);
+    int stat;
+    while ((stat = Receive(data.data(), chunk)) == 0)
+      WaitReadable();
+
+    data.resize(stat);
+    AfterRead(1);
+  }
+
+  // With drain=yes takes everything the receiver buffer has on every
+  // readiness, so that the Target gets the whole burst without the
+  // per-packet statistics and polling.
+  void ReadBatch(size_t chunk, size_t max, PacketPool &pool, vector<PacketRef> &batch) override {
+    if (!m_drain)
+      return Source::ReadBatch(chunk, max, pool, batch);
+
+    size_t count = 0;
+    for (;;) {
+      while (count < max) {
+        PacketRef packet = pool.Get();
+        bytevector &data = packet->payload;
+        data.resize(chunk);
+        int stat = Receive(data.data(), chunk);
+        if (stat == 0)
+          break;
+        data.resize(stat);
+        batch.push_back(std::move(packet));
+        ++count;
+      }
+      if (count)
+        break;
+      WaitReadable();
+    }
+    AfterRead(count);
+  }
+
+  virtual int ConfigurePre(UDTSOCKET sock) override {
+    int result = SrtCommon::ConfigurePre(sock);
+    if (result == -1)
+      return result;
+    // For sending party, the SRT_SENDER flag must be set, otherwise
+    // the connection will be pure UDT.
+    int yes = 1;
+
+    if (::bidirectional) {
+      result = SRT_TRACED(srt_setsockopt)(sock, 0, SRTO_TWOWAYDATA, &yes, sizeof yes);
+      if (result == -1)
+        return result;
+    }
+
+    return 0;
+  }
+
+  void SetNonBlocking() override {
+    bool no = false;
+    SRT_TRACED(srt_setsockopt)(m_sock, 0, SRTO_RCVSYN, &no, sizeof no);
+  }
+
+  PollHandle Poll() override { return PollHandle{true, m_sock}; }
+
+  bool TryRead(size_t chunk, bytevector &data) override {
+    data.resize(chunk);
+    SRT_MSGCTRL mctrl = srt_msgctrl_default;
+    int stat = SRT_TRACED(srt_recvmsg2)(m_sock, data.data(), chunk, &mctrl);
+    TRANSMIT_PROBE(srt_recv, m_sock, stat, mctrl.pktseq, mctrl.msgno);
+    Flight(FLIGHT_SRT_RECV, stat, mctrl.pktseq, mctrl.msgno);
+    if (stat == SRT_ERROR) {
+      data.clear();
+      if (srt_getlasterror(NULL) == SRT_EASYNCRCV)
+        return false;
+      Error(UDT::getlasterror(), "recvmsg");
+    }
+    data.resize(stat);
+    return true;
+  }
+
+  bool IsOpen() override { return IsUsable(); }
+  bool End() override { return IsBroken(); }
+
+ private:
+  // Returns the size of the message, or 0 if none is available yet.
+  int Receive(char *buf, size_t chunk) {
+    ::throw_on_interrupt = true;
+    SRT_MSGCTRL mctrl = srt_msgctrl_default;
+    int stat = SRT_TRACED(srt_recvmsg2)(m_sock, buf, chunk, &mctrl);
+    ::throw_on_interrupt = false;
+    TRANSMIT_PROBE(srt_recv, m_sock, stat, mctrl.pktseq, mctrl.msgno);
+    Flight(FLIGHT_SRT_RECV, stat, mctrl.pktseq, mctrl.msgno);
+    if (stat == SRT_ERROR) {
+      if (!m_blocking_mode && srt_getlasterror(NULL) == SRT_EASYNCRCV)
+        return 0;
+      Error(UDT::getlasterror(), "recvmsg");
+    }
+    return stat;
+  }
+
+  void WaitReadable() {
+    if (m_blocking_mode) {
+      // Not necessarily eof. Closed connection is reported as error.
+      this_thread::sleep_for(chrono::milliseconds(10));
+      return;
+    }
+    if (transmit_verbose) {
+      cout << "AGAIN: - waiting for data by epoll...\n";
+    }
+    // Poll on this descriptor until reading is available, indefinitely.
+    int len = 2;
+    SRTSOCKET ready[2];
+    // Untraced: every empty poll of the spin would count as a failed call.
+    if (SpinFor([&]() {
+          len = 2;
+          return srt_epoll_wait(srt_epoll, ready, &len, 0, 0, 0, 0, 0, 0, 0) > 0;
+        }))
+      return;
+    len = 2;
+    if (SRT_TRACED(srt_epoll_wait)(srt_epoll, ready, &len, 0, 0, -1, 0, 0, 0, 0) == -1)
+      Error(UDT::getlasterror(), "srt_epoll_wait");
+    if (transmit_verbose) {
+      cout << "... epoll reported ready " << len << " sockets\n";
+    }
+  }
+
+  // Whether any of the packets just read hits the frequency.
+  bool Crossed(size_t first, size_t freq) { return freq && m_counter / freq != first / freq; }
+
+  void AfterRead(size_t packets) {
+    size_t first = m_counter;
+    m_counter += packets;
+
+    bool bandwidth = Crossed(first, size_t(bw_report));
+    bool report = Crossed(first, stats_report_freq);
+    if (!bandwidth && !report && !Crossed(first, SOURCE_STATS_SAMPLE))
+      return;
+
+    CBytePerfMon perf;
+    if (SRT_TRACED(srt_bstats)(m_sock, &perf, false) == SRT_ERROR)
+      return;
+    TRANSMIT_PROBE(stats_sample, m_sock, perf.msRcvBuf, perf.pktRcvLossTotal, perf.pktRcvDropTotal,
+                   int64_t(perf.mbpsBandwidth * 1000));
+    Flight(FLIGHT_STATS, perf.msRcvBuf, perf.pktRcvLossTotal, perf.pktRcvDropTotal);
+    UpdateBufferPeak(perf);
+    if (bandwidth) {
+      cout << "+++/+++SRT BANDWIDTH: " << perf.mbpsBandwidth << endl;
+    }
+
+    if (report) {
+      PrintSrtStats(m_sock, perf);
+      if (m_autobuf)
+        PrintBufferUsage();
+    }
+  }
+};
+
+// Every how many packets the sender takes a CBytePerfMon sample.
+const size_t TARGET_STATS_SAMPLE = 64;
+
+// Default for how often the tracked input rate is pushed to the socket.
+const int BWTRACK_PERIOD_MS = 1000;
+
+// Default number of packets kept by the application when the sender
+// buffer is over the limit, for the drop-oldest and drop-age policies.
+const size_t OVERLOAD_QUEUE = 64;
+
+// Every how many overload checks the sender buffer is queried again.
+const size_t OVERLOAD_SAMPLE = 8;
+
+class SrtTarget final: public Target, public AsyncTarget, public SrtCommon {
+  typedef std::chrono::steady_clock::time_point time_point;
+  int srt_epoll = -1;
+  size_t m_counter = 0;
+
+  // Input rate tracking: "inputbw" feeds SRTO_INPUTBW (with SRTO_MAXBW=0
+  // SRT adds SRTO_OHEADBW on top), "maxbw" sets SRTO_MAXBW directly.
+  string m_bwtrack;
+  int m_bwtrack_period = BWTRACK_PERIOD_MS;
+  int m_oheadbw = 25; //< [%]
+  RateEstimator m_input_rate;
+  int64_t m_applied_bw = 0;
+  time_point m_applied_time;
+
+  unique_ptr<CongestionMonitor> m_congestion;
+
+  // What to do when the sender buffer holds more than m_overload_limit ms
+  // of data. Except for BLOCK the socket is switched to non-blocking
+  // sending, so that SRT never stalls the reading side. BLOCK is the
+  // plain blocking send of before: it waits for room in the buffer, and
+  // the limit doesn't apply to it.
+  enum Overload { BLOCK, DROP_NEWEST, DROP_OLDEST, DROP_AGE };
+  enum DropReason {
+    DROP_REASON_NEWEST, DROP_REASON_OLDEST, DROP_REASON_AGE, DROP_REASON_BUDGET, DROP_REASON_UNSENT,
+    DROP_REASON__SIZE
+  };
+  Overload m_overload = BLOCK;
+  int m_overload_limit = 0; //< [ms]; 0 means the latency
+  int m_overload_age = 0;   //< [ms]; 0 means the same as m_overload_limit
+  size_t m_overload_queue = OVERLOAD_QUEUE;
+  deque<MediaPacket> m_queue;
+  size_t m_snd_bytes = 0;    //< Sender buffer bytes at the last query, plus those sent since
+  size_t m_overload_checks = 0;
+  int m_sampled_snd_buf = 0; //< msSndBuf from the last stats sample
+  size_t m_dropped[DROP_REASON__SIZE] = {};
+  size_t m_dropped_bytes = 0;
+
+  // Packets that spent more than m_budget ms in the pipeline can't be
+  // delivered in time by the receiver anyway, so they are dropped
+  // before sending, and the rest is sent with the remaining msgttl.
+  int m_budget = 0; //< [ms]; 0 means no limit
+  LatencyHistogram m_residency;
+
+  StageStats *m_stages = nullptr; //< Of the pipeline writing, to time the wait for room
+ public:
+
+  void TrackStages(StageStats *stages) { m_stages = stages; }
+
+  SrtTarget(string host, int port, const map<string, string> &par) {
+    map<string, string> p = par;
+    if (p.count("bwtrack")) {
+      m_bwtrack = p.at("bwtrack");
+      if (m_bwtrack != "inputbw" && m_bwtrack != "maxbw")
+        throw std::invalid_argument("Invalid 'bwtrack'. Use 'inputbw' or 'maxbw'");
+      p.erase("bwtrack");
+    }
+    if (p.count("bwtrack_period")) {
+      m_bwtrack_period = stoi(p.at("bwtrack_period"), 0, 0);
+      p.erase("bwtrack_period");
+    }
+    if (p.count("oheadbw"))
+      m_oheadbw = stoi(p.at("oheadbw"), 0, 0);
+    m_applied_time = std::chrono::steady_clock::now();
+    bool congestion = p.count("congestion") && !false_names.count(p.at("congestion"));
+    p.erase("congestion");
+    ParseOverload(p);
+    if (p.count("budget")) {
+      m_budget = stoi(p.at("budget"), 0, 0);
+      p.erase("budget");
+    }
+
+    Init(host, port, p, true);
+
+    if (congestion) {
+      if (m_bitrate <= 0)
+        throw std::invalid_argument("'congestion' requires the stream bitrate (-b or bitrate=)");
+      int latency = OptionValue("peerlatency", OptionValue("latency", 120));
+      m_congestion.reset(new CongestionMonitor(m_bitrate, latency, [](const CongestionSignal &sig) {
+        cout << "+++/+++SRT CONGESTION: " << sig.state << " TARGET BITRATE: " << sig.target_bitrate
+             << " BANDWIDTH: " << sig.mbps_bandwidth << "Mb/s SNDBUF: " << sig.ms_snd_buf
+             << "ms DROP: " << sig.snd_drops << " LOSS: " << sig.snd_losses << endl;
+      }));
+    }
+
+    if (m_overload_limit == 0)
+      m_overload_limit = OptionValue("peerlatency", OptionValue("latency", 120));
+    if (m_overload_age == 0)
+      m_overload_age = m_overload_limit;
+
+    if (!m_blocking_mode) {
+      srt_epoll = AddPoller(m_sock, SRT_EPOLL_OUT);
+    }
+  }
+
+  void ParseOverload(map<string, string> &par) {
+    if (par.count("overload")) {
+      string policy = par.at("overload");
+      if (policy == "block")
+        m_overload = BLOCK;
+      else if (policy == "drop-newest")
+        m_overload = DROP_NEWEST;
+      else if (policy == "drop-oldest")
+        m_overload = DROP_OLDEST;
+      else if (policy == "drop-age")
+        m_overload = DROP_AGE;
+      else
+        throw std::invalid_argument(
+            "Invalid 'overload'. Use 'block', 'drop-newest', 'drop-oldest' or 'drop-age'");
+      par.erase("overload");
+    }
+
+    if (par.count("overload_limit")) {
+      m_overload_limit = stoi(par.at("overload_limit"), 0, 0);
+      par.erase("overload_limit");
+    }
+    if (par.count("overload_age")) {
+      m_overload_age = stoi(par.at("overload_age"), 0, 0);
+      par.erase("overload_age");
+    }
+    if (par.count("overload_queue")) {
+      m_overload_queue = stoul(par.at("overload_queue"), 0, 0);
+      par.erase("overload_queue");
+    }
+  }
+
+  virtual int ConfigurePre(SRTSOCKET sock) override {
+    int result = SrtCommon::ConfigurePre(sock);
+    if (result == -1)
+      return result;
+    // For sending party, the SRT_SENDER flag must be set, otherwise
+    // the connection will be pure UDT.
+    int yes = 1;
+
+    if (::bidirectional) {
+      result = SRT_TRACED(srt_setsockopt)(sock, 0, SRTO_TWOWAYDATA, &yes, sizeof yes);
+      if (result == -1)
+        return result;
+    } else {
+      result = SRT_TRACED(srt_setsockopt)(sock, 0, SRTO_SENDER, &yes, sizeof yes);
+      if (result == -1)
+        return result;
+    }
+
+    // SRTO_INPUTBW is only taken into account in the "relative" mode.
+    if (m_bwtrack == "inputbw" && !m_options.count("maxbw")) {
+      int64_t relative = 0;
+      result = SRT_TRACED(srt_setsockopt)(sock, 0, SRTO_MAXBW, &relative, sizeof relative);
+      if (result == -1)
+        return result;
+    }
+
+    return 0;
+  }
+
+  virtual int ConfigurePost(SRTSOCKET sock) override {
+    int result = SrtCommon::ConfigurePost(sock);
+    if (result == -1 || m_overload == BLOCK)
+      return result;
+
+    // Shedding load requires that sending never blocks.
+    bool no = false;
+    return SRT_TRACED(srt_setsockopt)(sock, 0, SRTO_SNDSYN, &no, sizeof no);
+  }
+
+  void Write(const bytevector &data) override {
+    Write(MediaPacket(bytevector(data), std::chrono::steady_clock::now()));
+  }
+
+  void Write(const MediaPacket &packet) override {
+    ::throw_on_interrupt = true;
+
+    if (m_overload == BLOCK) {
+      // Check first if it's ready to write.
+      // If not, wait indefinitely.
+      if (!m_blocking_mode) {
+        WaitWritable();
+        if (m_stages)
+          m_stages->Mark(STAGE_WAIT);
+      }
+      // The buffer may still have too little room for the packet, and
+      // then it waits again; a blocking socket only refuses on SRTO_SNDTIMEO.
+      while (!TrySend(packet)) {
+        if (m_blocking_mode)
+          Error(UDT::getlasterror(), "srt_sendmsg");
+        WaitWritable();
+      }
+    } else {
+      WriteShedding(packet);
+    }
+    ::throw_on_interrupt = false;
+
+    AfterWrite(packet.payload.size());
+  }
+
+  void WaitWritable() {
+    int ready[2];
+    int len = 2;
+    // Untraced, as in SrtSource::WaitReadable.
+    bool spun = SpinFor([&]() {
+      len = 2;
+      return srt_epoll_wait(srt_epoll, 0, 0, ready, &len, 0, 0, 0, 0, 0) > 0;
+    });
+    len = 2;
+    if (!spun && SRT_TRACED(srt_epoll_wait)(srt_epoll, 0, 0, ready, &len, -1, 0, 0, 0, 0) == SRT_ERROR)
+      Error(UDT::getlasterror(), "srt_epoll_wait");
+  }
+
+  void SetNonBlocking() override {
+    bool no = false;
+    SRT_TRACED(srt_setsockopt)(m_sock, 0, SRTO_SNDSYN, &no, sizeof no);
+  }
+
+  PollHandle Poll() override { return PollHandle{true, m_sock}; }
+
+  bool TryWrite(const MediaPacket &packet) override {
+    if (!TrySend(packet))
+      return false;
+    AfterWrite(packet.payload.size());
+    return true;
+  }
+
+  void AfterWrite(size_t size) {
+    m_input_rate.Add(size);
+    if (++m_counter % TARGET_STATS_SAMPLE == 0)
+      SampleStats();
+    if (stats_report_freq && m_counter % stats_report_freq == stats_report_freq - 1)
+      PrintSendStats();
+  }
+
+  void WriteShedding(const MediaPacket &packet) {
+    if (m_overload == DROP_NEWEST) {
+      if (Overloaded() || !TrySend(packet))
+        Drop(DROP_REASON_NEWEST, packet.payload.size());
+      return;
+    }
+
+    if (m_overload == DROP_AGE) {
+      time_point oldest = std::chrono::steady_clock::now() - std::chrono::milliseconds(m_overload_age);
+      while (!m_queue.empty() && m_queue.front().ingest_time < oldest) {
+        Drop(DROP_REASON_AGE, m_queue.front().payload.size());
+        m_queue.pop_front();
+      }
+    }
+
+    if (m_queue.size() >= m_overload_queue) {
+      Drop(m_overload == DROP_AGE ? DROP_REASON_AGE : DROP_REASON_OLDEST,
+           m_queue.front().payload.size());
+      m_queue.pop_front();
+    }
+    m_queue.push_back(packet);
+
+    while (!m_queue.empty() && !Overloaded()) {
+      if (!TrySend(m_queue.front()))
+        break;
+      m_queue.pop_front();
+    }
+  }
+
+  // At the end, sends what the overload queue still holds as far as the
+  // buffer takes it, and counts the rest as dropped. Packets over the
+  // budget are dropped by TrySend as usual.
+  void DrainQueue() {
+    try {
+      while (!m_queue.empty() && IsUsable() && !Overloaded() && TrySend(m_queue.front()))
+        m_queue.pop_front();
+    } catch (std::exception &) {
+      // The connection is gone; what's left is counted below.
+    }
+    for (const MediaPacket &packet: m_queue)
+      Drop(DROP_REASON_UNSENT, packet.payload.size());
+    m_queue.clear();
+  }
+
+  // Returns false when the sender buffer is full. A packet over the
+  // latency budget counts as consumed. The residency of a packet is
+  // recorded once, when it's sent or dropped, not on every retry.
+  bool TrySend(const MediaPacket &packet) {
+    using namespace std::chrono;
+    SRT_MSGCTRL mctrl = srt_msgctrl_default;
+
+    int64_t residency = duration_cast<microseconds>(steady_clock::now() - packet.ingest_time).count();
+    if (m_budget) {
+      int remaining = m_budget - int(residency / 1000);
+      if (remaining <= 0) {
+        m_residency.Add(residency);
+        Drop(DROP_REASON_BUDGET, packet.payload.size());
+        return true;
+      }
+      mctrl.msgttl = remaining;
+    }
+
+    const bytevector &data = packet.payload;
+    int stat = SRT_TRACED(srt_sendmsg2)(m_sock, data.data(), data.size(), &mctrl);
+    TRANSMIT_PROBE(srt_send, m_sock, stat, data.size(), mctrl.msgno);
+    Flight(FLIGHT_SRT_SEND, stat, mctrl.msgno);
+    if (stat != SRT_ERROR) {
+      m_residency.Add(residency);
+      m_snd_bytes += data.size();
+      return true;
+    }
+    if (srt_getlasterror(NULL) == SRT_EASYNCSND)
+      return false;
+    Error(UDT::getlasterror(), "srt_sendmsg");
+    return false;
+  }
+
+  // Whether the sender buffer spans more than the limit. The timespan is
+  // estimated from the buffered bytes and the input rate, falling back
+  // to the last msSndBuf until the rate is known. The buffer is only
+  // queried every OVERLOAD_SAMPLE checks, which takes the libsrt lock;
+  // in between, what was sent since counts as still buffered.
+  bool Overloaded() {
+    if (m_overload_checks++ % OVERLOAD_SAMPLE == 0) {
+      size_t blocks = 0, bytes = 0;
+      if (SRT_TRACED(srt_getsndbuffer)(m_sock, &blocks, &bytes) != SRT_ERROR)
+        m_snd_bytes = bytes;
+    }
+
+    double rate = m_input_rate.rate;
+    if (rate > 0)
+      return m_snd_bytes * 1000.0 / rate > m_overload_limit;
+    return m_sampled_snd_buf > m_overload_limit;
+  }
+
+  void Drop(DropReason reason, size_t size) {
+    TRANSMIT_PROBE(srt_drop, m_sock, int(reason), size);
+    Flight(FLIGHT_SRT_DROP, int32_t(size), 0, 0, uint16_t(reason));
+    ++m_dropped[reason];
+    m_dropped_bytes += size;
+    if (transmit_verbose)
+      cout << "(dropped: " << DropReasonName(reason) << ") ";
+  }
+
+  static const char *DropReasonName(DropReason reason) {
+    static const char *const names[DROP_REASON__SIZE] = {"newest", "oldest", "age", "budget",
+                                                         "unsent"};
+    return names[reason];
+  }
+
+  void PrintSendStats() {
+    m_residency.Print(cout, "PIPELINE RESIDENCY");
+    if (m_overload == BLOCK && !m_budget)
+      return;
+    cout << "DROPPED:";
+    for (int r = 0; r < DROP_REASON__SIZE; ++r)
+      cout << " " << DropReasonName(DropReason(r)) << "=" << m_dropped[r];
+    cout << " BYTES: " << m_dropped_bytes << " QUEUED: " << m_queue.size() << endl;
+  }
+
+  void SampleStats() {
+    time_point now = std::chrono::steady_clock::now();
+    m_input_rate.Sample(now);
+    if (m_bwtrack != "")
+      TrackInputRate(now);
+
+    if (!m_autobuf && !m_congestion && m_overload == BLOCK)
+      return;
+    CBytePerfMon perf;
+    if (SRT_TRACED(srt_bstats)(m_sock, &perf, false) == SRT_ERROR)
+      return;
+    TRANSMIT_PROBE(stats_sample, m_sock, perf.msSndBuf, perf.pktSndLossTotal, perf.pktSndDropTotal,
+                   int64_t(perf.mbpsBandwidth * 1000));
+    Flight(FLIGHT_STATS, perf.msSndBuf, perf.pktSndLossTotal, perf.pktSndDropTotal);
+    UpdateBufferPeak(perf);
+    m_sampled_snd_buf = perf.msSndBuf;
+    if (m_congestion)
+      m_congestion->Update(perf);
+  }
+
+  void TrackInputRate(time_point now) {
+    int64_t rate = int64_t(m_input_rate.rate);
+    if (now - m_applied_time < std::chrono::milliseconds(m_bwtrack_period))
+      return;
+    m_applied_time = now;
+
+    // Don't bother SRT with changes below 5%.
+    if (rate == 0)
+      return;
+    if (m_applied_bw && llabs(rate - m_applied_bw) * 20 < m_applied_bw)
+      return;
+
+    int stat;
+    if (m_bwtrack == "inputbw") {
+      stat = SRT_TRACED(srt_setsockopt)(m_sock, 0, SRTO_INPUTBW, &rate, sizeof rate);
+    } else {
+      int64_t maxbw = rate * (100 + m_oheadbw) / 100;
+      stat = SRT_TRACED(srt_setsockopt)(m_sock, 0, SRTO_MAXBW, &maxbw, sizeof maxbw);
+    }
+
+    if (stat == SRT_ERROR) {
+      if (transmit_verbose)
+        cout << "WARNING: bwtrack: failed to set " << m_bwtrack << ": "
+             << srt_getlasterror_str() << endl;
+      return;
+    }
+
+    m_applied_bw = rate;
+    if (transmit_verbose)
+      cout << "NOTE: bwtrack: input " << rate << "B/s, " << m_bwtrack << " updated\n";
+  }
+
+  bool IsOpen() override { return IsUsable(); }
+  bool Broken() override { return IsBroken(); }
+
+  ~SrtTarget() {
+    DrainQueue();
+    if (transmit_verbose)
+      PrintSendStats();
+  }
+};
+
+template<class Medium>
+void AttachRecorder(Medium &medium, FlightRecorder *flight) {
+  if (SrtCommon *c = dynamic_cast<SrtCommon *>(&medium))
+    c->AttachRecorder(flight);
+}
+
+template<class Iface>
+struct Srt;
+template<>
+struct Srt<Source> { typedef SrtSource type; };
+template<>
+struct Srt<Target> { typedef SrtTarget type; };
+
+template<class Iface>
+Iface *CreateSrt(const string &host, int port, const map<string, string> &par) {
+  return new typename Srt<Iface>::type(host, port, par);
+}
+
+class ConsoleSource final: public BlockSource {
+ public:
+
+  ConsoleSource() {
+  }
+
+  bool IsOpen() override { return true; }
+  int Descriptor() override { return STDIN_FILENO; }
+
+ protected:
+  size_t ReadSome(char *buf, size_t size) override { return ReadFd(STDIN_FILENO, buf, size); }
+};
+
+class ConsoleTarget final: public FdTarget {
+ public:
+
+  ConsoleTarget() : FdTarget(STDOUT_FILENO) {
+  }
+};
+
+template<class Iface>
+struct Console;
+template<>
+struct Console<Source> { typedef ConsoleSource type; };
+template<>
+struct Console<Target> { typedef ConsoleTarget type; };
+
+template<class Iface>
+Iface *CreateConsole() { return new typename Console<Iface>::type(); }
+
+
+// More options can be added in future.
+SocketOption udp_options[]{
+    {"iptos", IPPROTO_IP, IP_TOS, SocketOption::INT, SocketOption::PRE},
+    // IP_TTL and IP_MULTICAST_TTL are handled separately by a common option, "ttl".
+    {"mcloop", IPPROTO_IP, IP_MULTICAST_LOOP, SocketOption::INT, SocketOption::PRE},
+    {"rcvbuf", SOL_SOCKET, SO_RCVBUF, SocketOption::INT, SocketOption::PRE},
+    {"sndbuf", SOL_SOCKET, SO_SNDBUF, SocketOption::INT, SocketOption::PRE}
+};
+
+// How long a UDP reader may stall before its socket buffer overflows,
+// when the buffer is auto-sized.
+const int UDP_AUTOBUF_WINDOW_MS = 100;
+
+
+static inline bool IsMulticast(in_addr adr) {
+  unsigned char *abytes = (unsigned char *) &adr.s_addr;
+  unsigned char c = abytes[0];
+  return c >= 224 && c <= 239;
+}
+
+// Older system headers don't have the UDP offload options yet.
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL 40
+#endif
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE 33
+#endif
+
+// Limits of a single GSO send: the kernel's segment count limit and
+// the largest IPv4 UDP payload.
+const size_t UDP_GSO_MAX_SEGMENTS = 64;
+const size_t UDP_GSO_MAX_BYTES = 65507;
+
+// Most datagrams moved by one recvmmsg/sendmmsg.
+const size_t UDP_MMSG_BATCH = 64;
+
+class UdpCommon {
+ protected:
+  int m_sock = -1;
+  sockaddr_in sadr;
+  string adapter;
+  map<string, string> m_options;
+
+  void Setup(string host, int port, map<string, string> attr) {
+    m_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (m_sock == -1) {
+      perror("UdpCommon:socket");
+      throw std::runtime_error("UdpCommon: failed to create a socket");
+    }
+
+    int yes = 1;
+    ::setsockopt(m_sock, SOL_SOCKET, SO_REUSEADDR, (const char *) &yes, sizeof yes);
+
+    sadr = CreateAddrInet(host, port);
+
+    bool is_multicast = false;
+
+    if (attr.count("multicast")) {
+      if (!IsMulticast(sadr.sin_addr)) {
+        throw std::runtime_error(
+            "UdpCommon: requested multicast for a non-multicast-type IP address");
+      }
+      is_multicast = true;
+    } else if (IsMulticast(sadr.sin_addr)) {
+      is_multicast = true;
+    }
+
+    if (is_multicast) {
+      adapter = attr.count("adapter") ? attr.at("adapter") : string();
+      sockaddr_in maddr;
+      if (adapter == "") {
+        maddr.sin_family = AF_INET;
+        maddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        maddr.sin_port = htons(port); // necessary for temporary use
+      } else {
+        maddr = CreateAddrInet(adapter, port);
+      }
+
+      ip_mreq mreq;
+      mreq.imr_multiaddr.s_addr = sadr.sin_addr.s_addr;
+      mreq.imr_interface.s_addr = maddr.sin_addr.s_addr;
+#ifdef WIN32
+      const char* mreq_arg = (const char*)&mreq;
+            const auto status_error = SOCKET_ERROR;
+#else
+      const void *mreq_arg = &mreq;
+      const auto status_error = -1;
+#endif
+
+#if defined(WIN32) || defined(__CYGWIN__)
+      // On Windows it somehow doesn't work when bind()
+            // is called with multicast address. Write the address
+            // that designates the network device here.
+            // Also, sets port sharing when working with multicast
+            sadr = maddr;
+            int reuse = 1;
+            int shareAddrRes = setsockopt(m_sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+            if (shareAddrRes == status_error)
+            {
+                throw runtime_error("marking socket for shared use failed");
+            }
+#endif
+
+      int res = setsockopt(m_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, mreq_arg, sizeof(mreq));
+
+      if (res == status_error) {
+        throw runtime_error("adding to multicast membership failed");
+      }
+      attr.erase("multicast");
+      attr.erase("adapter");
+    }
+
+    // The "ttl" options is handled separately, it maps to either IP_TTL
+    // or IP_MULTICAST_TTL, depending on whether the address is sc or mc.
+    if (attr.count("ttl")) {
+      int ttl = stoi(attr.at("ttl"));
+      int res = setsockopt(m_sock, IPPROTO_IP, IP_TTL, (const char *) &ttl, sizeof ttl);
+      if (res == -1)
+        cout << "WARNING: failed to set 'ttl' (IP_TTL) to " << ttl << endl;
+      res = setsockopt(m_sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char *) &ttl, sizeof ttl);
+      if (res == -1)
+        cout << "WARNING: failed to set 'ttl' (IP_MULTICAST_TTL) to " << ttl << endl;
+
+      attr.erase("ttl");
+    }
+
+    bool autobuf = ::autobuf_headroom != 0;
+    if (attr.count("autobuf")) {
+      autobuf = !false_names.count(attr.at("autobuf"));
+      attr.erase("autobuf");
+    }
+
+    int64_t bitrate = ::stream_bitrate;
+    if (attr.count("bitrate")) {
+      bitrate = stoll(attr.at("bitrate"), 0, 0);
+      attr.erase("bitrate");
+    }
+
+    if (autobuf && bitrate > 0 && !attr.count("rcvbuf")) {
+      BufferPlan plan = PlanBuffers(bitrate, UDP_AUTOBUF_WINDOW_MS, DEFAULT_CHUNK, 1500,
+                                    ::autobuf_headroom ? ::autobuf_headroom : 25);
+      int size = max(UDP_MIN_BUFFER, plan.srt_bytes);
+      int res = setsockopt(m_sock, SOL_SOCKET, SO_RCVBUF, (const char *) &size, sizeof size);
+      if (res == -1)
+        cout << "WARNING: failed to set 'rcvbuf' (SO_RCVBUF) to " << size << endl;
+      else if (transmit_verbose)
+        cout << "NOTE: autobuf: udp rcvbuf=" << size << endl;
+    }
+
+    if (spin_us) {
+      int busy_poll = spin_us;
+      if (setsockopt(m_sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof busy_poll) == -1)
+        cout << "WARNING: failed to set SO_BUSY_POLL to " << busy_poll << "us: " << strerror(errno)
+             << endl;
+    }
+
+    m_options = attr;
+
+    for (auto o: udp_options) {
+      // Ignore "binding" - for UDP there are no post options.
+      if (m_options.count(o.name)) {
+        string value = m_options.at(o.name);
+        bool ok = o.apply<SocketOption::SYSTEM>(m_sock, value);
+        if (transmit_verbose && !ok)
+          cout << "WARNING: failed to set '" << o.name << "' to " << value << endl;
+      }
     }
+  }
 
-    if (::srt_maxlossttl != 0) {
-      result = srt_setsockopt(sock, 0, SRTO_LOSSMAXTTL, &srt_maxlossttl, sizeof srt_maxlossttl);
-      if (result == -1)
-        return result;
-    }
+  ~UdpCommon() {
+#ifdef WIN32
+    if (m_sock != -1)
+        {
+           shutdown(m_sock, SD_BOTH);
+           closesocket(m_sock);
+           m_sock = -1;
+        }
+#else
+    close(m_sock);
+#endif
+  }
+};
 
-    // Let's pretend async mode is set this way.
-    // This is for asynchronous connect.
-    int maybe = m_blocking_mode;
-    result = srt_setsockopt(sock, 0, SRTO_RCVSYN, &maybe, sizeof maybe);
-    if (result == -1)
-      return result;
 
-    //if ( m_timeout )
-    //    result = srt_setsockopt(sock, 0, SRTO_RCVTIMEO, &m_timeout, sizeof m_timeout);
-    //if ( result == -1 )
-    //    return result;
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
 
-    //if ( transmit_verbose )
-    //{
-    //    cout << "PRE: blocking mode set: " << yes << " timeout " << m_timeout << endl;
-    //}
+class ReuseportIngest;
+
+// Room for the control messages of one received datagram: the GRO
+// segment size, the kernel drop counter and the arrival time.
+const size_t UDP_RX_CONTROL =
+    CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(timespec));
+
+// Watches the receive side of a UDP socket with rxmon=yes. The kernel
+// reports with every datagram how many it dropped so far for lack of
+// room in the socket buffer (SO_RXQ_OVFL) and when the datagram arrived
+// (SO_TIMESTAMPNS). The arrivals are counted in windows of burst_us,
+// and a window with BURST_FACTOR times the average of the previous
+// second is a microburst. Drops are reported once a second; after drops
+// in SUSTAINED_SECONDS seconds in a row SO_RCVBUF is doubled, up to
+// rcvbuf_max.
+class UdpRxMonitor {
+ public:
+  static const int BURST_FACTOR = 4;
+  static const int BURST_MIN_PACKETS = 8;
+  static const int SUSTAINED_SECONDS = 2;
+  static const int HISTOGRAM_SIZE = 8; //< Windows with 1, 2-3, 4-7, ..., 128+ packets
 
-    // host is only checked for emptiness and depending on that the connection mode is selected.
-    // Here we are not exactly interested with that information.
-    vector<string> failures;
-    SocketOption::Mode conmode = SrtConfigurePre(sock, "", m_options, &failures);
+  bool On() const { return m_on; }
+  // Including the second not yet closed, which is often the one that matters.
+  uint64_t Drops() const { return m_drops + m_period_drops; }
 
-    if (transmit_verbose && conmode == SocketOption::FAILURE) {
-      cout << "WARNING: failed to set options: ";
-      copy(failures.begin(), failures.end(), ostream_iterator<string>(cout, ", "));
-      cout << endl;
+  void Enable(int sock, const map<string, string> &attr) {
+    if (!attr.count("rxmon") || false_names.count(attr.at("rxmon")))
+      return;
+    int yes = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof yes) == -1) {
+      cout << "WARNING: SO_RXQ_OVFL not supported by the system, kernel drops not reported\n";
+      return;
     }
-
-    return 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof yes) == -1)
+      cout << "WARNING: SO_TIMESTAMPNS not supported by the system, using the time read\n";
+    if (attr.count("burst_us"))
+      m_window_ns = max<int64_t>(stoll(attr.at("burst_us"), 0, 0), 1) * 1000;
+    if (attr.count("rcvbuf_max"))
+      m_rcvbuf_max = stoi(attr.at("rcvbuf_max"), 0, 0);
+    m_sock = sock;
+    m_rcvbuf = ReceiveBuffer();
+    m_on = true;
   }
 
-  void OpenClient(string host, int port) {
-    m_sock = srt_socket(AF_INET, SOCK_DGRAM, 0);
-    if (m_sock == SRT_ERROR)
-      Error(UDT::getlasterror(), "srt_socket");
+  // Takes the control messages of a datagram carrying the given number
+  // of packets (more than one if coalesced by GRO).
+  void Received(msghdr &mh, size_t packets) {
+    int64_t arrival = -1;
+    for (cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+      if (c->cmsg_level != SOL_SOCKET)
+        continue;
+      if (c->cmsg_type == SO_RXQ_OVFL) {
+        // Only sent once non-zero; counts all drops of the socket so far.
+        uint32_t total;
+        memcpy(&total, CMSG_DATA(c), sizeof total);
+        m_period_drops += uint32_t(total - m_kernel_total);
+        m_kernel_total = total;
+      } else if (c->cmsg_type == SCM_TIMESTAMPNS) {
+        timespec ts;
+        memcpy(&ts, CMSG_DATA(c), sizeof ts);
+        arrival = int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+      }
+    }
+    if (arrival == -1)
+      arrival = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+    Arrived(arrival, packets);
+  }
 
-    int stat = ConfigurePre(m_sock);
-    if (stat == SRT_ERROR)
-      Error(UDT::getlasterror(), "ConfigurePre");
+  void PrintStats(ostream &out) {
+    CloseWindow();
+    out << "UDP RX: kernel_dropped=" << Drops() << " rcvbuf=" << m_rcvbuf
+        << " microbursts=" << m_bursts_total << " peak=" << m_peak << "/" << m_window_ns / 1000
+        << "us windows:";
+    for (int i = 0; i < HISTOGRAM_SIZE; ++i)
+      out << " " << (1 << i) << (i == HISTOGRAM_SIZE - 1 ? "+" : "") << "=" << m_histogram[i];
+    out << endl;
+  }
 
-    if (!m_blocking_mode) {
-      srt_conn_epoll = AddPoller(m_sock, SRT_EPOLL_OUT);
+ private:
+  bool m_on = false;
+  int m_sock = -1;
+  int64_t m_window_ns = 100000;
+  int m_rcvbuf_max = 16 * 1024 * 1024; //< 0 keeps SO_RCVBUF as it is
+  int m_rcvbuf = 0;
+  bool m_at_limit = false;
+
+  uint32_t m_kernel_total = 0;
+  uint64_t m_drops = 0;
+  size_t m_period_drops = 0;
+  int m_drop_seconds = 0; //< Seconds in a row with drops
+
+  int64_t m_window_start = 0;
+  size_t m_window_packets = 0;
+  int64_t m_period_start = 0;
+  size_t m_period_packets = 0;
+  size_t m_period_bursts = 0;
+  size_t m_period_peak = 0;
+  size_t m_burst_threshold = 0; //< From the previous second; 0 while unknown
+  size_t m_bursts_total = 0;
+  size_t m_peak = 0;
+  uint64_t m_histogram[HISTOGRAM_SIZE] = {};
+
+  void Arrived(int64_t ns, size_t packets) {
+    if (!m_period_start)
+      m_period_start = m_window_start = ns;
+    if (ns - m_window_start >= m_window_ns) {
+      CloseWindow();
+      m_window_start = ns - (ns - m_window_start) % m_window_ns;
     }
+    m_window_packets += packets;
+    m_period_packets += packets;
+    if (ns - m_period_start >= 1000000000)
+      ClosePeriod(ns);
+  }
 
-    sockaddr_in sa = CreateAddrInet(host, port);
-    sockaddr *psa = (sockaddr *) &sa;
-    if (transmit_verbose) {
-      cout << "Connecting to " << host << ":" << port << " ... ";
-      cout.flush();
+  void CloseWindow() {
+    size_t n = m_window_packets;
+    if (!n)
+      return;
+    m_window_packets = 0;
+    int bucket = 0;
+    while (bucket < HISTOGRAM_SIZE - 1 && n >= (size_t(2) << bucket))
+      ++bucket;
+    ++m_histogram[bucket];
+    m_period_peak = max(m_period_peak, n);
+    m_peak = max(m_peak, n);
+    if (m_burst_threshold && n >= m_burst_threshold) {
+      ++m_period_bursts;
+      ++m_bursts_total;
     }
-    stat = srt_connect(m_sock, psa, sizeof sa);
-    if (stat == SRT_ERROR) {
-      srt_close(m_sock);
-      Error(UDT::getlasterror(), "UDT::connect");
+  }
+
+  void ClosePeriod(int64_t ns) {
+    int64_t windows = max<int64_t>((ns - m_period_start) / m_window_ns, 1);
+    m_burst_threshold = max<size_t>(BURST_MIN_PACKETS, BURST_FACTOR * m_period_packets / windows);
+
+    if (m_period_drops) {
+      m_drops += m_period_drops;
+      TRANSMIT_PROBE(udp_kernel_drop, m_sock, m_period_drops, m_drops);
+      cout << "WARNING: udp: kernel dropped " << m_period_drops << " packets in the last second"
+           << " (total " << m_drops << "), " << m_period_bursts << " microbursts, peak "
+           << m_period_peak << " packets in " << m_window_ns / 1000 << "us\n";
+      if (++m_drop_seconds >= SUSTAINED_SECONDS) {
+        GrowBuffer();
+        m_drop_seconds = 0;
+      }
+    } else {
+      m_drop_seconds = 0;
+      if (transmit_verbose && m_period_bursts)
+        cout << "NOTE: udp: " << m_period_bursts << " microbursts, peak " << m_period_peak
+             << " packets in " << m_window_ns / 1000 << "us\n";
     }
 
-    if (!m_blocking_mode) {
-      if (transmit_verbose)
-        cout << "[ASYNC] " << flush;
+    m_period_start = ns;
+    m_period_packets = m_period_drops = m_period_bursts = m_period_peak = 0;
+  }
 
-      /* SPIN-WAITING version. Don't use it unless you know what you're doing.
+  // The kernel doubles the value set for its bookkeeping, and reports
+  // it doubled.
+  int ReceiveBuffer() {
+    int size = 0;
+    socklen_t len = sizeof size;
+    getsockopt(m_sock, SOL_SOCKET, SO_RCVBUF, &size, &len);
+    return size / 2;
+  }
 
-      for (;;)
-      {
-          int state = UDT::getsockstate(m_sock);
-          if ( state < CONNECTED )
-          {
-              if ( verbose )
-                  cout << state << flush;
-              usleep(250000);
-              continue;
-          }
-          else if ( state > CONNECTED )
-          {
-              Error(UDT::getlasterror(), "UDT::connect status=" + udt_status_names[state]);
-          }
+  void GrowBuffer() {
+    if (!m_rcvbuf_max || m_at_limit)
+      return;
+    int size = min(m_rcvbuf_max, max(m_rcvbuf * 2, UDP_MIN_BUFFER));
+    // SO_RCVBUFFORCE isn't capped by net.core.rmem_max, but needs
+    // CAP_NET_ADMIN.
+    if (setsockopt(m_sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof size) == -1)
+      setsockopt(m_sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+    int was = m_rcvbuf;
+    m_rcvbuf = ReceiveBuffer();
+    if (m_rcvbuf > was)
+      cout << "NOTE: udp: sustained kernel drops, rcvbuf raised from " << was << " to "
+           << m_rcvbuf << endl;
+    if (m_rcvbuf <= was || m_rcvbuf >= m_rcvbuf_max) {
+      m_at_limit = true;
+      cout << "WARNING: udp: rcvbuf can't grow over " << m_rcvbuf
+           << (m_rcvbuf < m_rcvbuf_max ? " (see net.core.rmem_max)" : " (rcvbuf_max)") << endl;
+    }
+  }
+};
 
-          stat = 0; // fake that connect() returned 0
-          break;
-      }
-      */
+class UdpSource final: public Source, public AsyncSource, public UdpCommon {
+  bool eof = true;
+  unique_ptr<ReuseportIngest> m_ingest; //< With readers=N, the sockets read instead
+  // Batches are received with recvmmsg straight into the pooled packets,
+  // unless mmsg=no.
+  bool m_mmsg = true;
+  mmsghdr m_msgs[UDP_MMSG_BATCH];
+  iovec m_iov[UDP_MMSG_BATCH];
+  // The packets the slots receive into, kept across calls, so that only
+  // the ones the last call handed out are taken from the pool again.
+  PacketRef m_armed[UDP_MMSG_BATCH];
+  size_t m_armed_chunk = 0;
+  UdpRxMonitor m_rx;
+  char m_control[UDP_MMSG_BATCH][UDP_RX_CONTROL]; //< Only used with rxmon=yes
+  // With gro=yes the kernel coalesces consecutive datagrams of one flow,
+  // which are split here back into packets of m_gro_seg bytes.
+  bool m_gro = false;
+  bytevector m_gro_buf;
+  size_t m_gro_pos = 0;
+  size_t m_gro_len = 0;
+  size_t m_gro_seg = 0;
+
+  // Receives a datagram, possibly coalesced. Returns false if there's
+  // nothing to receive in MSG_DONTWAIT mode.
+  bool ReceiveGro(int flags) {
+    iovec iov = {m_gro_buf.data(), m_gro_buf.size()};
+    char control[UDP_RX_CONTROL];
+    msghdr mh;
+    memset(&mh, 0, sizeof mh);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof control;
+
+    int stat = recvmsg(m_sock, &mh, flags);
+    if (stat == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return false;
+    m_gro_pos = 0;
+    if (stat == -1 || stat == 0) {
+      eof = true;
+      m_gro_len = 0;
+      return true;
+    }
 
-      // Socket readiness for connection is checked by polling on WRITE allowed sockets.
-      int len = 2;
-      SRTSOCKET ready[2];
-      if (srt_epoll_wait(srt_conn_epoll, 0, 0, ready, &len, -1, 0, 0, 0, 0) != -1) {
-        if (transmit_verbose) {
-          cout << "[EPOLL: " << len << " sockets] " << flush;
-        }
-      } else {
-        Error(UDT::getlasterror(), "srt_epoll_wait");
+    m_gro_len = m_gro_seg = size_t(stat);
+    for (cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+      if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+        int seg;
+        memcpy(&seg, CMSG_DATA(c), sizeof seg);
+        m_gro_seg = size_t(seg);
       }
     }
+    if (m_rx.On())
+      m_rx.Received(mh, (m_gro_len + m_gro_seg - 1) / m_gro_seg);
+    return true;
+  }
 
-    if (transmit_verbose)
-      cout << " connected.\n";
-    stat = ConfigurePost(m_sock);
-    if (stat == SRT_ERROR)
-      Error(UDT::getlasterror(), "ConfigurePost");
+  // Receives a single datagram, with its control messages if watched.
+  int ReceiveOne(char *buf, size_t len, int flags) {
+    if (!m_rx.On())
+      return recv(m_sock, buf, len, flags);
+
+    iovec iov = {buf, len};
+    char control[UDP_RX_CONTROL];
+    msghdr mh;
+    memset(&mh, 0, sizeof mh);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof control;
+    int stat = recvmsg(m_sock, &mh, flags);
+    if (stat > 0)
+      m_rx.Received(mh, 1);
+    return stat;
   }
 
-  void Error(UDT::ERRORINFO &udtError, string src) {
-    int udtResult = udtError.getErrorCode();
-    if (transmit_verbose)
-      cout << "FAILURE\n" << src << ": [" << udtResult << "] " << udtError.getErrorMessage()
-           << endl;
-    udtError.clear();
-    throw std::invalid_argument("error in " + src);
+  size_t GroPending() const { return m_gro_len - m_gro_pos; }
+
+  void NextSegment(bytevector &data) {
+    size_t n = min(m_gro_seg, GroPending());
+    data.resize(n);
+    memcpy(data.data(), m_gro_buf.data() + m_gro_pos, n);
+    m_gro_pos += n;
   }
 
-  void OpenServer(string host, int port) {
-    m_bindsock = srt_socket(AF_INET, SOCK_DGRAM, 0);
-    if (m_bindsock == SRT_ERROR)
-      Error(UDT::getlasterror(), "srt_socket");
+ public:
 
-    int stat = ConfigurePre(m_bindsock);
-    if (stat == SRT_ERROR)
-      Error(UDT::getlasterror(), "ConfigurePre");
+  UdpSource(string host, int port, const map<string, string> &attr);
+  ~UdpSource();
 
-    if (!m_blocking_mode) {
-      srt_conn_epoll = AddPoller(m_bindsock, SRT_EPOLL_OUT);
+  // For the socket of one of the readers of a ReuseportIngest.
+  UdpSource(string host, int port, const map<string, string> &attr, bool reuseport) {
+    Setup(host, port, attr);
+    int yes = 1;
+    if (reuseport && setsockopt(m_sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes) == -1)
+      throw runtime_error(string("SO_REUSEPORT: ") + strerror(errno));
+    int stat = ::bind(m_sock, (sockaddr *) &sadr, sizeof sadr);
+    if (stat == -1) {
+      perror("bind");
+      throw runtime_error("bind failed, UDP cannot read");
     }
+    eof = false;
+    EnableGro(attr);
+    m_rx.Enable(m_sock, attr);
+  }
 
-    sockaddr_in sa = CreateAddrInet(host, port);
-    sockaddr *psa = (sockaddr *) &sa;
-    if (transmit_verbose) {
-      cout << "Binding a server on " << host << ":" << port << " ...";
-      cout.flush();
+  void EnableGro(const map<string, string> &attr) {
+    if (attr.count("mmsg"))
+      m_mmsg = !false_names.count(attr.at("mmsg"));
+    if (attr.count("gro") && !false_names.count(attr.at("gro"))) {
+      int yes = 1;
+      if (setsockopt(m_sock, SOL_UDP, UDP_GRO, &yes, sizeof yes) == -1) {
+        cout << "WARNING: UDP_GRO not supported by the system, receiving datagrams one by one\n";
+      } else {
+        m_gro = true;
+        m_gro_buf.resize(65535);
+      }
     }
-    stat = srt_bind(m_bindsock, psa, sizeof sa);
-    if (stat == SRT_ERROR) {
-      srt_close(m_bindsock);
-      Error(UDT::getlasterror(), "srt_bind");
+  }
+
+  int Socket() const { return m_sock; }
+  uint64_t KernelDrops() const { return m_rx.Drops(); }
+
+  void Arm(size_t i, size_t chunk, PacketPool &pool) {
+    m_armed[i] = pool.Get();
+    bytevector &data = m_armed[i]->payload;
+    data.resize(chunk);
+    m_iov[i].iov_base = data.data();
+    m_iov[i].iov_len = chunk;
+    memset(&m_msgs[i], 0, sizeof m_msgs[i]);
+    m_msgs[i].msg_hdr.msg_iov = &m_iov[i];
+    m_msgs[i].msg_hdr.msg_iovlen = 1;
+    if (m_rx.On()) {
+      m_msgs[i].msg_hdr.msg_control = m_control[i];
+      m_msgs[i].msg_hdr.msg_controllen = sizeof m_control[i];
     }
+  }
 
-    if (transmit_verbose) {
-      cout << " listen... ";
-      cout.flush();
+  void ReadMmsg(size_t chunk, size_t max, PacketPool &pool, vector<PacketRef> &batch) {
+    if (chunk != m_armed_chunk) {
+      for (PacketRef &packet: m_armed)
+        packet.reset();
+      m_armed_chunk = chunk;
     }
-    stat = srt_listen(m_bindsock, 1);
-    if (stat == SRT_ERROR) {
-      srt_close(m_bindsock);
-      Error(UDT::getlasterror(), "srt_listen");
+    for (size_t i = 0; i < max; ++i)
+      if (!m_armed[i])
+        Arm(i, chunk, pool);
+
+    // Blocks for the first datagram only, then takes what's there.
+    int stat = -1;
+    if (!SpinFor([&]() { return (stat = recvmmsg(m_sock, m_msgs, max, MSG_DONTWAIT, nullptr)) > 0; }))
+      stat = recvmmsg(m_sock, m_msgs, max, MSG_WAITFORONE, nullptr);
+    if (stat == -1 || stat == 0) {
+      eof = true;
+      batch.push_back(pool.Get());
+      return;
     }
 
-    sockaddr_in scl;
-    int sclen = sizeof scl;
-    if (transmit_verbose) {
-      cout << " accept... ";
-      cout.flush();
+    for (int i = 0; i < stat; ++i) {
+      m_armed[i]->payload.resize(m_msgs[i].msg_len);
+      if (m_rx.On())
+        m_rx.Received(m_msgs[i].msg_hdr, 1);
+      batch.push_back(std::move(m_armed[i]));
     }
-    ::throw_on_interrupt = true;
-
-    if (!m_blocking_mode) {
-      if (transmit_verbose)
-        cout << "[ASYNC] " << flush;
-
-      int len = 2;
-      SRTSOCKET ready[2];
-      if (srt_epoll_wait(srt_conn_epoll, 0, 0, ready, &len, -1, 0, 0, 0, 0) == -1)
-        Error(UDT::getlasterror(), "srt_epoll_wait");
+  }
 
-      if (transmit_verbose) {
-        cout << "[EPOLL: " << len << " sockets] " << flush;
-      }
+  void Read(size_t chunk, bytevector &data) override {
+    if (m_ingest)
+      return ReadIngest(data);
+    if (m_gro) {
+      if (!GroPending())
+        ReceiveGro(0);
+      NextSegment(data);
+      return;
     }
 
-    m_sock = srt_accept(m_bindsock, (sockaddr *) &scl, &sclen);
-    if (m_sock == SRT_INVALID_SOCK) {
-      srt_close(m_bindsock);
-      Error(UDT::getlasterror(), "srt_accept");
+    data.resize(chunk);
+    int stat = -1;
+    if (!SpinFor([&]() { return (stat = ReceiveOne(data.data(), chunk, MSG_DONTWAIT)) > 0; }))
+      stat = ReceiveOne(data.data(), chunk, 0);
+    if (stat == -1 || stat == 0) {
+      eof = true;
+      data.clear();
+      return;
     }
 
-    if (transmit_verbose)
-      cout << " connected.\n";
-    ::throw_on_interrupt = false;
-
-    // ConfigurePre is done on bindsock, so any possible Pre flags
-    // are DERIVED by sock. ConfigurePost is done exclusively on sock.
-    stat = ConfigurePost(m_sock);
-    if (stat == SRT_ERROR)
-      Error(UDT::getlasterror(), "ConfigurePost");
+    chunk = size_t(stat);
+    if (chunk < data.size())
+      data.resize(chunk);
   }
 
-  void OpenRendezvous(string adapter, string host, int port) {
-    m_sock = srt_socket(AF_INET, SOCK_DGRAM, 0);
-    if (m_sock == SRT_ERROR)
-      Error(UDT::getlasterror(), "srt_socket");
-
-    bool yes = true;
-    srt_setsockopt(m_sock, 0, SRTO_RENDEZVOUS, &yes, sizeof yes);
+  // Hands out all the segments of a coalesced datagram at once, and
+  // otherwise all the datagrams waiting in the socket.
+  void ReadBatch(size_t chunk, size_t max, PacketPool &pool, vector<PacketRef> &batch) override {
+    if (m_mmsg && !m_gro && !m_ingest)
+      return ReadMmsg(chunk, min(max, UDP_MMSG_BATCH), pool, batch);
+
+    Source::ReadBatch(chunk, max, pool, batch);
+    for (size_t n = 1; m_gro && n < max && GroPending(); ++n) {
+      PacketRef packet = pool.Get();
+      NextSegment(packet->payload);
+      batch.push_back(std::move(packet));
+    }
+  }
 
-    int stat = ConfigurePre(m_sock);
-    if (stat == SRT_ERROR)
-      Error(UDT::getlasterror(), "ConfigurePre");
+  PollHandle Poll() override { return PollHandle{false, m_sock}; }
 
-    if (!m_blocking_mode) {
-      srt_conn_epoll = AddPoller(m_bindsock, SRT_EPOLL_OUT);
+  bool TryRead(size_t chunk, bytevector &data) override {
+    if (m_gro) {
+      if (!GroPending() && !ReceiveGro(MSG_DONTWAIT)) {
+        data.clear();
+        return false;
+      }
+      NextSegment(data);
+      return true;
     }
 
-    sockaddr_in localsa = CreateAddrInet(adapter, port);
-    sockaddr *plsa = (sockaddr *) &localsa;
-    if (transmit_verbose) {
-      cout << "Binding a server on " << adapter << ":" << port << " ...";
-      cout.flush();
+    data.resize(chunk);
+    int stat = ReceiveOne(data.data(), chunk, MSG_DONTWAIT);
+    if (stat == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      data.clear();
+      return false;
     }
-    stat = srt_bind(m_sock, plsa, sizeof localsa);
-    if (stat == SRT_ERROR) {
-      srt_close(m_sock);
-      Error(UDT::getlasterror(), "srt_bind");
+    if (stat == -1 || stat == 0) {
+      eof = true;
+      data.clear();
+      return true;
     }
+    data.resize(stat);
+    return true;
+  }
 
-    sockaddr_in sa = CreateAddrInet(host, port);
-    sockaddr *psa = (sockaddr *) &sa;
-    if (transmit_verbose) {
-      cout << "Connecting to " << host << ":" << port << " ... ";
-      cout.flush();
-    }
-    stat = srt_connect(m_sock, psa, sizeof sa);
-    if (stat == SRT_ERROR) {
-      srt_close(m_sock);
-      Error(UDT::getlasterror(), "srt_connect");
-    }
+  void SetNonBlocking() override {
+    if (m_ingest)
+      throw invalid_argument("UDP source with readers can't be used in a route");
+  }
 
-    if (transmit_verbose)
-      cout << " connected.\n";
+  bool IsOpen() override { return m_sock != -1 || m_ingest; }
+  bool End() override { return eof; }
 
-    stat = ConfigurePost(m_sock);
-    if (stat == SRT_ERROR)
-      Error(UDT::getlasterror(), "ConfigurePost");
+ private:
+  void ReadIngest(bytevector &data);
+};
+
+// Orders in which ReuseportIngest merges the packets of its readers.
+enum IngestOrder { INGEST_ANY, INGEST_ARRIVAL, INGEST_RTP };
+
+// Default for the packets held per reader of a ReuseportIngest.
+const size_t INGEST_QUEUE = 1024;
+// Largest datagram a ReuseportIngest reader takes.
+const size_t INGEST_CHUNK = 1500;
+
+// Ingest of one UDP port by several threads: udp://...?readers=N opens N
+// SO_REUSEPORT sockets on the port, each read by its own thread into its
+// own queue. The kernel picks the socket per datagram as told by spread:
+// random (default; spreads even a single stream), cpu (the one of the CPU
+// that received it) or flow (the kernel's hash of the addresses, which
+// keeps a stream on one socket). Packets then leave in the given order:
+// any, arrival (the time read), or rtp (the RTP sequence number); for the
+// last two a packet waits up to reorder_ms for an earlier one to show up
+// at another reader. Not for a multicast group: the kernel gives each
+// datagram to every socket joined to it, so each reader would get all.
+class ReuseportIngest {
+  struct Reader {
+    unique_ptr<UdpSource> source;
+    deque<MediaPacket> queue;
+    std::thread thread;
+    size_t received = 0;
+    size_t dropped = 0; //< Oldest packets dropped with the queue full
+  };
+
+  vector<unique_ptr<Reader>> m_readers;
+  IngestOrder m_order;
+  std::chrono::microseconds m_window;
+  size_t m_queue_limit;
+  std::mutex m_lock;
+  std::condition_variable m_ready;
+  size_t m_running = 0;
+  size_t m_next = 0;          //< For INGEST_ANY, the reader to look at first
+  uint16_t m_last_seq = 0;    //< For INGEST_RTP, of the last packet out
+  bool m_seq_known = false;
+  size_t m_reordered = 0;     //< Packets that left before an earlier arrival
+
+  static bool HasRtpSeq(const bytevector &p) { return p.size() >= 12 && (uint8_t(p[0]) >> 6) == 2; }
+  static uint16_t RtpSeq(const bytevector &p) { return (uint8_t(p[2]) << 8) | uint8_t(p[3]); }
+
+  // Position of the packet in the output order; the smallest leaves first.
+  int64_t Key(const MediaPacket &packet) {
+    if (m_order == INGEST_RTP && m_seq_known && HasRtpSeq(packet.payload))
+      return int16_t(RtpSeq(packet.payload) - m_last_seq);
+    return packet.ingest_time.time_since_epoch().count();
   }
 
-  ~SrtCommon() {
-    if (transmit_verbose)
-      cout << "SrtCommon: DESTROYING CONNECTION, closing sockets\n";
-    if (m_sock != UDT::INVALID_SOCK)
-      srt_close(m_sock);
+  void Run(Reader *r) {
+    PinThread("udp reader");
+    for (;;) {
+      MediaPacket packet;
+      r->source->Read(INGEST_CHUNK, packet.payload);
+      packet.ingest_time = std::chrono::steady_clock::now();
+      std::lock_guard<std::mutex> lk(m_lock);
+      if (packet.payload.empty() && r->source->End()) {
+        --m_running;
+        m_ready.notify_one();
+        return;
+      }
+      ++r->received;
+      if (r->queue.size() >= m_queue_limit) {
+        r->queue.pop_front();
+        ++r->dropped;
+      }
+      r->queue.push_back(std::move(packet));
+      m_ready.notify_one();
+    }
+  }
 
-    if (m_bindsock != UDT::INVALID_SOCK)
-      srt_close(m_bindsock);
+  void AttachSpread(const string &spread) {
+    if (spread == "flow")
+      return;
+    uint32_t ad;
+    if (spread == "random")
+      ad = SKF_AD_RANDOM;
+    else if (spread == "cpu")
+      ad = SKF_AD_CPU;
+    else
+      throw invalid_argument("Unknown spread: '" + spread + "'; use random, cpu or flow");
+
+    sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t(SKF_AD_OFF + ad)},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, uint32_t(m_readers.size())},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    sock_fprog prog = {sizeof code / sizeof code[0], code};
+    // Any socket of the group sets the program for all.
+    int sock = m_readers[0]->source->Socket();
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog) == -1)
+      cout << "WARNING: can't set spread=" << spread << " (" << strerror(errno)
+           << "), the kernel spreads by flow\n";
   }
-};
 
-class SrtSource: public Source, public SrtCommon {
-  int srt_epoll = -1;
  public:
+  ReuseportIngest(const string &host, int port, map<string, string> attr, size_t readers) {
+    if (IsMulticast(CreateAddrInet(host, port).sin_addr))
+      throw invalid_argument("UDP readers=" + to_string(readers) + " on multicast group " + host
+                             + " would each read every packet; use one reader");
+    string order = attr.count("order") ? attr.at("order") : "any";
+    if (order == "any")
+      m_order = INGEST_ANY;
+    else if (order == "arrival")
+      m_order = INGEST_ARRIVAL;
+    else if (order == "rtp")
+      m_order = INGEST_RTP;
+    else
+      throw invalid_argument("Unknown order: '" + order + "'; use any, arrival or rtp");
+    m_window = std::chrono::microseconds(
+        int64_t(1000 * stod(attr.count("reorder_ms") ? attr.at("reorder_ms") : "2")));
+    m_queue_limit = attr.count("reader_queue") ? stoul(attr.at("reader_queue"), 0, 0) : INGEST_QUEUE;
+    string spread = attr.count("spread") ? attr.at("spread") : "random";
+    for (const char *key: {"readers", "order", "reorder_ms", "reader_queue", "spread"})
+      attr.erase(key);
+
+    for (size_t i = 0; i < readers; ++i) {
+      m_readers.emplace_back(new Reader);
+      m_readers.back()->source.reset(new UdpSource(host, port, attr, true));
+    }
+    AttachSpread(spread);
 
-  SrtSource(string host, int port, const map<string, string> &par) {
-    Init(host, port, par, false);
+    m_running = readers;
+    for (auto &r: m_readers)
+      r->thread = std::thread(&ReuseportIngest::Run, this, r.get());
+  }
 
-    if (!m_blocking_mode) {
-      srt_epoll = AddPoller(m_sock, SRT_EPOLL_IN);
+  ~ReuseportIngest() {
+    // Wakes up the readers blocked in recvfrom.
+    for (auto &r: m_readers)
+      shutdown(r->source->Socket(), SHUT_RD);
+    for (auto &r: m_readers)
+      r->thread.join();
+
+    if (transmit_verbose || stats_report_freq) {
+      for (size_t i = 0; i < m_readers.size(); ++i)
+        cout << "INGEST reader " << i << ": received=" << m_readers[i]->received
+             << " dropped=" << m_readers[i]->dropped
+             << " kernel_dropped=" << m_readers[i]->source->KernelDrops() << endl;
+      cout << "INGEST reordered=" << m_reordered << endl;
     }
   }
 
-  bytevector Read(size_t chunk) override {
-    static size_t counter = 1;
+  // Takes the next packet in order; data is left empty when all readers
+  // have ended.
+  void Read(bytevector &data) {
+    using namespace std::chrono;
+    std::unique_lock<std::mutex> lk(m_lock);
+    for (;;) {
+      Reader *best = nullptr;
+      int64_t best_key = 0;
+      bool all_have = true;
+      for (size_t n = 0; n < m_readers.size(); ++n) {
+        Reader *r = m_readers[(m_next + n) % m_readers.size()].get();
+        if (r->queue.empty()) {
+          all_have = false;
+          continue;
+        }
+        if (m_order == INGEST_ANY) {
+          best = r;
+          m_next = (m_next + n + 1) % m_readers.size();
+          break;
+        }
+        int64_t key = Key(r->queue.front());
+        if (!best || key < best_key) {
+          best = r;
+          best_key = key;
+        }
+      }
 
-    bytevector data(chunk);
-    bool ready = true;
-    int stat;
-    do {
-      ::throw_on_interrupt = true;
-      stat = srt_recvmsg(m_sock, data.data(), chunk);
-      ::throw_on_interrupt = false;
-      if (stat == SRT_ERROR) {
-        if (!m_blocking_mode) {
-          // EAGAIN for SRT READING
-          if (srt_getlasterror(NULL) == SRT_EASYNCRCV) {
-            if (transmit_verbose) {
-              cout << "AGAIN: - waiting for data by epoll...\n";
-            }
-            // Poll on this descriptor until reading is available, indefinitely.
-            int len = 2;
-            SRTSOCKET ready[2];
-            if (srt_epoll_wait(srt_epoll, ready, &len, 0, 0, -1, 0, 0, 0, 0) != -1) {
-              if (transmit_verbose) {
-                cout << "... epoll reported ready " << len << " sockets\n";
-              }
-              continue;
-            }
-            // If was -1, then passthru.
-          }
+      steady_clock::time_point now = steady_clock::now();
+      if (best && (m_order == INGEST_ANY || all_have || m_running < m_readers.size()
+          || now - best->queue.front().ingest_time >= m_window)) {
+        MediaPacket &packet = best->queue.front();
+        if (m_order == INGEST_RTP && HasRtpSeq(packet.payload)) {
+          if (m_seq_known && int16_t(RtpSeq(packet.payload) - m_last_seq) < 0)
+            ++m_reordered;
+          m_last_seq = RtpSeq(packet.payload);
+          m_seq_known = true;
         }
-        Error(UDT::getlasterror(), "recvmsg");
-        return bytevector();
+        swap(data, packet.payload);
+        best->queue.pop_front();
+        return;
+      }
+      if (!best && m_running == 0) {
+        data.clear();
+        return;
       }
 
-      if (stat == 0) {
-        // Not necessarily eof. Closed connection is reported as error.
-        this_thread::sleep_for(chrono::milliseconds(10));
-        ready = false;
+      if (best)
+        m_ready.wait_until(lk, best->queue.front().ingest_time + m_window);
+      else
+        m_ready.wait_for(lk, milliseconds(100));
+      if (int_state) {
+        data.clear();
+        return;
       }
-    } while (!ready);
+    }
+  }
 
-    chunk = size_t(stat);
-    if (chunk < data.size())
-      data.resize(chunk);
+  bool End() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    if (m_running)
+      return false;
+    for (auto &r: m_readers)
+      if (!r->queue.empty())
+        return false;
+    return true;
+  }
+};
 
-    CBytePerfMon perf;
-    srt_bstats(m_sock, &perf, false);
-    if (bw_report && int(counter % bw_report) == bw_report - 1) {
-      cout << "+++/+++SRT BANDWIDTH: " << perf.mbpsBandwidth << endl;
-    }
+UdpSource::UdpSource(string host, int port, const map<string, string> &attr) {
+  size_t readers = attr.count("readers") ? stoul(attr.at("readers"), 0, 0) : 1;
+  if (readers > 1) {
+    m_ingest.reset(new ReuseportIngest(host, port, attr, readers));
+    eof = false;
+    if (transmit_verbose)
+      cout << "NOTE: UDP ingest on port " << port << " by " << readers << " readers\n";
+    return;
+  }
 
-    if (stats_report_freq && counter % stats_report_freq == stats_report_freq - 1) {
-      //CPerfMon pmon;
-      //memset(&pmon, 0, sizeof pmon);
-      //UDT::perfmon(m_sock, &pmon, false);
-      //PrintSrtStats(m_sock, pmon);
-      PrintSrtStats(m_sock, perf);
+  Setup(host, port, attr);
+  int stat = ::bind(m_sock, (sockaddr *) &sadr, sizeof sadr);
+  if (stat == -1) {
+    perror("bind");
+    throw runtime_error("bind failed, UDP cannot read");
+  }
+  eof = false;
+  EnableGro(attr);
+  m_rx.Enable(m_sock, attr);
+}
+
+UdpSource::~UdpSource() {
+  if (m_rx.On() && (transmit_verbose || stats_report_freq))
+    m_rx.PrintStats(cout);
+}
+
+void UdpSource::ReadIngest(bytevector &data) {
+  m_ingest->Read(data);
+  if (data.empty())
+    eof = m_ingest->End() || int_state;
+}
+
+
+class UdpTarget final: public Target, public AsyncTarget, public UdpCommon {
+  // With gso=yes packets of equal size are collected and handed to the
+  // kernel in one send, which segments them (the last may be shorter).
+  bool m_gso = false;
+  bytevector m_gso_buf;
+  size_t m_gso_len = 0;
+  size_t m_gso_count = 0;
+  size_t m_gso_seg = 0;
+  // Otherwise the packets are held by reference and sent with one
+  // sendmmsg on Flush(), unless mmsg=no.
+  bool m_mmsg = true;
+  vector<PacketRef> m_held;
+  mmsghdr m_msgs[UDP_MMSG_BATCH];
+  iovec m_iov[UDP_MMSG_BATCH];
+
+  void SendHeld() {
+    size_t count = m_held.size();
+    for (size_t i = 0; i < count; ++i) {
+      bytevector &data = m_held[i]->payload;
+      m_iov[i].iov_base = data.data();
+      m_iov[i].iov_len = data.size();
+      memset(&m_msgs[i], 0, sizeof m_msgs[i]);
+      m_msgs[i].msg_hdr.msg_name = &sadr;
+      m_msgs[i].msg_hdr.msg_namelen = sizeof sadr;
+      m_msgs[i].msg_hdr.msg_iov = &m_iov[i];
+      m_msgs[i].msg_hdr.msg_iovlen = 1;
     }
 
-    ++counter;
+    for (size_t done = 0; done < count;) {
+      int stat = sendmmsg(m_sock, m_msgs + done, count - done, 0);
+      if (stat == -1) {
+        if (errno == EINTR)
+          continue;
+        m_held.clear();
+        perror("UdpTarget: write");
+        throw runtime_error("Error during write");
+      }
+      done += stat;
+    }
+    m_held.clear();
+  }
 
-    return data;
+  void Send(const char *data, size_t size) {
+    int stat = sendto(m_sock, data, size, 0, (sockaddr *) &sadr, sizeof sadr);
+    if (stat == -1) {
+      perror("UdpTarget: write");
+      throw runtime_error("Error during write");
+    }
   }
 
-  virtual int ConfigurePre(UDTSOCKET sock) override {
-    int result = SrtCommon::ConfigurePre(sock);
-    if (result == -1)
-      return result;
-    // For sending party, the SRT_SENDER flag must be set, otherwise
-    // the connection will be pure UDT.
-    int yes = 1;
+  void SendGso() {
+    if (m_gso_count == 0)
+      return;
 
-    if (::bidirectional) {
-      result = srt_setsockopt(sock, 0, SRTO_TWOWAYDATA, &yes, sizeof yes);
-      if (result == -1)
-        return result;
+    iovec iov = {m_gso_buf.data(), m_gso_len};
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    memset(control, 0, sizeof control);
+    msghdr mh;
+    memset(&mh, 0, sizeof mh);
+    mh.msg_name = &sadr;
+    mh.msg_namelen = sizeof sadr;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (m_gso_count > 1) {
+      mh.msg_control = control;
+      mh.msg_controllen = sizeof control;
+      cmsghdr *c = CMSG_FIRSTHDR(&mh);
+      c->cmsg_level = SOL_UDP;
+      c->cmsg_type = UDP_SEGMENT;
+      c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t seg = uint16_t(m_gso_seg);
+      memcpy(CMSG_DATA(c), &seg, sizeof seg);
     }
 
-    return 0;
+    int stat = sendmsg(m_sock, &mh, 0);
+    if (stat == -1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+      // The device or the kernel can't segment after all.
+      cout << "WARNING: UDP GSO failed (" << strerror(errno) << "), sending datagrams one by one\n";
+      m_gso = false;
+      for (size_t pos = 0; pos < m_gso_len; pos += m_gso_seg)
+        Send(m_gso_buf.data() + pos, min(m_gso_seg, m_gso_len - pos));
+    } else if (stat == -1) {
+      perror("UdpTarget: write");
+      throw runtime_error("Error during write");
+    }
+    m_gso_len = m_gso_count = 0;
   }
 
-  bool IsOpen() override { return IsUsable(); }
-  bool End() override { return IsBroken(); }
-};
-
-class SrtTarget: public Target, public SrtCommon {
-  int srt_epoll = -1;
  public:
+  UdpTarget(string host, int port, const map<string, string> &attr) {
+    Setup(host, port, attr);
 
-  SrtTarget(string host, int port, const map<string, string> &par) {
-    Init(host, port, par, true);
+    if (attr.count("mmsg"))
+      m_mmsg = !false_names.count(attr.at("mmsg"));
 
-    if (!m_blocking_mode) {
-      srt_epoll = AddPoller(m_sock, SRT_EPOLL_OUT);
+    if (attr.count("gso") && !false_names.count(attr.at("gso"))) {
+      int seg = 0;
+      socklen_t len = sizeof seg;
+      if (getsockopt(m_sock, SOL_UDP, UDP_SEGMENT, &seg, &len) == -1) {
+        cout << "WARNING: UDP_SEGMENT not supported by the system, sending datagrams one by one\n";
+      } else {
+        m_gso = true;
+        m_gso_buf.resize(UDP_GSO_MAX_BYTES);
+      }
     }
   }
 
-  virtual int ConfigurePre(SRTSOCKET sock) override {
-    int result = SrtCommon::ConfigurePre(sock);
-    if (result == -1)
-      return result;
-    // For sending party, the SRT_SENDER flag must be set, otherwise
-    // the connection will be pure UDT.
-    int yes = 1;
-
-    if (::bidirectional) {
-      result = srt_setsockopt(sock, 0, SRTO_TWOWAYDATA, &yes, sizeof yes);
-      if (result == -1)
-        return result;
-    } else {
-      result = srt_setsockopt(sock, 0, SRTO_SENDER, &yes, sizeof yes);
-      if (result == -1)
-        return result;
+  ~UdpTarget() {
+    try {
+      Flush();
+    } catch (...) {
     }
+  }
 
-    return 0;
+  void Write(const PacketRef &packet) override {
+    if (m_gso || !m_mmsg)
+      return Write(packet->payload);
+    m_held.push_back(packet);
+    if (m_held.size() == UDP_MMSG_BATCH)
+      SendHeld();
   }
 
   void Write(const bytevector &data) override {
-    ::throw_on_interrupt = true;
+    if (!m_gso || data.size() > UDP_GSO_MAX_BYTES) {
+      Flush();
+      return Send(data.data(), data.size());
+    }
 
-    // Check first if it's ready to write.
-    // If not, wait indefinitely.
-    if (!m_blocking_mode) {
-      int ready[2];
-      int len = 2;
-      if (srt_epoll_wait(srt_epoll, 0, 0, ready, &len, -1, 0, 0, 0, 0) == SRT_ERROR)
-        Error(UDT::getlasterror(), "srt_epoll_wait");
+    // Only the last segment may differ, and only by being shorter.
+    if (m_gso_count && (data.size() > m_gso_seg || m_gso_count == UDP_GSO_MAX_SEGMENTS
+        || m_gso_len + data.size() > UDP_GSO_MAX_BYTES)) {
+      SendGso();
+      if (!m_gso)
+        return Send(data.data(), data.size());
     }
+    if (m_gso_count == 0)
+      m_gso_seg = data.size();
+    memcpy(m_gso_buf.data() + m_gso_len, data.data(), data.size());
+    m_gso_len += data.size();
+    ++m_gso_count;
+    if (data.size() < m_gso_seg)
+      SendGso();
+  }
 
-    int stat = srt_sendmsg2(m_sock, data.data(), data.size(), nullptr);
-    if (stat == SRT_ERROR)
-      Error(UDT::getlasterror(), "srt_sendmsg");
-    ::throw_on_interrupt = false;
+  void Flush() override {
+    if (m_gso)
+      SendGso();
+    if (!m_held.empty())
+      SendHeld();
   }
 
-  bool IsOpen() override { return IsUsable(); }
-  bool Broken() override { return IsBroken(); }
+  PollHandle Poll() override { return PollHandle{false, m_sock}; }
 
+  bool TryWrite(const MediaPacket &packet) override {
+    const bytevector &data = packet.payload;
+    int stat = sendto(m_sock, data.data(), data.size(), MSG_DONTWAIT, (sockaddr *) &sadr,
+                      sizeof sadr);
+    if (stat == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return false;
+      perror("UdpTarget: write");
+      throw runtime_error("Error during write");
+    }
+    return true;
+  }
+
+  bool IsOpen() override { return m_sock != -1; }
+  bool Broken() override { return false; }
 };
 
 template<class Iface>
-struct Srt;
+struct Udp;
 template<>
-struct Srt<Source> { typedef SrtSource type; };
+struct Udp<Source> { typedef UdpSource type; };
 template<>
-struct Srt<Target> { typedef SrtTarget type; };
+struct Udp<Target> { typedef UdpTarget type; };
 
-template<class Iface>
-Iface *CreateSrt(const string &host, int port, const map<string, string> &par) {
-  return new typename Srt<Iface>::type(host, port, par);
-}
+// Most datagrams a MulticastHub takes in one recvmmsg.
+const size_t HUB_BATCH = 32;
+const size_t HUB_DATAGRAM = 1500;
+
+// Packets of one multicast group (and source, if source-specific) as
+// demultiplexed by a MulticastHub. The eventfd is readable while the
+// queue has packets, so that a Reactor can wait on it. The packets come
+// from the hub's pool and are shared by the channels they match.
+struct McChannel {
+  in_addr_t group;
+  in_addr_t source; //< INADDR_ANY for any-source multicast
+  std::mutex lock;
+  std::condition_variable ready;
+  deque<PacketRef> queue;
+  size_t received = 0;
+  size_t dropped = 0;
+  int event = -1;
+  bool closed = false;
+};
 
-class ConsoleSource: public Source {
- public:
+// One socket per port receiving any number of multicast groups: every
+// channel joins its group on it, and the datagrams are sorted into the
+// channels by their destination address, got with IP_PKTINFO. Reading is
+// done in batches with recvmmsg on the hub's own thread, straight into
+// pooled packets, so a datagram is neither copied nor allocated for here.
+class MulticastHub {
+  typedef pair<int, string> HubKey; //< Port and adapter
+  static std::mutex registry_lock;
+  static map<HubKey, std::weak_ptr<MulticastHub>> registry;
 
-  ConsoleSource() {
+  int m_sock = -1;
+  in_addr m_interface;
+  PacketPool m_pool;
+  std::mutex m_lock;
+  vector<std::shared_ptr<McChannel>> m_channels;
+  std::thread m_thread;
+  std::atomic<bool> m_stop{false};
+
+  void Membership(int option, const McChannel &ch) {
+    int res;
+    if (ch.source == INADDR_ANY) {
+      ip_mreq mreq;
+      mreq.imr_multiaddr.s_addr = ch.group;
+      mreq.imr_interface = m_interface;
+      res = setsockopt(m_sock, IPPROTO_IP, option, &mreq, sizeof mreq);
+    } else {
+      ip_mreq_source mreq;
+      memset(&mreq, 0, sizeof mreq);
+      mreq.imr_multiaddr.s_addr = ch.group;
+      mreq.imr_interface = m_interface;
+      mreq.imr_sourceaddr.s_addr = ch.source;
+      option = option == IP_ADD_MEMBERSHIP ? IP_ADD_SOURCE_MEMBERSHIP : IP_DROP_SOURCE_MEMBERSHIP;
+      res = setsockopt(m_sock, IPPROTO_IP, option, &mreq, sizeof mreq);
+    }
+    if (res == -1 && (option == IP_ADD_MEMBERSHIP || option == IP_ADD_SOURCE_MEMBERSHIP))
+      throw runtime_error(string("adding to multicast membership failed: ") + strerror(errno));
   }
 
-  bytevector Read(size_t chunk) override {
-    bytevector data(chunk);
-    bool st = cin.read(data.data(), chunk).good();
-    chunk = size_t(cin.gcount());
-    if (chunk == 0 && !st)
-      return bytevector();
+  bool Matches(const McChannel &ch, in_addr_t group, in_addr_t sender) {
+    return ch.group == group && (ch.source == INADDR_ANY || ch.source == sender);
+  }
 
-    if (chunk < data.size())
-      data.resize(chunk);
+  void Enqueue(McChannel &ch, PacketRef packet) {
+    std::lock_guard<std::mutex> chlk(ch.lock);
+    ++ch.received;
+    if (ch.queue.size() >= INGEST_QUEUE) {
+      ch.queue.pop_front();
+      ++ch.dropped;
+    }
+    ch.queue.push_back(std::move(packet));
+    if (ch.queue.size() == 1) {
+      uint64_t one = 1;
+      if (write(ch.event, &one, sizeof one) == -1)
+        perror("MulticastHub: eventfd");
+    }
+    ch.ready.notify_one();
+  }
 
-    return data;
+  // Queues the packet to every channel it matches, sharing it between
+  // them. The last one gets the reference of the hub, so that a single
+  // reader finds it unique and takes the payload over without a copy.
+  void Deliver(in_addr_t group, in_addr_t sender, PacketRef packet) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    McChannel *last = nullptr;
+    for (auto &ch: m_channels) {
+      if (!Matches(*ch, group, sender))
+        continue;
+      if (last)
+        Enqueue(*last, packet);
+      last = ch.get();
+    }
+    if (last)
+      Enqueue(*last, std::move(packet));
   }
 
-  bool IsOpen() override { return cin.good(); }
-  bool End() override { return cin.eof(); }
-};
+  // Points the i-th message at a fresh pooled packet.
+  void Arm(size_t i, PacketRef *armed, iovec *iov, mmsghdr *msgs, sockaddr_in *senders,
+           char *control, size_t control_size) {
+    armed[i] = m_pool.Get();
+    bytevector &data = armed[i]->payload;
+    data.resize(HUB_DATAGRAM);
+    iov[i].iov_base = data.data();
+    iov[i].iov_len = HUB_DATAGRAM;
+    memset(&msgs[i], 0, sizeof msgs[i]);
+    msgs[i].msg_hdr.msg_name = &senders[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof senders[i];
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control;
+    msgs[i].msg_hdr.msg_controllen = control_size;
+  }
 
-class ConsoleTarget: public Target {
- public:
+  void Run() {
+    PinThread("multicast hub");
+    const size_t control_size = CMSG_SPACE(sizeof(in_pktinfo));
+    vector<char> controls(HUB_BATCH * control_size);
+    sockaddr_in senders[HUB_BATCH];
+    iovec iov[HUB_BATCH];
+    mmsghdr msgs[HUB_BATCH];
+    PacketRef armed[HUB_BATCH];
+
+    while (!m_stop) {
+      // Only the slots handed out in the last round need a new packet;
+      // the kernel overwrites the lengths of the others.
+      for (size_t i = 0; i < HUB_BATCH; ++i) {
+        if (!armed[i]) {
+          Arm(i, armed, iov, msgs, senders, &controls[i * control_size], control_size);
+        } else {
+          msgs[i].msg_hdr.msg_namelen = sizeof senders[i];
+          msgs[i].msg_hdr.msg_controllen = control_size;
+        }
+      }
 
-  ConsoleTarget() {
-  }
+      // Blocks for the first datagram only, then takes what's there.
+      int n = recvmmsg(m_sock, msgs, HUB_BATCH, MSG_WAITFORONE, nullptr);
+      if (n <= 0) {
+        if (n == -1 && errno == EINTR)
+          continue;
+        break;
+      }
 
-  void Write(const bytevector &data) override {
-    cout.write(data.data(), data.size());
+      for (int i = 0; i < n; ++i) {
+        in_addr_t group = INADDR_ANY;
+        msghdr &mh = msgs[i].msg_hdr;
+        for (cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+          if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO) {
+            in_pktinfo info;
+            memcpy(&info, CMSG_DATA(c), sizeof info);
+            group = info.ipi_addr.s_addr;
+          }
+        }
+        armed[i]->payload.resize(msgs[i].msg_len);
+        Deliver(group, senders[i].sin_addr.s_addr, std::move(armed[i]));
+      }
+    }
+
+    std::lock_guard<std::mutex> lk(m_lock);
+    for (auto &ch: m_channels) {
+      std::lock_guard<std::mutex> chlk(ch->lock);
+      ch->closed = true;
+      ch->ready.notify_all();
+    }
   }
 
-  bool IsOpen() override { return cout.good(); }
-  bool Broken() override { return cout.eof(); }
-};
+  MulticastHub(int port, const string &adapter) {
+    m_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (m_sock == -1)
+      throw runtime_error("MulticastHub: failed to create a socket");
+    int yes = 1, no = 0;
+    setsockopt(m_sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+    setsockopt(m_sock, IPPROTO_IP, IP_PKTINFO, &yes, sizeof yes);
+    // Only the groups joined here, not any other on the port.
+    setsockopt(m_sock, IPPROTO_IP, IP_MULTICAST_ALL, &no, sizeof no);
+
+    m_interface.s_addr = htonl(INADDR_ANY);
+    if (adapter != "")
+      m_interface = CreateAddrInet(adapter, port).sin_addr;
 
-template<class Iface>
-struct Console;
-template<>
-struct Console<Source> { typedef ConsoleSource type; };
-template<>
-struct Console<Target> { typedef ConsoleTarget type; };
+    sockaddr_in sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(port);
+    if (::bind(m_sock, (sockaddr *) &sa, sizeof sa) == -1) {
+      close(m_sock);
+      throw runtime_error(string("MulticastHub: bind failed: ") + strerror(errno));
+    }
+    m_thread = std::thread(&MulticastHub::Run, this);
+  }
 
-template<class Iface>
-Iface *CreateConsole() { return new typename Console<Iface>::type(); }
+ public:
+  static std::shared_ptr<MulticastHub> Get(int port, const string &adapter) {
+    std::lock_guard<std::mutex> lk(registry_lock);
+    std::weak_ptr<MulticastHub> &slot = registry[HubKey(port, adapter)];
+    std::shared_ptr<MulticastHub> hub = slot.lock();
+    if (!hub) {
+      hub.reset(new MulticastHub(port, adapter));
+      slot = hub;
+    }
+    return hub;
+  }
 
+  ~MulticastHub() {
+    m_stop = true;
+    shutdown(m_sock, SHUT_RD);
+    m_thread.join();
+    close(m_sock);
+  }
 
-// More options can be added in future.
-SocketOption udp_options[]{
-    {"iptos", IPPROTO_IP, IP_TOS, SocketOption::INT, SocketOption::PRE},
-    // IP_TTL and IP_MULTICAST_TTL are handled separately by a common option, "ttl".
-    {"mcloop", IPPROTO_IP, IP_MULTICAST_LOOP, SocketOption::INT, SocketOption::PRE}
+  std::shared_ptr<McChannel> Join(in_addr_t group, in_addr_t source) {
+    auto ch = std::make_shared<McChannel>();
+    ch->group = group;
+    ch->source = source;
+    ch->event = eventfd(0, EFD_NONBLOCK);
+    if (ch->event == -1)
+      throw runtime_error("MulticastHub: can't create eventfd");
+
+    std::lock_guard<std::mutex> lk(m_lock);
+    bool joined = false;
+    for (auto &other: m_channels)
+      joined = joined || (other->group == group && other->source == source);
+    if (!joined)
+      Membership(IP_ADD_MEMBERSHIP, *ch);
+    m_channels.push_back(ch);
+    return ch;
+  }
+
+  void Leave(const std::shared_ptr<McChannel> &ch) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_channels.erase(std::remove(m_channels.begin(), m_channels.end(), ch), m_channels.end());
+    bool still = false;
+    for (auto &other: m_channels)
+      still = still || (other->group == ch->group && other->source == ch->source);
+    if (!still)
+      Membership(IP_DROP_MEMBERSHIP, *ch);
+    close(ch->event);
+  }
 };
 
+std::mutex MulticastHub::registry_lock;
+map<MulticastHub::HubKey, std::weak_ptr<MulticastHub>> MulticastHub::registry;
+
+// A multicast group read through the MulticastHub of its port:
+// udp://<group>:<port>?mcshared=yes[&source=<sender ip>][&adapter=<ip>].
+class McChannelSource final: public Source, public AsyncSource {
+  std::shared_ptr<MulticastHub> m_hub;
+  std::shared_ptr<McChannel> m_channel;
+  bool m_eof = false;
+
+  // Takes one packet; call with the channel locked and the queue not empty.
+  // The payload is moved over unless other channels still share it.
+  void Take(bytevector &data) {
+    PacketRef &front = m_channel->queue.front();
+    if (front.unique())
+      swap(data, front->payload);
+    else
+      data = front->payload;
+    m_channel->queue.pop_front();
+    if (m_channel->queue.empty()) {
+      uint64_t count;
+      if (read(m_channel->event, &count, sizeof count) == -1 && errno != EAGAIN)
+        perror("McChannelSource: eventfd");
+    }
+  }
 
-static inline bool IsMulticast(in_addr adr) {
-  unsigned char *abytes = (unsigned char *) &adr.s_addr;
-  unsigned char c = abytes[0];
-  return c >= 224 && c <= 239;
-}
+ public:
+  McChannelSource(const string &host, int port, const map<string, string> &par) {
+    sockaddr_in group = CreateAddrInet(host, port);
+    if (!IsMulticast(group.sin_addr))
+      throw invalid_argument("mcshared requires a multicast address: " + host);
+    in_addr_t source = INADDR_ANY;
+    if (par.count("source"))
+      source = CreateAddrInet(par.at("source"), port).sin_addr.s_addr;
+
+    m_hub = MulticastHub::Get(port, par.count("adapter") ? par.at("adapter") : "");
+    m_channel = m_hub->Join(group.sin_addr.s_addr, source);
+  }
 
-class UdpCommon {
- protected:
-  int m_sock = -1;
-  sockaddr_in sadr;
-  string adapter;
-  map<string, string> m_options;
+  ~McChannelSource() {
+    if (transmit_verbose || stats_report_freq)
+      cout << "MULTICAST channel: received=" << m_channel->received
+           << " dropped=" << m_channel->dropped << endl;
+    m_hub->Leave(m_channel);
+  }
 
-  void Setup(string host, int port, map<string, string> attr) {
-    m_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (m_sock == -1) {
-      perror("UdpCommon:socket");
-      throw std::runtime_error("UdpCommon: failed to create a socket");
+  void Read(size_t, bytevector &data) override {
+    std::unique_lock<std::mutex> lk(m_channel->lock);
+    while (m_channel->queue.empty() && !m_channel->closed && !int_state)
+      m_channel->ready.wait_for(lk, std::chrono::milliseconds(100));
+    if (m_channel->queue.empty()) {
+      m_eof = true;
+      data.clear();
+      return;
     }
+    Take(data);
+  }
 
-    int yes = 1;
-    ::setsockopt(m_sock, SOL_SOCKET, SO_REUSEADDR, (const char *) &yes, sizeof yes);
-
-    sadr = CreateAddrInet(host, port);
+  void ReadBatch(size_t chunk, size_t max, PacketPool &pool, vector<PacketRef> &batch) override {
+    Source::ReadBatch(chunk, max, pool, batch);
+    std::lock_guard<std::mutex> lk(m_channel->lock);
+    for (size_t n = 1; n < max && !m_channel->queue.empty(); ++n) {
+      PacketRef packet = pool.Get();
+      Take(packet->payload);
+      batch.push_back(std::move(packet));
+    }
+  }
 
-    bool is_multicast = false;
+  PollHandle Poll() override { return PollHandle{false, m_channel->event}; }
 
-    if (attr.count("multicast")) {
-      if (!IsMulticast(sadr.sin_addr)) {
-        throw std::runtime_error(
-            "UdpCommon: requested multicast for a non-multicast-type IP address");
-      }
-      is_multicast = true;
-    } else if (IsMulticast(sadr.sin_addr)) {
-      is_multicast = true;
+  bool TryRead(size_t, bytevector &data) override {
+    std::lock_guard<std::mutex> lk(m_channel->lock);
+    if (m_channel->queue.empty()) {
+      data.clear();
+      if (!m_channel->closed)
+        return false;
+      m_eof = true;
+      return true;
     }
+    Take(data);
+    return true;
+  }
 
-    if (is_multicast) {
-      adapter = attr.count("adapter") ? attr.at("adapter") : string();
-      sockaddr_in maddr;
-      if (adapter == "") {
-        maddr.sin_family = AF_INET;
-        maddr.sin_addr.s_addr = htonl(INADDR_ANY);
-        maddr.sin_port = htons(port); // necessary for temporary use
-      } else {
-        maddr = CreateAddrInet(adapter, port);
-      }
-
-      ip_mreq mreq;
-      mreq.imr_multiaddr.s_addr = sadr.sin_addr.s_addr;
-      mreq.imr_interface.s_addr = maddr.sin_addr.s_addr;
-#ifdef WIN32
-      const char* mreq_arg = (const char*)&mreq;
-            const auto status_error = SOCKET_ERROR;
-#else
-      const void *mreq_arg = &mreq;
-      const auto status_error = -1;
-#endif
+  bool IsOpen() override { return bool(m_channel); }
+  bool End() override { return m_eof; }
+};
 
-#if defined(WIN32) || defined(__CYGWIN__)
-      // On Windows it somehow doesn't work when bind()
-            // is called with multicast address. Write the address
-            // that designates the network device here.
-            // Also, sets port sharing when working with multicast
-            sadr = maddr;
-            int reuse = 1;
-            int shareAddrRes = setsockopt(m_sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
-            if (shareAddrRes == status_error)
-            {
-                throw runtime_error("marking socket for shared use failed");
-            }
-#endif
+template<class Iface>
+Iface *CreateUdp(const string &host, int port, const map<string, string> &par) {
+  return new typename Udp<Iface>::type(host, port, par);
+}
 
-      int res = setsockopt(m_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, mreq_arg, sizeof(mreq));
+template<>
+Source *CreateUdp<Source>(const string &host, int port, const map<string, string> &par) {
+  if (par.count("mcshared") && !false_names.count(par.at("mcshared")))
+    return new McChannelSource(host, port, par);
+  return new UdpSource(host, port, par);
+}
 
-      if (res == status_error) {
-        throw runtime_error("adding to multicast membership failed");
-      }
-      attr.erase("multicast");
-      attr.erase("adapter");
-    }
+// Defaults for the ring created by the reading side of shm://.
+const uint32_t SHM_SLOTS = 1024;
+const uint32_t SHM_SLOT_SIZE = 1500;
+// How long the writing side of shm:// waits for the reader to create the ring.
+const int SHM_ATTACH_TIMEOUT_MS = 30000;
+
+// Packets from a local producer (e.g. an encoder) through a ShmRing:
+// shm://name or shm:///path/to/file, ?slots=<n>&slot_size=<bytes>.
+class ShmSource final: public Source {
+  unique_ptr<ShmRing> m_ring;
+  bool m_eof = false;
+ public:
 
-    // The "ttl" options is handled separately, it maps to either IP_TTL
-    // or IP_MULTICAST_TTL, depending on whether the address is sc or mc.
-    if (attr.count("ttl")) {
-      int ttl = stoi(attr.at("ttl"));
-      int res = setsockopt(m_sock, IPPROTO_IP, IP_TTL, (const char *) &ttl, sizeof ttl);
-      if (res == -1)
-        cout << "WARNING: failed to set 'ttl' (IP_TTL) to " << ttl << endl;
-      res = setsockopt(m_sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char *) &ttl, sizeof ttl);
-      if (res == -1)
-        cout << "WARNING: failed to set 'ttl' (IP_MULTICAST_TTL) to " << ttl << endl;
+  ShmSource(const string &name, const map<string, string> &par) {
+    uint32_t slots = par.count("slots") ? stoul(par.at("slots"), 0, 0) : SHM_SLOTS;
+    uint32_t slot_size = par.count("slot_size") ? stoul(par.at("slot_size"), 0, 0) : SHM_SLOT_SIZE;
+    m_ring.reset(ShmRing::Create(name, slots, slot_size));
+    if (transmit_verbose)
+      cout << "Created shm ring '" << name << "': " << slots << " x " << slot_size << " bytes\n";
+  }
 
-      attr.erase("ttl");
+  void Read(size_t chunk, bytevector &data) override {
+    data.resize(max<size_t>(chunk, m_ring->SlotSize()));
+    int stat;
+    // Wakes up now and then to notice an interrupt.
+    while ((stat = m_ring->Read(data.data(), ShmRing::WAIT_MS)) == 0 && !int_state) {
     }
+    if (stat < 0)
+      m_eof = true;
+    data.resize(max(stat, 0));
+  }
 
-    m_options = attr;
+  bool IsOpen() override { return bool(m_ring); }
+  bool End() override { return m_eof; }
+};
 
-    for (auto o: udp_options) {
-      // Ignore "binding" - for UDP there are no post options.
-      if (m_options.count(o.name)) {
-        string value = m_options.at(o.name);
-        bool ok = o.apply<SocketOption::SYSTEM>(m_sock, value);
-        if (transmit_verbose && !ok)
-          cout << "WARNING: failed to set '" << o.name << "' to " << value << endl;
-      }
-    }
+class ShmTarget final: public Target {
+  unique_ptr<ShmRing> m_ring;
+  bool m_broken = false;
+ public:
+
+  ShmTarget(const string &name, const map<string, string> &) {
+    m_ring.reset(ShmRing::Attach(name, SHM_ATTACH_TIMEOUT_MS));
   }
 
-  ~UdpCommon() {
-#ifdef WIN32
-    if (m_sock != -1)
-        {
-           shutdown(m_sock, SD_BOTH);
-           closesocket(m_sock);
-           m_sock = -1;
-        }
-#else
-    close(m_sock);
-#endif
+  void Write(const bytevector &data) override {
+    int stat;
+    while ((stat = m_ring->Write(data.data(), data.size(), ShmRing::WAIT_MS)) == 1 && !int_state) {
+    }
+    if (stat < 0)
+      m_broken = true;
   }
+
+  bool IsOpen() override { return bool(m_ring); }
+  bool Broken() override { return m_broken; }
 };
 
+template<class Iface>
+struct Shm;
+template<>
+struct Shm<Source> { typedef ShmSource type; };
+template<>
+struct Shm<Target> { typedef ShmTarget type; };
+
+template<class Iface>
+Iface *CreateShm(const string &name, const map<string, string> &par) {
+  return new typename Shm<Iface>::type(name, par);
+}
 
-class UdpSource: public Source, public UdpCommon {
-  bool eof = true;
+#if TRANSMIT_XDP
+// How long the XDP media wait in one go, to notice an interrupt.
+const int XDP_WAIT_MS = 100;
+// Frames the XDP target queues before waking the kernel to send them:
+// what the kernel sends per wakeup in copy mode.
+const int XDP_TX_BATCH = 32;
+
+XdpSocket::Config XdpConfig(const map<string, string> &par) {
+  XdpSocket::Config cfg;
+  if (!par.count("iface"))
+    throw invalid_argument("xdp:// needs the interface: ?iface=<name>");
+  cfg.iface = par.at("iface");
+  if (par.count("queue"))
+    cfg.queue = stoul(par.at("queue"));
+  if (par.count("frames"))
+    cfg.frames = stoul(par.at("frames"), 0, 0);
+  if (par.count("mode")) {
+    const string &mode = par.at("mode");
+    if (mode != "skb" && mode != "auto")
+      throw invalid_argument("xdp:// mode must be skb or auto");
+    cfg.skb_mode = mode == "skb";
+  }
+  return cfg;
+}
+
+// UDP datagrams taken off the interface by an XDP program, past the
+// network stack: xdp://:port?iface=<name>[&queue=<n>][&mode=skb][&frames=<n>].
+// Only the datagrams to the port arriving on the queue come here, so the
+// flow must be steered to it (ethtool -N) on a multi-queue interface.
+// The payloads are copied from the UMEM into pooled packets, which keep
+// their own buffers, and the frames go straight back to the kernel.
+class XdpSource final: public Source {
+  unique_ptr<XdpSocket> m_sock;
  public:
 
-  UdpSource(string host, int port, const map<string, string> &attr) {
-    Setup(host, port, attr);
-    int stat = ::bind(m_sock, (sockaddr *) &sadr, sizeof sadr);
-    if (stat == -1) {
-      perror("bind");
-      throw runtime_error("bind failed, UDP cannot read");
-    }
-    eof = false;
+  XdpSource(const string &, int port, const map<string, string> &par) {
+    XdpSocket::Config cfg = XdpConfig(par);
+    cfg.rx_port = port;
+    m_sock.reset(new XdpSocket(cfg));
+    if (transmit_verbose)
+      cout << "XDP: receiving port " << port << " on " << cfg.iface << " queue " << cfg.queue
+           << (m_sock->DriverMode() ? " (driver hook, " : " (generic hook, ")
+           << (m_sock->ZeroCopy() ? "zero-copy)\n" : "copy)\n");
   }
 
-  bytevector Read(size_t chunk) override {
-    bytevector data(chunk);
-    sockaddr_in sa;
-    socklen_t si = sizeof(sockaddr_in);
-    int stat = recvfrom(m_sock, data.data(), chunk, 0, (sockaddr *) &sa, &si);
-    if (stat == -1 || stat == 0) {
-      eof = true;
-      return bytevector();
-    }
+  ~XdpSource() {
+    xdp_statistics st = m_sock->Statistics();
+    if (transmit_verbose && (st.rx_dropped || st.rx_ring_full || st.rx_fill_ring_empty_descs))
+      cout << "XDP: dropped " << st.rx_dropped << ", rx ring full " << st.rx_ring_full
+           << ", fill ring empty " << st.rx_fill_ring_empty_descs << endl;
+  }
 
-    chunk = size_t(stat);
-    if (chunk < data.size())
-      data.resize(chunk);
+  void Read(size_t chunk, bytevector &data) override {
+    data.clear();
+    while (data.empty() && !int_state) {
+      Receive(1, [&](const char *payload, size_t size) {
+        data.assign(payload, payload + min(size, chunk));
+      });
+    }
+  }
 
-    return data;
+  void ReadBatch(size_t chunk, size_t max, PacketPool &pool, vector<PacketRef> &batch) override {
+    size_t before = batch.size();
+    while (batch.size() == before && !int_state) {
+      Receive(max, [&](const char *payload, size_t size) {
+        PacketRef packet = pool.Get();
+        packet->payload.assign(payload, payload + min(size, chunk));
+        batch.push_back(std::move(packet));
+      });
+    }
+    if (batch.size() == before)
+      batch.push_back(pool.Get());
   }
 
-  bool IsOpen() override { return m_sock != -1; }
-  bool End() override { return eof; }
+  bool IsOpen() override { return bool(m_sock); }
+  bool End() override { return false; }
+
+ private:
+  template<class Fn>
+  void Receive(size_t max, Fn fn) {
+    m_sock->Receive(max, XDP_WAIT_MS, [&](const char *frame, size_t len) {
+      size_t size;
+      if (const char *payload = XdpUdpPayload(frame, len, size))
+        fn(payload, size);
+    });
+  }
 };
 
-class UdpTarget: public Target, public UdpCommon {
+// UDP datagrams built into raw frames and sent through an AF_XDP socket:
+// xdp://host:port?iface=<name>[&dmac=<mac>][&sport=<port>][&queue=<n>].
+// The next hop's MAC is taken from the ARP table unless given; the
+// source address is the interface's own.
+class XdpTarget final: public Target {
+  unique_ptr<XdpSocket> m_sock;
+  XdpEndpoint m_from, m_to;
+  uint16_t m_ip_id = 0;
+  int m_unsent = 0; //< Queued since the last wakeup
  public:
-  UdpTarget(string host, int port, const map<string, string> &attr) {
-    Setup(host, port, attr);
+
+  XdpTarget(const string &host, int port, const map<string, string> &par) {
+    XdpSocket::Config cfg = XdpConfig(par);
+    sockaddr_in to = CreateAddrInet(host, port);
+    m_to.ip = to.sin_addr.s_addr;
+    m_to.port = to.sin_port;
+    if (par.count("dmac")) {
+      if (!XdpSocket::ParseMac(par.at("dmac"), m_to.mac))
+        throw invalid_argument("XdpTarget: bad dmac: " + par.at("dmac"));
+    } else if (!XdpSocket::NeighborMac(m_to.ip, cfg.iface, m_to.mac)) {
+      throw invalid_argument("XdpTarget: no ARP entry for " + host + " on " + cfg.iface
+                             + ", give its MAC with dmac=");
+    }
+    XdpSocket::InterfaceMac(cfg.iface, m_from.mac);
+    m_from.ip = XdpSocket::InterfaceAddress(cfg.iface);
+    m_from.port = htons(uint16_t(par.count("sport") ? stoi(par.at("sport")) : port));
+
+    m_sock.reset(new XdpSocket(cfg));
+    if (transmit_verbose)
+      cout << "XDP: sending to " << host << ":" << port << " on " << cfg.iface
+           << (m_sock->ZeroCopy() ? " (zero-copy)\n" : " (copy)\n");
+  }
+
+  ~XdpTarget() {
+    try {
+      Flush();
+    } catch (...) {
+    }
   }
 
   void Write(const bytevector &data) override {
-    int stat = sendto(m_sock, data.data(), data.size(), 0, (sockaddr *) &sadr, sizeof sadr);
-    if (stat == -1) {
-      perror("UdpTarget: write");
-      throw runtime_error("Error during write");
+    if (data.size() > m_sock->FrameSize() - XdpSocket::HEADERS)
+      throw invalid_argument("XdpTarget: " + to_string(data.size()) + " bytes don't fit a frame");
+    char *frame;
+    while (!(frame = m_sock->TxFrame())) {
+      if (int_state)
+        return;
+      m_sock->Wait(XDP_WAIT_MS);
     }
+    m_sock->Send(frame, XdpBuildUdp(frame, m_from, m_to, m_ip_id++, data.data(), data.size()));
+    if (++m_unsent == XDP_TX_BATCH)
+      Flush();
   }
 
-  bool IsOpen() override { return m_sock != -1; }
+  void Flush() override {
+    m_sock->Kick();
+    m_unsent = 0;
+  }
+
+  bool IsOpen() override { return bool(m_sock); }
   bool Broken() override { return false; }
 };
 
 template<class Iface>
-struct Udp;
+struct Xdp;
 template<>
-struct Udp<Source> { typedef UdpSource type; };
+struct Xdp<Source> { typedef XdpSource type; };
 template<>
-struct Udp<Target> { typedef UdpTarget type; };
+struct Xdp<Target> { typedef XdpTarget type; };
 
 template<class Iface>
-Iface *CreateUdp(const string &host, int port, const map<string, string> &par) {
-  return new typename Udp<Iface>::type(host, port, par);
+Iface *CreateXdp(const string &host, int port, const map<string, string> &par) {
+  return new typename Xdp<Iface>::type(host, port, par);
 }
+#endif
 
 template<class Base>
 inline bool IsOutput() { return false; }
@@ -1338,6 +4655,20 @@ unique_ptr<Base> CreateMedium(const string &uri) {
 
   UriParser u(uri);
 
+  // Not a scheme UriParser knows.
+  if (u.proto() == "shm") {
+    ptr.reset(CreateShm<Base>(u.host() != "" ? u.host() : u.path(), u.parameters()));
+    return ptr;
+  }
+  if (u.proto() == "xdp") {
+#if TRANSMIT_XDP
+    ptr.reset(CreateXdp<Base>(u.host(), atoi(u.port().c_str()), u.parameters()));
+    return ptr;
+#else
+    throw invalid_argument("xdp:// isn't available: built without AF_XDP");
+#endif
+  }
+
   int iport = 0;
   switch (u.type()) {
     default:; // do nothing, return nullptr
@@ -1389,6 +4720,594 @@ unique_ptr<Base> CreateMedium(const string &uri) {
 }
 
 
+// How long the tee waits at close for its outputs to send what they have
+// queued. An output that is still stuck in a write then is abandoned.
+const int TEE_CLOSE_TIMEOUT_MS = 5000;
+
+// Sends the same packets to several targets. Every output has its own
+// thread and queue of references to the shared packets, so a slow or
+// stalled output only loses its own data and doesn't delay the others.
+class TeeTarget final: public Target {
+  struct Output {
+    string uri;
+    unique_ptr<Target> target;
+    std::thread thr;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::condition_variable done;
+    deque<PacketRef> queue;
+    bool closing = false;
+    bool finished = false; //< The thread has left Drain()
+    std::atomic<bool> broken{false};
+
+    size_t written = 0;
+    size_t dropped = 0; //< Packets that didn't fit into the queue
+    size_t peak_queue = 0;
+    LatencyHistogram lag; //< Time from ingest until the output got the packet
+  };
+
+  PacketPool m_pool; // for data that doesn't come in a pooled packet
+  vector<unique_ptr<Output>> m_outputs;
+
+  static void Run(Output *o) {
+    PinThread("tee output");
+    Drain(o);
+    std::lock_guard<std::mutex> lk(o->lock);
+    o->finished = true;
+    o->done.notify_one();
+  }
+
+  static void Drain(Output *o) {
+    using namespace std::chrono;
+    for (;;) {
+      PacketRef packet;
+      bool idle;
+      {
+        std::unique_lock<std::mutex> lk(o->lock);
+        o->ready.wait(lk, [o] { return o->closing || !o->queue.empty(); });
+        if (o->queue.empty())
+          return;
+        packet = std::move(o->queue.front());
+        o->queue.pop_front();
+        idle = o->queue.empty();
+      }
+
+      o->lag.Add(duration_cast<microseconds>(steady_clock::now() - packet->ingest_time).count());
+      try {
+        o->target->Write(packet);
+        if (idle)
+          o->target->Flush();
+        ++o->written;
+        if (!o->target->Broken())
+          continue;
+        cerr << "TEE: output '" << o->uri << "' broken\n";
+      } catch (std::exception &x) {
+        cerr << "TEE: output '" << o->uri << "' failed: " << x.what() << endl;
+      }
+
+      std::lock_guard<std::mutex> lk(o->lock);
+      o->broken = true;
+      o->queue.clear();
+      return;
+    }
+  }
+
+ public:
+  TeeTarget(const vector<string> &urls) {
+    for (const string &url: urls) {
+      unique_ptr<Output> o(new Output);
+      o->uri = url;
+      o->target = Target::Create(url);
+      if (!o->target)
+        throw invalid_argument("Unsupported tee output: " + url);
+      m_outputs.push_back(std::move(o));
+    }
+
+    for (auto &o: m_outputs)
+      o->thr = std::thread(Run, o.get());
+  }
+
+  void Write(const PacketRef &packet) override {
+    for (auto &o: m_outputs) {
+      if (o->broken)
+        continue;
+      {
+        std::lock_guard<std::mutex> lk(o->lock);
+        if (o->queue.size() >= tee_queue_limit) {
+          ++o->dropped;
+          continue;
+        }
+        o->queue.push_back(packet);
+        o->peak_queue = max(o->peak_queue, o->queue.size());
+      }
+      o->ready.notify_one();
+    }
+  }
+
+  void Write(const MediaPacket &packet) override {
+    PacketRef p = m_pool.Get();
+    *p = packet;
+    Write(p);
+  }
+
+  void Write(const bytevector &data) override {
+    PacketRef p = m_pool.Get();
+    p->payload = data;
+    p->ingest_time = std::chrono::steady_clock::now();
+    Write(p);
+  }
+
+  bool IsOpen() override {
+    for (auto &o: m_outputs) {
+      if (!o->broken && o->target->IsOpen())
+        return true;
+    }
+    return false;
+  }
+
+  // Broken only when no output is left.
+  bool Broken() override {
+    for (auto &o: m_outputs) {
+      if (!o->broken)
+        return false;
+    }
+    return true;
+  }
+
+  void PrintStats(ostream &out) {
+    for (auto &o: m_outputs) {
+      if (!o)
+        continue;
+      out << "TEE OUTPUT '" << o->uri << "': written=" << o->written << " dropped=" << o->dropped
+          << " peak-queue=" << o->peak_queue << (o->broken ? " BROKEN" : "") << endl;
+      o->lag.Print(out, "\tLAG");
+    }
+  }
+
+  ~TeeTarget() {
+    // Let every output flush what it has queued.
+    for (auto &o: m_outputs) {
+      {
+        std::lock_guard<std::mutex> lk(o->lock);
+        o->closing = true;
+      }
+      o->ready.notify_one();
+    }
+    // A target blocked in a write can't be interrupted from here, so after
+    // the timeout its thread is left running, together with the Output it
+    // uses; the process is about to exit anyway.
+    auto deadline = std::chrono::steady_clock::now()
+                    + std::chrono::milliseconds(TEE_CLOSE_TIMEOUT_MS);
+    for (auto &o: m_outputs) {
+      bool finished;
+      size_t queued;
+      {
+        std::unique_lock<std::mutex> lk(o->lock);
+        finished = o->done.wait_until(lk, deadline, [&o] { return o->finished; });
+        queued = o->queue.size();
+      }
+      if (finished) {
+        o->thr.join();
+        continue;
+      }
+      cerr << "TEE: output '" << o->uri << "' stuck with " << queued
+           << " packets queued, abandoning it\n";
+      o->thr.detach();
+      o.release();
+    }
+
+    if (transmit_verbose)
+      PrintStats(cout);
+  }
+};
+
+unique_ptr<Target> Target::Create(const vector<string> &urls) {
+  if (urls.size() == 1)
+    return Create(urls[0]);
+  return unique_ptr<Target>(new TeeTarget(urls));
+}
+
+// Which Write() overload a target implements itself: the payload only,
+// the stamped packet, or the shared reference. The pipeline calls that
+// one directly, instead of going through the forwarding ones in Target.
+enum WriteKind { WRITE_PAYLOAD, WRITE_PACKET, WRITE_REF };
+
+template<class TargetT>
+struct TargetWrite { static const WriteKind kind = WRITE_PAYLOAD; };
+template<>
+struct TargetWrite<SrtTarget> { static const WriteKind kind = WRITE_PACKET; };
+template<>
+struct TargetWrite<UdpTarget> { static const WriteKind kind = WRITE_REF; };
+template<>
+struct TargetWrite<TeeTarget> { static const WriteKind kind = WRITE_REF; };
+template<>
+struct TargetWrite<Target> { static const WriteKind kind = WRITE_REF; };
+
+// The transmission loop, compiled for a concrete pair of media. As the
+// media classes are final, Read(), Write(), End() and Broken() are
+// resolved statically and can be inlined; Broken() of UdpTarget, for
+// example, disappears completely. Of them only Write() runs per packet:
+// End() only for an empty read, and Broken() once per read batch. Pipeline<Source, Target>
+// is the generic version, used for anything not known here.
+template<class SourceT, class TargetT>
+class Pipeline {
+  typedef std::integral_constant<WriteKind, WRITE_PAYLOAD> PayloadTag;
+  typedef std::integral_constant<WriteKind, WRITE_PACKET> PacketTag;
+  typedef std::integral_constant<WriteKind, WRITE_REF> RefTag;
+
+  SourceT &m_src;
+  TargetT &m_tar;
+  PacketPool &m_pool;
+  FilterChain &m_filters;
+  const PipelineConfig &m_cfg;
+
+  void Deliver(const PacketRef &packet, PayloadTag) { m_tar.Write(packet->payload); }
+  void Deliver(const PacketRef &packet, PacketTag) { m_tar.Write(*packet); }
+  void Deliver(const PacketRef &packet, RefTag) { m_tar.Write(packet); }
+  void Deliver(const PacketRef &packet) {
+    Deliver(packet, std::integral_constant<WriteKind, TargetWrite<TargetT>::kind>());
+    uint64_t send_ticks = m_stages ? m_stages->Mark(STAGE_SEND) : 0;
+    if (m_flight)
+      m_flight->Add(m_stages ? m_stages->Cursor() : TscNow(), FLIGHT_WRITE,
+                    int32_t(packet->payload.size()), packet->seq, send_ticks);
+    TRANSMIT_PROBE(packet_write, 0, packet->seq, packet->payload.size(), packet->IngestNs());
+  }
+
+  void Dropped(const PacketRef &packet) {
+    if (m_flight)
+      m_flight->Add(TscNow(), FLIGHT_FILTER_DROP, int32_t(packet->payload.size()), packet->seq);
+    TRANSMIT_PROBE(filter_drop, 0, packet->seq, packet->payload.size());
+  }
+
+  unique_ptr<StageStats> m_stages; //< With -stages
+  unique_ptr<FlightRecorder> m_flight; //< With -flight
+  uint64_t m_packets = 0;
+  uint64_t m_read_seq = 0;
+
+  bool Process(MediaPacket &packet) {
+    bool pass = m_filters.Process(packet);
+    if (m_stages)
+      m_stages->Mark(STAGE_FILTER);
+    return pass;
+  }
+
+  // Packets filtered on the task pool; delivered in the order of reading,
+  // whichever worker finishes first.
+  struct Batch {
+    vector<PacketRef> packets;
+    vector<char> pass;
+    std::future<void> done;
+  };
+  unique_ptr<Batch> m_batch;
+  deque<unique_ptr<Batch>> m_inflight;
+
+  void Submit() {
+    Batch *b = m_batch.get();
+    auto done = std::make_shared<std::promise<void>>();
+    b->done = done->get_future();
+    b->pass.resize(b->packets.size());
+    FilterChain &filters = m_filters;
+    m_cfg.workers->Submit([b, done, &filters] {
+      try {
+        for (size_t i = 0; i < b->packets.size(); ++i)
+          b->pass[i] = filters.Process(*b->packets[i]);
+        done->set_value();
+      } catch (...) {
+        done->set_exception(std::current_exception());
+      }
+    });
+    m_inflight.push_back(std::move(m_batch));
+  }
+
+  // Delivers the batches already filtered, waiting for the oldest ones
+  // while more than keep are in flight.
+  void DeliverFiltered(size_t keep) {
+    while (!m_inflight.empty()) {
+      Batch &b = *m_inflight.front();
+      if (m_inflight.size() <= keep
+          && b.done.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return;
+      b.done.get();
+      for (size_t i = 0; i < b.packets.size(); ++i) {
+        if (m_stages) {
+          // From the hand-off: waiting for a worker and filtering
+          uint64_t now = TscNow();
+          m_stages->Add(STAGE_FILTER, b.packets[i]->stamp, now);
+          m_stages->Begin(now);
+        }
+        if (b.pass[i])
+          Deliver(b.packets[i]);
+        else
+          Dropped(b.packets[i]);
+      }
+      m_inflight.pop_front();
+    }
+  }
+
+  void Offload(PacketRef &&packet) {
+    if (!m_batch)
+      m_batch.reset(new Batch);
+    if (m_stages)
+      packet->stamp = m_stages->Cursor();
+    m_batch->packets.push_back(std::move(packet));
+    if (m_batch->packets.size() >= m_cfg.filter_batch)
+      Submit();
+    // Two batches per worker keep them busy while the oldest is delivered.
+    DeliverFiltered(2 * m_cfg.workers->Size());
+  }
+
+ public:
+  Pipeline(SourceT &src, TargetT &tar, PacketPool &pool, FilterChain &filters,
+           const PipelineConfig &cfg)
+      : m_src(src), m_tar(tar), m_pool(pool), m_filters(filters), m_cfg(cfg) {
+    if (stage_stats) {
+      m_stages.reset(new StageStats);
+      if (SrtTarget *t = dynamic_cast<SrtTarget *>(&m_tar))
+        t->TrackStages(m_stages.get());
+    }
+    m_flight = NewFlightRecorder(0);
+    AttachRecorder(m_src, m_flight.get());
+    AttachRecorder(m_tar, m_flight.get());
+  }
+
+  // The workers may still be filtering batches left on an error.
+  ~Pipeline() {
+    for (auto &b: m_inflight)
+      b->done.wait();
+    if (SrtTarget *t = dynamic_cast<SrtTarget *>(&m_tar))
+      t->TrackStages(nullptr);
+    AttachRecorder(m_src, nullptr);
+    AttachRecorder(m_tar, nullptr);
+  }
+
+  // Leaves the last packets in a file when the transmission fails.
+  void Run() {
+    try {
+      Transmit();
+    } catch (std::exception &x) {
+      if (!int_state)
+        DumpFlight(m_flight.get(), x.what());
+      throw;
+    }
+    if (m_tar.Broken())
+      DumpFlight(m_flight.get(), "output broken");
+  }
+
+ private:
+  void Transmit() {
+    // Now loop until broken
+    BandwidthGuard bw(m_cfg.bandwidth);
+    const bool filtering = !m_filters.empty();
+    const bool offload = filtering && m_cfg.workers;
+    vector<PacketRef> batch;
+    bool done = false;
+
+    while (!done) {
+      if (m_cfg.timeout != -1) {
+        alarm(m_cfg.timeout);
+      }
+      batch.clear();
+      uint64_t read_begin = m_stages ? TscNow() : 0;
+      m_src.ReadBatch(m_cfg.chunk, READ_BATCH, m_pool, batch);
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      uint64_t read_end = m_stages || m_flight ? TscNow() : 0;
+      if (m_stages)
+        m_stages->Begin(read_end);
+
+      for (PacketRef &packet: batch) {
+        packet->ingest_time = now;
+        packet->stamp = read_end;
+        packet->seq = m_read_seq++;
+        if (m_flight)
+          m_flight->Add(read_end, FLIGHT_READ, int32_t(packet->payload.size()), packet->seq);
+        TRANSMIT_PROBE(packet_read, 0, packet->seq, packet->payload.size(), packet->IngestNs());
+        if (m_stages) {
+          m_stages->Add(STAGE_READ, read_begin, read_end);
+          m_stages->Add(STAGE_QUEUE, read_end, m_stages->Cursor());
+        }
+        const bytevector &data = packet->payload;
+        if (transmit_verbose)
+          cout << " << " << data.size() << "  ->  ";
+        if (data.empty() && m_src.End()) {
+          if (transmit_verbose)
+            cout << "EOS\n";
+          done = true;
+          break;
+        }
+        if (offload)
+          Offload(std::move(packet));
+        else if (!filtering || Process(*packet))
+          Deliver(packet);
+        else
+          Dropped(packet);
+        if (transmit_verbose)
+          cout << " sent\n";
+        if (int_state) {
+          cerr << "\n (interrupted on request)\n";
+          done = true;
+          break;
+        }
+
+        bw.Checkpoint(m_cfg.chunk, bw_report);
+        if (m_stages) {
+          if (m_cfg.bandwidth)
+            m_stages->Mark(STAGE_PACE);
+          if (stats_report_freq && ++m_packets % stats_report_freq == 0)
+            m_stages->Print(cout, "pipeline");
+        }
+      }
+      // A short batch means the source has nothing more at hand, and the
+      // next read may block for long: the packets held for filtering go
+      // out now rather than wait for the input to resume.
+      if (offload && !done && batch.size() < READ_BATCH) {
+        if (m_batch)
+          Submit();
+        DeliverFiltered(0);
+      }
+      // Once per batch: a write to an output that broke in the middle
+      // of it fails and throws anyway.
+      if (!done && m_tar.Broken()) {
+        if (transmit_verbose)
+          cout << " OUTPUT broken\n";
+        done = true;
+      }
+      m_tar.Flush();
+      if (m_cfg.timeout != -1) {
+        alarm(0);
+      }
+    }
+
+    if (offload && !m_tar.Broken()) {
+      if (m_batch)
+        Submit();
+      DeliverFiltered(0);
+      m_tar.Flush();
+    }
+
+    if (m_stages && (transmit_verbose || stats_report_freq))
+      m_stages->Print(cout, "pipeline");
+  }
+};
+
+template<class SourceT, class TargetT>
+void RunWith(SourceT &src, TargetT &tar, PacketPool &pool, FilterChain &filters,
+             const PipelineConfig &cfg) {
+  if (transmit_verbose)
+    cout << "PIPELINE: " << typeid(SourceT).name() << " -> " << typeid(TargetT).name() << endl;
+  Pipeline<SourceT, TargetT>(src, tar, pool, filters, cfg).Run();
+}
+
+template<class SourceT>
+void RunForTarget(SourceT &src, Target &tar, PacketPool &pool, FilterChain &filters,
+                  const PipelineConfig &cfg) {
+  if (SrtTarget *t = dynamic_cast<SrtTarget *>(&tar))
+    return RunWith(src, *t, pool, filters, cfg);
+  if (UdpTarget *t = dynamic_cast<UdpTarget *>(&tar))
+    return RunWith(src, *t, pool, filters, cfg);
+  if (FileTarget *t = dynamic_cast<FileTarget *>(&tar))
+    return RunWith(src, *t, pool, filters, cfg);
+  if (ConsoleTarget *t = dynamic_cast<ConsoleTarget *>(&tar))
+    return RunWith(src, *t, pool, filters, cfg);
+  if (TeeTarget *t = dynamic_cast<TeeTarget *>(&tar))
+    return RunWith(src, *t, pool, filters, cfg);
+  RunWith(src, tar, pool, filters, cfg);
+}
+
+const size_t SPLICE_BLOCK = 1024 * 1024;
+
+static bool IsPipe(int fd) {
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// Moves up to size bytes from in to out inside the kernel. splice() needs
+// a pipe on one side, so between two files the data go through one.
+// Returns the bytes moved, 0 at the end of input, -1 on failure; with
+// EAGAIN, blocked is the descriptor to wait for.
+static ssize_t SpliceOnce(int in, int out, int (&via)[2], size_t size, int &blocked) {
+  const unsigned flags = SPLICE_F_MOVE | SPLICE_F_MORE;
+  if (via[0] == -1) {
+    ssize_t n = splice(in, NULL, out, NULL, size, flags);
+    if (n == -1 && errno == EAGAIN) {
+      // Either side may be the one not ready: the output, if it can't take more.
+      pollfd pfd = {out, POLLOUT, 0};
+      blocked = poll(&pfd, 1, 0) == 1 ? in : out;
+      errno = EAGAIN;
+    }
+    return n;
+  }
+
+  blocked = in;
+  ssize_t n = splice(in, NULL, via[1], NULL, size, flags);
+  // What is in the pipe can't be given back to the input, so it must
+  // all go out, even to a non-blocking output that is full now.
+  for (ssize_t left = n; left > 0;) {
+    ssize_t m = splice(via[0], NULL, out, NULL, left, flags);
+    if (m == -1 && errno == EAGAIN) {
+      WaitFd(out, POLLOUT);
+      continue;
+    }
+    if (m == -1 && errno == EINTR)
+      continue;
+    if (m <= 0)
+      return -1;
+    left -= m;
+  }
+  return n;
+}
+
+// Relays a byte stream between descriptors without copying it through
+// user space. Returns false, having moved nothing, if the kernel can't
+// splice these descriptors (e.g. a terminal), so that the caller falls
+// back to the pipeline.
+static bool Splice(int in, int out, const PipelineConfig &cfg) {
+  int via[2] = {-1, -1};
+  if (!IsPipe(in) && !IsPipe(out) && pipe(via) == -1)
+    return false;
+  struct ViaCleanup {
+    int *fds;
+    ~ViaCleanup() {
+      if (fds[0] != -1) {
+        close(fds[0]);
+        close(fds[1]);
+      }
+    }
+  } cleanup{via};
+
+  bool started = false;
+  for (;;) {
+    if (cfg.timeout != -1)
+      alarm(cfg.timeout);
+    ::throw_on_interrupt = true;
+    int blocked = in;
+    ssize_t n = SpliceOnce(in, out, via, SPLICE_BLOCK, blocked);
+    ::throw_on_interrupt = false;
+    if (cfg.timeout != -1)
+      alarm(0);
+
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        WaitFd(blocked, blocked == out ? POLLOUT : POLLIN);
+        continue;
+      }
+      if (!started && (errno == EINVAL || errno == ENOSYS))
+        return false;
+      perror("splice");
+      return true;
+    }
+    if (!started && transmit_verbose)
+      cout << "PIPELINE: splice " << in << " -> " << out << endl;
+    started = true;
+    if (n == 0 || int_state)
+      return true;
+  }
+}
+
+void RunPipeline(Source &src, Target &tar, PacketPool &pool, FilterChain &filters,
+                 const PipelineConfig &cfg) {
+  // Plain byte relay: nothing to look at in user space.
+  BlockSource *bs = dynamic_cast<BlockSource *>(&src);
+  FdTarget *ft = dynamic_cast<FdTarget *>(&tar);
+  if (bs && ft && filters.empty() && !cfg.bandwidth && !cfg.generic
+      && Splice(bs->Descriptor(), ft->Descriptor(), cfg))
+    return;
+
+  if (cfg.generic)
+    return RunWith(src, tar, pool, filters, cfg);
+
+  if (SrtSource *s = dynamic_cast<SrtSource *>(&src))
+    return RunForTarget(*s, tar, pool, filters, cfg);
+  if (UdpSource *s = dynamic_cast<UdpSource *>(&src))
+    return RunForTarget(*s, tar, pool, filters, cfg);
+  if (FileSource *s = dynamic_cast<FileSource *>(&src))
+    return RunForTarget(*s, tar, pool, filters, cfg);
+  if (ConsoleSource *s = dynamic_cast<ConsoleSource *>(&src))
+    return RunForTarget(*s, tar, pool, filters, cfg);
+  RunForTarget(src, tar, pool, filters, cfg);
+}
+
 void TestLogHandler(void *opaque,
                     int level,
                     const char *file,
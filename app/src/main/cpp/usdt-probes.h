@@ -0,0 +1,48 @@
+#ifndef USDT_PROBES_H
+#define USDT_PROBES_H
+
+// Statically defined tracepoints (USDT) on the data path, so that a
+// running channel can be traced with perf or bpftrace, e.g.
+//
+//   bpftrace -e 'usdt:./srt-transmit:srt_transmit:srt_send { @[arg1 < 0] = count(); }'
+//
+// A probe is a single nop in the code until a tracer attaches to it, and
+// its arguments are only integers already at hand. They exist only when
+// built with systemtap's <sys/sdt.h> on the include path (the NDK has
+// none); otherwise, or with -DTRANSMIT_NO_PROBES, they compile to nothing.
+//
+// Probes of the provider srt_transmit, and their arguments:
+//
+//   packet_read      route, seq, size, ingest time [ns, steady clock]
+//   packet_write     route, seq, size, ingest time
+//   filter_drop      route, seq, size
+//   srt_recv         socket, result, packet sequence, message number
+//   srt_send         socket, result, size, message number
+//   srt_drop         socket, drop reason, size
+//   srt_connect      socket, mode (0 caller, 1 listener, 2 rendezvous)
+//   srt_close        socket
+//   stats_sample     socket, buffered [ms], lost total, dropped total, bandwidth [kbps]
+//   udp_kernel_drop  socket, dropped in the last second, dropped total
+//   jni_connect      socket, result
+//   jni_send         socket, packet number, size, result
+//
+// The route is 0 for the single pipeline and the line number of the
+// route in the -routes file otherwise.
+
+#if !defined(TRANSMIT_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRANSMIT_PROBES 1
+#endif
+#endif
+
+#ifdef TRANSMIT_PROBES
+#define TRANSMIT_PROBE(name, ...) STAP_PROBEV(srt_transmit, name, __VA_ARGS__)
+#else
+// The arguments still count as used, but are never evaluated.
+template<class... Args>
+inline void TransmitProbeArgs(const Args &...) {}
+#define TRANSMIT_PROBE(name, ...) do { if (false) TransmitProbeArgs(__VA_ARGS__); } while (0)
+#endif
+
+#endif // USDT_PROBES_H
@@ -2,6 +2,7 @@ package com.example.srttest;
 
 import android.app.Activity;
 import android.os.Bundle;
+import android.util.Log;
 import android.widget.TextView;
 
 public class MainActivity extends Activity {
@@ -16,6 +17,20 @@ public class MainActivity extends Activity {
 
   public native String stringFromJNI();
 
+  // Hands encoded packets to a transmit process reading shm://<path>, e.g.
+  // a file in getCacheDir(). shmOpen returns 0 if no reader created the
+  // ring in time; shmWrite returns 0 when written, 1 when the ring stayed
+  // full for timeoutMs and -1 when the reader has gone.
+  public native long shmOpen(String path, int timeoutMs);
+  public native int shmWrite(long ring, byte[] data, int length, int timeoutMs);
+  public native void shmClose(long ring);
+
+  // Called by the native sender when the uplink starts saturating or clears
+  // up again; state is 0 (clear), 1 (loaded) or 2 (congested).
+  public void onTargetBitrate(long bitrate, int state) {
+    Log.d("SRTClient", "Recommended bitrate: " + bitrate + " (state " + state + ")");
+  }
+
   static {
     System.loadLibrary("native-lib");
   }
@@ -0,0 +1,192 @@
+// Feeds a CongestionMonitor synthetic CBytePerfMon samples on a made-up
+// clock and checks the signals it reports.
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "srt/srt.h"
+#include "congestion-monitor.h"
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                    \
+    }                                                                \
+  } while (0)
+
+const int64_t MAX_BITRATE = 10000000;
+const int LATENCY_MS = 120;
+
+// A sender whose statistics only move as the test says, 1000 packets
+// per sample unless told otherwise.
+class Sender {
+  CBytePerfMon m_perf;
+  CongestionMonitor::time_point m_now;
+
+ public:
+  std::vector<CongestionSignal> signals;
+  CongestionMonitor monitor;
+
+  Sender()
+      : m_now(std::chrono::steady_clock::now()),
+        monitor(MAX_BITRATE, LATENCY_MS,
+                [this](const CongestionSignal &sig) { signals.push_back(sig); }) {
+    memset(&m_perf, 0, sizeof m_perf);
+    m_perf.mbpsBandwidth = 100;
+    m_perf.msSndBuf = 10;
+    monitor.Update(m_perf, m_now); // Only primes it
+  }
+
+  CBytePerfMon &Perf() { return m_perf; }
+
+  // Takes the next sample after ms, with the counters advanced.
+  void Sample(int ms, int snd_buf, int losses = 0, int drops = 0, int sent = 1000) {
+    m_now += std::chrono::milliseconds(ms);
+    m_perf.msSndBuf = snd_buf;
+    m_perf.pktSentTotal += sent;
+    m_perf.pktSndLossTotal += losses;
+    m_perf.pktSndDropTotal += drops;
+    monitor.Update(m_perf, m_now);
+  }
+};
+
+void TestPriming() {
+  Sender s;
+  CHECK(s.signals.empty());
+  CHECK(s.monitor.TargetBitrate() == MAX_BITRATE);
+}
+
+// A sender buffer filling up over a quarter of the latency.
+void TestLoadedByBuffer() {
+  Sender s;
+  s.Sample(1000, 40);
+  CHECK(s.signals.size() == 1);
+  CHECK(s.signals[0].state == CongestionSignal::LOADED);
+  CHECK(s.signals[0].target_bitrate == MAX_BITRATE * 85 / 100);
+  CHECK(s.signals[0].ms_snd_buf == 40);
+  CHECK(s.monitor.TargetBitrate() == MAX_BITRATE * 85 / 100);
+
+  // Full, but no longer rising: nothing to report.
+  s.Sample(1000, 40);
+  CHECK(s.signals.size() == 1);
+}
+
+// Over 2% of the sent packets lost; exactly 2% is still clear.
+void TestLoadedByLoss() {
+  Sender s;
+  s.Sample(1000, 10, 20);
+  CHECK(s.signals.empty());
+  s.Sample(1000, 10, 21);
+  CHECK(s.signals.size() == 1);
+  CHECK(s.signals[0].state == CongestionSignal::LOADED);
+  CHECK(s.signals[0].snd_losses == 21);
+}
+
+// Loaded never goes over 80% of the estimated bandwidth.
+void TestLoadedCapacity() {
+  Sender s;
+  s.Perf().mbpsBandwidth = 5;
+  s.Sample(1000, 40);
+  CHECK(s.signals.size() == 1);
+  CHECK(s.signals[0].target_bitrate == 4000000);
+}
+
+// Any drop cuts the bitrate by 30%, down to a tenth of the maximum.
+void TestCongested() {
+  Sender s;
+  s.Sample(1000, 10, 0, 1);
+  CHECK(s.signals.size() == 1);
+  CHECK(s.signals[0].state == CongestionSignal::CONGESTED);
+  CHECK(s.signals[0].snd_drops == 1);
+  CHECK(s.signals[0].target_bitrate == MAX_BITRATE * 7 / 10);
+
+  for (int i = 0; i < 10; ++i)
+    s.Sample(1000, 10, 0, 5);
+  CHECK(s.monitor.TargetBitrate() == MAX_BITRATE / 10);
+  // Staying at the floor is no change, so it isn't reported again.
+  size_t at_floor = s.signals.size();
+  s.Sample(1000, 10, 0, 5);
+  CHECK(s.signals.size() == at_floor);
+}
+
+// Four clear samples in a row probe up by 5% of the maximum.
+void TestClearProbesUp() {
+  Sender s;
+  s.Sample(1000, 40);
+  CHECK(s.signals.size() == 1);
+  int64_t loaded = s.signals[0].target_bitrate;
+
+  for (int i = 0; i < 3; ++i)
+    s.Sample(1000, 10);
+  CHECK(s.signals.size() == 1);
+  s.Sample(1000, 10);
+  CHECK(s.signals.size() == 2);
+  CHECK(s.signals[1].state == CongestionSignal::CLEAR);
+  CHECK(s.signals[1].target_bitrate == loaded + MAX_BITRATE / 20);
+
+  // Never over the maximum.
+  for (int i = 0; i < 40; ++i)
+    s.Sample(1000, 10);
+  CHECK(s.monitor.TargetBitrate() == MAX_BITRATE);
+  CHECK(s.signals.back().target_bitrate == MAX_BITRATE);
+}
+
+// Changes closer than 500ms to the last report are held back; the
+// recommendation then stays as it was reported.
+void TestRateLimit() {
+  Sender s;
+  s.Sample(1000, 40);
+  CHECK(s.signals.size() == 1);
+  int64_t first = s.signals[0].target_bitrate;
+
+  s.Sample(100, 50);
+  CHECK(s.signals.size() == 1);
+  CHECK(s.monitor.TargetBitrate() == first);
+  s.Sample(399, 60);
+  CHECK(s.signals.size() == 1);
+
+  s.Sample(1, 70); // 500ms after the report
+  CHECK(s.signals.size() == 2);
+  CHECK(s.signals[1].state == CongestionSignal::LOADED);
+  CHECK(s.signals[1].target_bitrate == first * 85 / 100);
+}
+
+// Drops are reported at once, whenever the last report was.
+void TestUrgentBypass() {
+  Sender s;
+  s.Sample(1000, 40);
+  CHECK(s.signals.size() == 1);
+  int64_t loaded = s.signals[0].target_bitrate;
+
+  s.Sample(10, 40, 0, 2);
+  CHECK(s.signals.size() == 2);
+  CHECK(s.signals[1].state == CongestionSignal::CONGESTED);
+  CHECK(s.signals[1].target_bitrate == loaded * 7 / 10);
+
+  // And they restart the interval for what isn't urgent.
+  s.Sample(10, 80);
+  CHECK(s.signals.size() == 2);
+}
+
+} // namespace
+
+int main() {
+  TestPriming();
+  TestLoadedByBuffer();
+  TestLoadedByLoss();
+  TestLoadedCapacity();
+  TestCongested();
+  TestClearProbesUp();
+  TestRateLimit();
+  TestUrgentBypass();
+  if (failures)
+    fprintf(stderr, "%d checks failed\n", failures);
+  return failures ? 1 : 0;
+}
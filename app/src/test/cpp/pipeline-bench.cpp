@@ -0,0 +1,114 @@
+// Cost per packet of the transmission loop, run generic (virtual calls
+// through Source and Target, as with -pipeline:generic) and specialized
+// for final media types (as for SrtSource or UdpTarget). The media here
+// do as little as possible, so that the difference is the loop's own.
+//
+//   pipeline-bench [packets] [rounds]
+
+#define main transmit_main
+#include "transmit-lib.cpp"
+#undef main
+
+namespace {
+
+const size_t PAYLOAD = 1316;
+
+// Hands out the same payload until the count is reached, then an empty
+// read and End().
+class MemSource final: public Source {
+  bytevector m_payload;
+  size_t m_left;
+
+ public:
+  explicit MemSource(size_t packets) : m_payload(PAYLOAD, 0x47), m_left(packets) {}
+
+  void Read(size_t, bytevector &data) override {
+    if (!m_left) {
+      data.clear();
+      return;
+    }
+    --m_left;
+    data.assign(m_payload.begin(), m_payload.end());
+  }
+
+  void ReadBatch(size_t chunk, size_t max, PacketPool &pool, vector<PacketRef> &batch) override {
+    for (size_t n = 0; n < max; ++n) {
+      PacketRef packet = pool.Get();
+      Read(chunk, packet->payload);
+      bool last = packet->payload.empty();
+      batch.push_back(std::move(packet));
+      if (last)
+        break;
+    }
+  }
+
+  bool IsOpen() override { return true; }
+  bool End() override { return !m_left; }
+};
+
+class NullTarget final: public Target {
+ public:
+  size_t bytes = 0;
+
+  void Write(const bytevector &data) override { bytes += data.size(); }
+  void Write(const PacketRef &packet) override { bytes += packet->payload.size(); }
+  bool IsOpen() override { return true; }
+  bool Broken() override { return false; }
+};
+
+} // namespace
+
+template<>
+struct TargetWrite<NullTarget> { static const WriteKind kind = WRITE_REF; };
+
+namespace {
+
+// Out of line, so that the compiler can't see the media types through
+// the references and devirtualize the generic run.
+__attribute__((noinline)) void RunGeneric(Source &src, Target &tar, PacketPool &pool,
+                                          FilterChain &filters, const PipelineConfig &cfg) {
+  RunWith(src, tar, pool, filters, cfg);
+}
+
+// Returns ns per packet.
+template<class Run>
+double Measure(size_t packets, Run run) {
+  using namespace std::chrono;
+  MemSource src(packets);
+  NullTarget tar;
+  PacketPool pool;
+  FilterChain filters("");
+  PipelineConfig cfg;
+  cfg.chunk = PAYLOAD;
+  steady_clock::time_point start = steady_clock::now();
+  run(src, tar, pool, filters, cfg);
+  double ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+  if (tar.bytes != packets * PAYLOAD)
+    throw runtime_error("pipeline-bench: packets lost");
+  return ns / packets;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  size_t packets = argc > 1 ? stoul(argv[1]) : 2000000;
+  int rounds = argc > 2 ? stoi(argv[2]) : 5;
+  // The loop alone, as with -stages:no -flight:0.
+  stage_stats = false;
+  flight_records = 0;
+
+  double generic = 1e9, specialized = 1e9;
+  for (int r = 0; r < rounds; ++r) {
+    generic = min(generic, Measure(packets, [](MemSource &s, NullTarget &t, PacketPool &p,
+                                               FilterChain &f, const PipelineConfig &c) {
+      RunGeneric(s, t, p, f, c);
+    }));
+    specialized = min(specialized, Measure(packets, [](MemSource &s, NullTarget &t, PacketPool &p,
+                                                       FilterChain &f, const PipelineConfig &c) {
+      RunWith(s, t, p, f, c);
+    }));
+  }
+  printf("generic:     %.1f ns/packet\n", generic);
+  printf("specialized: %.1f ns/packet (%.0f%%)\n", specialized, 100 * specialized / generic);
+  return 0;
+}
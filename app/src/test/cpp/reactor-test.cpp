@@ -0,0 +1,287 @@
+// Drives a Reactor over a fake srt_epoll, linked instead of libsrt. The
+// fake keeps libsrt 1.3 semantics: adding an SRT socket again doesn't
+// clear its old events, adding a system socket again fails with EEXIST,
+// and only the update calls replace the events. SRT sockets are made
+// ready by the test; system sockets are real descriptors, polled.
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <chrono>
+#include <future>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "srt/srt.h"
+#include "reactor.h"
+
+namespace {
+
+std::mutex fake_lock;
+std::map<int, int> usocks;        //< Events registered per SRT socket
+std::map<int, int> ssocks;        //< Events registered per system socket
+std::set<int> readable, writable; //< Fake SRT sockets that are ready
+int eexist_failures = 0;
+
+int UsockEvents(int u) {
+  std::lock_guard<std::mutex> lk(fake_lock);
+  return usocks.count(u) ? usocks[u] : 0;
+}
+
+int SsockEvents(int s) {
+  std::lock_guard<std::mutex> lk(fake_lock);
+  return ssocks.count(s) ? ssocks[s] : 0;
+}
+
+void SetReady(int u, bool read, bool write) {
+  std::lock_guard<std::mutex> lk(fake_lock);
+  if (read)
+    readable.insert(u);
+  else
+    readable.erase(u);
+  if (write)
+    writable.insert(u);
+  else
+    writable.erase(u);
+}
+
+} // namespace
+
+extern "C" {
+
+int srt_epoll_create(void) { return 1; }
+int srt_epoll_release(int) { return 0; }
+
+int srt_epoll_add_usock(int, SRTSOCKET u, const int *events) {
+  std::lock_guard<std::mutex> lk(fake_lock);
+  usocks[u] |= *events;
+  return 0;
+}
+
+int srt_epoll_add_ssock(int, SYSSOCKET s, const int *events) {
+  std::lock_guard<std::mutex> lk(fake_lock);
+  if (ssocks.count(s)) {
+    ++eexist_failures;
+    errno = EEXIST;
+    return -1;
+  }
+  ssocks[s] = *events;
+  return 0;
+}
+
+int srt_epoll_update_usock(int, SRTSOCKET u, const int *events) {
+  std::lock_guard<std::mutex> lk(fake_lock);
+  usocks[u] = *events;
+  return 0;
+}
+
+int srt_epoll_update_ssock(int, SYSSOCKET s, const int *events) {
+  std::lock_guard<std::mutex> lk(fake_lock);
+  ssocks[s] = *events;
+  return 0;
+}
+
+int srt_epoll_remove_usock(int, SRTSOCKET u) {
+  std::lock_guard<std::mutex> lk(fake_lock);
+  usocks.erase(u);
+  return 0;
+}
+
+int srt_epoll_remove_ssock(int, SYSSOCKET s) {
+  std::lock_guard<std::mutex> lk(fake_lock);
+  ssocks.erase(s);
+  return 0;
+}
+
+// Checks every millisecond until something is ready or the time is up.
+int srt_epoll_wait(int, SRTSOCKET *rd, int *rnum, SRTSOCKET *wr, int *wnum, int64_t timeout,
+                   SYSSOCKET *lrd, int *lrnum, SYSSOCKET *lwr, int *lwnum) {
+  auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  for (;;) {
+    int nr = 0, nw = 0, nlr = 0, nlw = 0;
+    std::vector<pollfd> fds;
+    {
+      std::lock_guard<std::mutex> lk(fake_lock);
+      for (auto &u: usocks) {
+        if ((u.second & SRT_EPOLL_IN) && readable.count(u.first) && nr < *rnum)
+          rd[nr++] = u.first;
+        if ((u.second & SRT_EPOLL_OUT) && writable.count(u.first) && nw < *wnum)
+          wr[nw++] = u.first;
+      }
+      for (auto &s: ssocks) {
+        pollfd p = {s.first, 0, 0};
+        p.events = short(((s.second & SRT_EPOLL_IN) ? POLLIN : 0)
+                         | ((s.second & SRT_EPOLL_OUT) ? POLLOUT : 0));
+        fds.push_back(p);
+      }
+    }
+    if (!fds.empty() && poll(fds.data(), fds.size(), 0) > 0) {
+      for (pollfd &p: fds) {
+        if ((p.revents & POLLIN) && nlr < *lrnum)
+          lrd[nlr++] = p.fd;
+        if ((p.revents & POLLOUT) && nlw < *lwnum)
+          lwr[nlw++] = p.fd;
+      }
+    }
+    if (nr + nw + nlr + nlw > 0 || std::chrono::steady_clock::now() >= until) {
+      *rnum = nr;
+      *wnum = nw;
+      *lrnum = nlr;
+      *lwnum = nlw;
+      return nr + nw + nlr + nlw > 0 ? nr + nw + nlr + nlw : -1;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+} // extern "C"
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                    \
+    }                                                                \
+  } while (0)
+
+const std::chrono::seconds PATIENCE(2);
+
+// Runs fn on the loop thread and waits for it.
+template<class Fn>
+void OnLoop(Reactor &reactor, Fn fn) {
+  std::promise<void> done;
+  reactor.Post([&] {
+    fn();
+    done.set_value();
+  });
+  done.get_future().wait();
+}
+
+bool Fired(std::future<void> &f) { return f.wait_for(PATIENCE) == std::future_status::ready; }
+
+// A continuation runs once when its SRT socket gets ready, and the
+// socket leaves the epoll set with it.
+void TestSrtReadiness() {
+  Reactor reactor;
+  const int u = 100;
+  std::promise<void> read;
+  std::future<void> fired = read.get_future();
+  OnLoop(reactor, [&] { reactor.WhenReady(PollHandle{true, u}, false, [&] { read.set_value(); }); });
+  CHECK(UsockEvents(u) == SRT_EPOLL_IN);
+
+  SetReady(u, true, false);
+  CHECK(Fired(fired));
+  OnLoop(reactor, [] {});
+  CHECK(UsockEvents(u) == 0);
+  SetReady(u, false, false);
+}
+
+// Waiting for writing too replaces the events of the SRT socket, and
+// firing one side leaves only the other.
+void TestSrtUpdate() {
+  Reactor reactor;
+  const int u = 101;
+  std::promise<void> read, write;
+  std::future<void> read_fired = read.get_future(), write_fired = write.get_future();
+  OnLoop(reactor, [&] {
+    reactor.WhenReady(PollHandle{true, u}, false, [&] { read.set_value(); });
+    reactor.WhenReady(PollHandle{true, u}, true, [&] { write.set_value(); });
+  });
+  CHECK(UsockEvents(u) == (SRT_EPOLL_IN | SRT_EPOLL_OUT));
+
+  SetReady(u, false, true);
+  CHECK(Fired(write_fired));
+  OnLoop(reactor, [] {});
+  // With add instead of update the OUT would stay, and the loop would
+  // spin on a socket that nobody waits to write to.
+  CHECK(UsockEvents(u) == SRT_EPOLL_IN);
+  CHECK(read_fired.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready);
+
+  SetReady(u, true, true);
+  CHECK(Fired(read_fired));
+  OnLoop(reactor, [] {});
+  CHECK(UsockEvents(u) == 0);
+  SetReady(u, false, false);
+}
+
+// A second wait on a system socket goes through update, not a second
+// add that fails with EEXIST and loses the new event.
+void TestSystemSocketUpdate() {
+  Reactor reactor;
+  int fd = eventfd(0, EFD_NONBLOCK);
+  int eexist_before = eexist_failures;
+  std::promise<void> read, write;
+  std::future<void> read_fired = read.get_future(), write_fired = write.get_future();
+  OnLoop(reactor, [&] {
+    reactor.WhenReady(PollHandle{false, fd}, false, [&] { read.set_value(); });
+    reactor.WhenReady(PollHandle{false, fd}, true, [&] { write.set_value(); });
+  });
+  CHECK(eexist_failures == eexist_before);
+
+  // An eventfd is always writable, and readable once written to.
+  CHECK(Fired(write_fired));
+  OnLoop(reactor, [] {});
+  CHECK(SsockEvents(fd) == SRT_EPOLL_IN);
+  CHECK(read_fired.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready);
+
+  uint64_t one = 1;
+  CHECK(::write(fd, &one, sizeof one) == sizeof one);
+  CHECK(Fired(read_fired));
+  OnLoop(reactor, [] {});
+  CHECK(SsockEvents(fd) == 0);
+  close(fd);
+}
+
+// Cancel drops both continuations; the socket may then be closed.
+void TestCancel() {
+  Reactor reactor;
+  const int u = 102;
+  bool ran = false;
+  OnLoop(reactor, [&] {
+    reactor.WhenReady(PollHandle{true, u}, false, [&] { ran = true; });
+    reactor.Cancel(PollHandle{true, u});
+  });
+  CHECK(UsockEvents(u) == 0);
+  SetReady(u, true, false);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  OnLoop(reactor, [] {});
+  CHECK(!ran);
+  SetReady(u, false, false);
+}
+
+// Posted tasks run on the loop thread, in order, and see it as current.
+void TestPost() {
+  bool setup_ran = false;
+  Reactor reactor(-1, [&] { setup_ran = true; });
+  std::vector<int> order;
+  Reactor *seen = nullptr;
+  for (int i = 0; i < 3; ++i)
+    reactor.Post([&order, i] { order.push_back(i); });
+  OnLoop(reactor, [&] { seen = Reactor::Current(); });
+  CHECK(setup_ran);
+  CHECK(seen == &reactor);
+  CHECK((order == std::vector<int>{0, 1, 2}));
+  CHECK(Reactor::Current() == nullptr);
+}
+
+} // namespace
+
+int main() {
+  TestSrtReadiness();
+  TestSrtUpdate();
+  TestSystemSocketUpdate();
+  TestCancel();
+  TestPost();
+  if (failures)
+    fprintf(stderr, "%d checks failed\n", failures);
+  return failures ? 1 : 0;
+}
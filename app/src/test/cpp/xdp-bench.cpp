@@ -0,0 +1,228 @@
+// AF_XDP against the socket path on a veth pair: how many 1316-byte
+// datagrams a sender gets out, and how many a receiver takes in, while
+// an AF_XDP sender floods the pair. Both receivers copy each payload
+// out, as the media do. A veth delivers in the sender's context, so a
+// slower receive path shows as fewer datagrams sent rather than lost.
+// Needs root, and the pair set up as:
+//
+//   ip link add vx0 type veth peer name vx1
+//   ip addr add 10.77.0.1/24 dev vx0 && ip addr add 10.77.0.2/24 dev vx1
+//   ip link set vx0 up && ip link set vx1 up
+//   sysctl -w net.ipv4.conf.all.rp_filter=0 net.ipv4.conf.vx1.rp_filter=0 \
+//     net.ipv4.conf.vx1.accept_local=1
+//
+//   xdp-bench [tx-iface=vx0] [rx-iface=vx1] [port=4200] [seconds=3]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "af-xdp.h"
+
+#if !TRANSMIT_XDP
+#error "xdp-bench needs the AF_XDP headers of Linux 5.10 or later"
+#endif
+
+namespace {
+
+const size_t PAYLOAD = 1316;
+const size_t BATCH = 64;
+
+std::string tx_iface = "vx0", rx_iface = "vx1";
+int port = 4200;
+double seconds = 3;
+
+// Sends or receives until stop, returns the datagrams moved.
+typedef std::function<size_t(const std::atomic<bool> &stop)> Flow;
+
+// Runs the flow on a thread; the bench ends on any failure.
+std::thread Start(Flow flow, const std::atomic<bool> &stop, size_t &count) {
+  return std::thread([flow, &stop, &count]() {
+    try {
+      count = flow(stop);
+    } catch (std::exception &e) {
+      fprintf(stderr, "xdp-bench: %s\n", e.what());
+      exit(1);
+    }
+  });
+}
+
+size_t XdpSend(const std::atomic<bool> &stop) {
+  XdpSocket::Config cfg;
+  cfg.iface = tx_iface;
+  XdpSocket sock(cfg);
+  XdpEndpoint from, to;
+  XdpSocket::InterfaceMac(tx_iface, from.mac);
+  from.ip = XdpSocket::InterfaceAddress(tx_iface);
+  from.port = htons(uint16_t(port));
+  XdpSocket::InterfaceMac(rx_iface, to.mac);
+  to.ip = XdpSocket::InterfaceAddress(rx_iface);
+  to.port = htons(uint16_t(port));
+
+  std::vector<char> payload(PAYLOAD, 0x47);
+  size_t sent = 0;
+  while (!stop) {
+    for (size_t i = 0; i < BATCH; ++i) {
+      char *frame = sock.TxFrame();
+      if (!frame) {
+        sock.Wait(10);
+        break;
+      }
+      sock.Send(frame, XdpBuildUdp(frame, from, to, uint16_t(sent), payload.data(), PAYLOAD));
+      ++sent;
+    }
+    sock.Kick();
+  }
+  return sent;
+}
+
+size_t SocketSend(const std::atomic<bool> &stop) {
+  int s = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in to;
+  memset(&to, 0, sizeof to);
+  to.sin_family = AF_INET;
+  to.sin_port = htons(uint16_t(port));
+  to.sin_addr.s_addr = XdpSocket::InterfaceAddress(rx_iface);
+  // Out through the tx side, not over loopback.
+  setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE, tx_iface.c_str(), socklen_t(tx_iface.size()));
+
+  std::vector<char> payload(PAYLOAD, 0x47);
+  iovec iov[BATCH];
+  mmsghdr msgs[BATCH];
+  memset(msgs, 0, sizeof msgs);
+  for (size_t i = 0; i < BATCH; ++i) {
+    iov[i].iov_base = payload.data();
+    iov[i].iov_len = PAYLOAD;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &to;
+    msgs[i].msg_hdr.msg_namelen = sizeof to;
+  }
+  size_t sent = 0;
+  while (!stop) {
+    int n = sendmmsg(s, msgs, BATCH, 0);
+    if (n > 0)
+      sent += size_t(n);
+  }
+  close(s);
+  return sent;
+}
+
+// Where the payloads are copied to.
+struct Buffers {
+  std::vector<std::vector<char>> payloads;
+  size_t next = 0;
+
+  Buffers() : payloads(BATCH, std::vector<char>(2048)) {}
+  std::vector<char> &Next() { return payloads[next++ % BATCH]; }
+};
+
+Flow XdpReceive(bool skb) {
+  return [skb](const std::atomic<bool> &stop) {
+    XdpSocket::Config cfg;
+    cfg.iface = rx_iface;
+    cfg.rx_port = port;
+    cfg.skb_mode = skb;
+    XdpSocket sock(cfg);
+    Buffers buf;
+    size_t got = 0;
+    while (!stop) {
+      sock.Receive(BATCH, 10, [&](const char *frame, size_t len) {
+        size_t size;
+        if (const char *payload = XdpUdpPayload(frame, len, size)) {
+          buf.Next().assign(payload, payload + size);
+          ++got;
+        }
+      });
+    }
+    return got;
+  };
+}
+
+size_t SocketReceive(const std::atomic<bool> &stop) {
+  int s = socket(AF_INET, SOCK_DGRAM, 0);
+  int size = 8 << 20;
+  setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof size);
+  timeval tv = {0, 10000};
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  sockaddr_in sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(uint16_t(port));
+  sa.sin_addr.s_addr = XdpSocket::InterfaceAddress(rx_iface);
+  if (bind(s, reinterpret_cast<sockaddr *>(&sa), sizeof sa) == -1) {
+    perror("xdp-bench: bind");
+    exit(1);
+  }
+
+  Buffers buf;
+  iovec iov[BATCH];
+  mmsghdr msgs[BATCH];
+  memset(msgs, 0, sizeof msgs);
+  for (size_t i = 0; i < BATCH; ++i) {
+    iov[i].iov_base = buf.payloads[i].data();
+    iov[i].iov_len = buf.payloads[i].size();
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  size_t got = 0;
+  while (!stop) {
+    int n = recvmmsg(s, msgs, BATCH, MSG_WAITFORONE, nullptr);
+    if (n > 0)
+      got += size_t(n);
+  }
+  close(s);
+  return got;
+}
+
+// Runs the sender alone, or with a receiver started before it.
+void Run(const char *name, Flow send, Flow receive = Flow()) {
+  std::atomic<bool> stop_send{false}, stop_receive{false};
+  size_t got = 0;
+  std::thread rx;
+  if (receive) {
+    rx = Start(receive, stop_receive, got);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  }
+  size_t sent = 0;
+  std::thread tx = Start(send, stop_send, sent);
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  stop_send = true;
+  tx.join();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  stop_receive = true;
+  if (rx.joinable())
+    rx.join();
+
+  printf("%-24s sent %8.0f/s", name, sent / seconds);
+  if (receive)
+    printf(", received %8.0f/s (%.1f%% of sent)", got / seconds, sent ? 100.0 * got / sent : 0);
+  printf("\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    tx_iface = argv[1];
+  if (argc > 2)
+    rx_iface = argv[2];
+  if (argc > 3)
+    port = atoi(argv[3]);
+  if (argc > 4)
+    seconds = atof(argv[4]);
+
+  setvbuf(stdout, nullptr, _IONBF, 0);
+  Run("tx socket (sendmmsg)", SocketSend);
+  Run("tx xdp", XdpSend);
+  Run("rx socket (recvmmsg)", XdpSend, SocketReceive);
+  Run("rx xdp, generic hook", XdpSend, XdpReceive(true));
+  Run("rx xdp", XdpSend, XdpReceive(false));
+  return 0;
+}